@@ -16,34 +16,834 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
 #include "adf.h"
+#include "hash.h"
 
-static FILE *fp;
+static int open_mapped(int mode);
+static int open_memory(int mode);
+static void free_image(void);
+static int start_stream(void);
+static int finish_stream(void);
+static void stop_stream(void);
+static void *stream_writer(void *arg);
+static int write_all(int fd, const unsigned char *buf, int size);
+static unsigned char *build_extended(int *size);
+static int save_extended(unsigned char *buf, int size);
+static void free_raw(void);
+static void discard_output(void);
+static void gz_mode(char *modestr, int size);
+static int load_image(const char *fname, unsigned char *dest);
+static int is_compressed_name(const char *fname);
 
-int adf_open(const char *fname)
+/* the image is written to out_fname: the .part itself when it's mapped, or a
+ * new file next to it when it's compressed, which replaces the .part only
+ * when suspended, so that a resumed .part survives until then
+ */
+static char *dest_fname, *tmp_fname, *new_fname, *out_fname;
+static int fd = -1;
+static unsigned char *img;
+static int in_memory;	/* img is allocated, instead of mapping the .part file */
+static int resumed;		/* the .part file is from an earlier run */
+
+/* streaming output: a writer thread consumes the tracks in order, as soon as
+ * all tracks before them are final, while the rest of the disk is being read.
+ * It deflates them into compressed images, pipes them to stdout when the
+ * image name is "-", and hashes them.
+ */
+static int comp_level = -1;
+static int hashing;
+static int to_stdout, stream_fd = STDOUT_FILENO;
+static int streaming;
+static gzFile gzfp;
+static pthread_t stream_thread;
+static pthread_mutex_t stream_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stream_cond = PTHREAD_COND_INITIALIZER;
+static unsigned char trk_done[ADF_MAX_TRACKS];
+static int stream_abort, stream_error;
+
+static struct hash_ctx img_hash;
+static struct hash_result img_hashres, trk_hashres[ADF_MAX_TRACKS];
+static int hash_valid;
+
+/* tracks which can't be decoded as AmigaDOS are kept as raw MFM, and if there
+ * are any, the image is committed as an extended ADF (UAE-1ADF)
+ */
+#define EXT_HDR_SIZE		12
+#define EXT_TRKHDR_SIZE		12
+#define EXT_TYPE_DOS		0
+#define EXT_TYPE_RAW		1
+
+static unsigned char *raw_mfm[ADF_MAX_TRACKS];
+static int raw_bits[ADF_MAX_TRACKS];
+static int nraw;
+
+void adf_compression(int level)
+{
+	comp_level = level > 9 ? 9 : level;
+}
+
+void adf_hashing(int enable)
+{
+	hashing = enable;
+}
+
+void adf_stream_fd(int fd)
+{
+	stream_fd = fd;
+}
+
+int adf_open(const char *fname, int mode)
+{
+	int res;
+
+	if(img) return -1;
+
+	to_stdout = strcmp(fname, "-") == 0;
+	if(to_stdout && mode != ADF_NEW) {
+		fprintf(stderr, "can't resume or repair an image streamed to stdout\n");
+		return -1;
+	}
+
+	if(!(dest_fname = malloc(strlen(fname) * 3 + 16))) {
+		fprintf(stderr, "failed to allocate filename buffer\n");
+		return -1;
+	}
+	strcpy(dest_fname, fname);
+	tmp_fname = dest_fname + strlen(fname) + 1;
+	sprintf(tmp_fname, "%s.part", fname);
+	new_fname = tmp_fname + strlen(tmp_fname) + 1;
+	sprintf(new_fname, "%s.part.new", fname);
+	out_fname = tmp_fname;
+
+	hash_valid = 0;
+	resumed = mode == ADF_RESUME;
+
+	if(to_stdout || comp_level >= 0 || is_compressed_name(fname)) {
+		res = open_memory(mode);
+	} else {
+		res = open_mapped(mode);
+	}
+
+	if(res != -1 && (gzfp || to_stdout || hashing) && start_stream() == -1) {
+		if(gzfp) {
+			gzclose(gzfp);
+			gzfp = 0;
+		}
+		free_image();
+		discard_output();
+		res = -1;
+	}
+
+	if(res == -1) {
+		free(dest_fname);
+		dest_fname = tmp_fname = new_fname = out_fname = 0;
+	}
+	return res;
+}
+
+static int open_mapped(int mode)
+{
+	int err, oflags;
+
+	oflags = O_RDWR | O_CREAT;
+	if(mode == ADF_RESUME) {
+		oflags = O_RDWR;
+	} else if(mode == ADF_NEW) {
+		oflags |= O_TRUNC;
+	} else {
+		oflags |= O_EXCL;
+	}
+
+	if((fd = open(tmp_fname, oflags, 0666)) == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", tmp_fname, strerror(errno));
+		goto err;
+	}
+
+	/* preallocate the whole image, so that we won't run out of space halfway */
+	if((err = posix_fallocate(fd, 0, ADF_SIZE)) != 0) {
+		fprintf(stderr, "failed to allocate space for %s: %s\n", tmp_fname, strerror(err));
+		goto err;
+	}
+
+	if((img = mmap(0, ADF_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "failed to map %s: %s\n", tmp_fname, strerror(errno));
+		img = 0;
+		goto err;
+	}
+	in_memory = 0;
+
+	/* when repairing, start from the contents of the existing image */
+	if(mode == ADF_REPAIR && load_image(dest_fname, img) == -1) {
+		goto err;
+	}
+	return 0;
+
+err:
+	if(img) {
+		munmap(img, ADF_SIZE);
+		img = 0;
+	}
+	if(fd >= 0) {
+		close(fd);
+		fd = -1;
+		if(mode != ADF_RESUME) {
+			unlink(tmp_fname);
+		}
+	}
+	return -1;
+}
+
+/* compressed images and images streamed to stdout are kept in memory */
+static int open_memory(int mode)
+{
+	int ofd;
+	char modestr[8];
+
+	if(!(img = calloc(1, ADF_SIZE))) {
+		fprintf(stderr, "failed to allocate image buffer\n");
+		return -1;
+	}
+	in_memory = 1;
+
+	/* a partial compressed image is always complete, with zeros in place of
+	 * the missing sectors, so resuming means decompressing it back to memory
+	 */
+	if(mode == ADF_RESUME && load_image(tmp_fname, img) == -1) {
+		goto err;
+	}
+	if(mode == ADF_REPAIR) {
+		if(access(tmp_fname, F_OK) == 0) {
+			fprintf(stderr, "failed to open %s: %s\n", tmp_fname, strerror(EEXIST));
+			goto err;
+		}
+		if(load_image(dest_fname, img) == -1) {
+			goto err;
+		}
+	}
+
+	if(comp_level < 0 && !is_compressed_name(dest_fname)) {
+		return 0;	/* uncompressed, to stdout */
+	}
+
+	gz_mode(modestr, sizeof modestr);
+
+	if(to_stdout) {
+		if((ofd = dup(stream_fd)) == -1 || !(gzfp = gzdopen(ofd, modestr))) {
+			fprintf(stderr, "failed to open stdout for compressed output\n");
+			if(ofd >= 0) close(ofd);
+			goto err;
+		}
+	} else {
+		out_fname = new_fname;
+		if(!(gzfp = gzopen(out_fname, modestr))) {
+			fprintf(stderr, "failed to open %s for writing: %s\n", out_fname, strerror(errno));
+			goto err;
+		}
+	}
+	return 0;
+
+err:
+	free_image();
+	return -1;
+}
+
+static void free_image(void)
+{
+	if(!img) return;
+
+	if(in_memory) {
+		free(img);
+	} else {
+		munmap(img, ADF_SIZE);
+		close(fd);
+		fd = -1;
+	}
+	img = 0;
+}
+
+static int start_stream(void)
+{
+	memset(trk_done, 0, sizeof trk_done);
+	stream_abort = stream_error = 0;
+	if(hashing) {
+		hash_init(&img_hash);
+	}
+
+	if(pthread_create(&stream_thread, 0, stream_writer, 0) != 0) {
+		fprintf(stderr, "failed to start the image writer thread\n");
+		return -1;
+	}
+	streaming = 1;
+	return 0;
+}
+
+/* marks all tracks as final, and waits for the writer to consume them */
+static int finish_stream(void)
+{
+	int res = Z_OK;
+
+	pthread_mutex_lock(&stream_mutex);
+	memset(trk_done, 1, sizeof trk_done);
+	pthread_cond_signal(&stream_cond);
+	pthread_mutex_unlock(&stream_mutex);
+	pthread_join(stream_thread, 0);
+	streaming = 0;
+
+	if(gzfp) {
+		res = gzclose(gzfp);
+		gzfp = 0;
+	}
+
+	if(stream_error || res != Z_OK) {
+		fprintf(stderr, "failed to write image %s\n", to_stdout ? "to stdout" : out_fname);
+		return -1;
+	}
+	return 0;
+}
+
+static void stop_stream(void)
+{
+	pthread_mutex_lock(&stream_mutex);
+	stream_abort = 1;
+	pthread_cond_signal(&stream_cond);
+	pthread_mutex_unlock(&stream_mutex);
+	pthread_join(stream_thread, 0);
+	streaming = 0;
+
+	if(gzfp) {
+		gzclose(gzfp);
+		gzfp = 0;
+	}
+}
+
+static void *stream_writer(void *arg)
+{
+	int trk;
+	unsigned char *ptr;
+	struct hash_ctx trk_hash;
+
+	for(trk=0; trk<ADF_NUM_TRACKS; trk++) {
+		pthread_mutex_lock(&stream_mutex);
+		while(!trk_done[trk] && !stream_abort) {
+			pthread_cond_wait(&stream_cond, &stream_mutex);
+		}
+		pthread_mutex_unlock(&stream_mutex);
+		if(stream_abort) break;
+
+		ptr = img + trk * ADF_TRACK_SIZE;
+
+		if(hashing) {
+			hash_update(&img_hash, ptr, ADF_TRACK_SIZE);
+			hash_init(&trk_hash);
+			hash_update(&trk_hash, ptr, ADF_TRACK_SIZE);
+			hash_final(&trk_hash, trk_hashres + trk);
+		}
+
+		if(stream_error) continue;
+		if(gzfp) {
+			if(gzwrite(gzfp, ptr, ADF_TRACK_SIZE) != ADF_TRACK_SIZE) {
+				stream_error = 1;
+			}
+		} else if(to_stdout) {
+			if(write_all(stream_fd, ptr, ADF_TRACK_SIZE) == -1) {
+				stream_error = 1;
+			}
+		}
+	}
+
+	if(hashing && trk >= ADF_NUM_TRACKS) {
+		hash_final(&img_hash, &img_hashres);
+		hash_valid = 1;
+	}
+	return 0;
+}
+
+static int write_all(int fd, const unsigned char *buf, int size)
+{
+	int res;
+
+	while(size > 0) {
+		if((res = write(fd, buf, size)) == -1) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		buf += res;
+		size -= res;
+	}
+	return 0;
+}
+
+void adf_track_done(int trk)
+{
+	if(!streaming || trk < 0 || trk >= ADF_NUM_TRACKS) return;
+
+	pthread_mutex_lock(&stream_mutex);
+	trk_done[trk] = 1;
+	pthread_cond_signal(&stream_cond);
+	pthread_mutex_unlock(&stream_mutex);
+}
+
+int adf_commit(void)
+{
+	int extsize;
+	unsigned char *ext = 0;
+
+	if(!img) return -1;
+
+	if(streaming && finish_stream() == -1) {
+		return -1;
+	}
+	if(!in_memory && msync(img, ADF_SIZE, MS_SYNC) == -1) {
+		fprintf(stderr, "failed to flush %s: %s\n", tmp_fname, strerror(errno));
+		return -1;
+	}
+
+	if(nraw) {
+		if(to_stdout) {
+			fprintf(stderr, "warning: %d non-DOS tracks can't be streamed, they are left empty\n", nraw);
+		} else if(!(ext = build_extended(&extsize))) {
+			return -1;
+		}
+	}
+	free_image();
+	free_raw();
+
+	if(to_stdout) return 0;
+
+	/* rewrite the temporary image in the extended format, now that it's unmapped */
+	if(ext) {
+		int res = save_extended(ext, extsize);
+		free(ext);
+		if(res == -1) {
+			discard_output();
+			return -1;
+		}
+	}
+
+	if(rename(out_fname, dest_fname) == -1) {
+		fprintf(stderr, "failed to rename %s to %s: %s\n", out_fname, dest_fname, strerror(errno));
+		discard_output();
+		return -1;
+	}
+	if(out_fname != tmp_fname && resumed) {
+		unlink(tmp_fname);
+	}
+	return 0;
+}
+
+int adf_suspend(void)
 {
-	if(fp) return -1;
+	if(!img) return -1;
 
-	if(!(fp = fopen(fname, "wb"))) {
-		fprintf(stderr, "failed to open %s for writing: %s\n", fname, strerror(errno));
+	if(to_stdout) {
+		fprintf(stderr, "can't keep a partial image streamed to stdout\n");
 		return -1;
 	}
 
+	if(gzfp) {
+		/* the rest of the compressed image is written out with the missing
+		 * sectors zeroed, there's no way to leave gaps in it
+		 */
+		if(finish_stream() == -1) {
+			return -1;
+		}
+		if(rename(out_fname, tmp_fname) == -1) {
+			fprintf(stderr, "failed to rename %s to %s: %s\n", out_fname, tmp_fname, strerror(errno));
+			return -1;
+		}
+	} else {
+		if(streaming) {
+			stop_stream();
+		}
+		if(msync(img, ADF_SIZE, MS_SYNC) == -1) {
+			fprintf(stderr, "failed to flush %s: %s\n", tmp_fname, strerror(errno));
+			return -1;
+		}
+	}
+	hash_valid = 0;
+	free_image();
 	return 0;
 }
 
 void adf_close(void)
 {
-	if(fp) {
-		fclose(fp);
-		fp = 0;
+	/* a resumed partial image holds the sectors of the earlier runs, keep it */
+	if(img && resumed) {
+		adf_suspend();
+	}
+	if(streaming) {
+		stop_stream();
+	}
+
+	if(img) {
+		/* never committed or suspended, discard the partial image */
+		free_image();
+		discard_output();
+	}
+	free_raw();
+	free(dest_fname);
+	dest_fname = tmp_fname = new_fname = out_fname = 0;
+}
+
+/* removes the image being written, unless it's a resumed .part */
+static void discard_output(void)
+{
+	if(!to_stdout && (out_fname != tmp_fname || !resumed)) {
+		unlink(out_fname);
+	}
+}
+
+unsigned char *adf_track(int trk)
+{
+	if(!img || trk < 0 || trk >= ADF_NUM_TRACKS) return 0;
+	return img + trk * ADF_TRACK_SIZE;
+}
+
+unsigned char *adf_sector(int trk, int sec)
+{
+	unsigned char *ptr;
+
+	if(!(ptr = adf_track(trk)) || sec < 0 || sec >= ADF_TRACK_SECTORS) {
+		return 0;
+	}
+	return ptr + sec * ADF_SECTOR_SIZE;
+}
+
+int adf_write_track(int trk, void *trackbuf)
+{
+	unsigned char *ptr;
+
+	if(!(ptr = adf_track(trk))) return -1;
+	memcpy(ptr, trackbuf, ADF_TRACK_SIZE);
+	adf_track_done(trk);
+	return 0;
+}
+
+int adf_raw_track(int trk, const unsigned char *mfm, int bits)
+{
+	unsigned char *ptr, *buf;
+	int size = (bits + 7) / 8;
+
+	if(!(ptr = adf_track(trk)) || bits <= 0) return -1;
+
+	if(!(buf = malloc(size))) {
+		fprintf(stderr, "failed to allocate raw track buffer\n");
+		return -1;
+	}
+	memcpy(buf, mfm, size);
+
+	if(raw_mfm[trk]) {
+		free(raw_mfm[trk]);
+	} else {
+		nraw++;
+	}
+	raw_mfm[trk] = buf;
+	raw_bits[trk] = bits;
+
+	/* there's no AmigaDOS data for this track in the plain image */
+	memset(ptr, 0, ADF_TRACK_SIZE);
+	return 0;
+}
+
+int adf_is_raw(int trk)
+{
+	return trk >= 0 && trk < ADF_NUM_TRACKS && raw_mfm[trk];
+}
+
+static void put16(unsigned char *ptr, unsigned int val)
+{
+	ptr[0] = val >> 8;
+	ptr[1] = val;
+}
+
+static void put32(unsigned char *ptr, unsigned long val)
+{
+	put16(ptr, val >> 16);
+	put16(ptr + 2, val);
+}
+
+/* Builds an extended ADF: the "UAE-1ADF" header with the number of tracks,
+ * a header for each track with its type, size in bytes, and length in bits,
+ * and then the data of all tracks, 5632 bytes for the AmigaDOS ones.
+ */
+static unsigned char *build_extended(int *size)
+{
+	int i, tsize, total;
+	unsigned char *buf, *hdr, *data;
+
+	total = EXT_HDR_SIZE + ADF_NUM_TRACKS * EXT_TRKHDR_SIZE;
+	for(i=0; i<ADF_NUM_TRACKS; i++) {
+		total += raw_mfm[i] ? (raw_bits[i] + 7) / 8 : ADF_TRACK_SIZE;
+	}
+
+	if(!(buf = calloc(1, total))) {
+		fprintf(stderr, "failed to allocate extended image buffer\n");
+		return 0;
+	}
+	memcpy(buf, "UAE-1ADF", 8);
+	put16(buf + 10, ADF_NUM_TRACKS);
+
+	hdr = buf + EXT_HDR_SIZE;
+	data = hdr + ADF_NUM_TRACKS * EXT_TRKHDR_SIZE;
+
+	for(i=0; i<ADF_NUM_TRACKS; i++) {
+		if(raw_mfm[i]) {
+			tsize = (raw_bits[i] + 7) / 8;
+			put16(hdr + 2, EXT_TYPE_RAW);
+			put32(hdr + 4, tsize);
+			put32(hdr + 8, raw_bits[i]);
+			memcpy(data, raw_mfm[i], tsize);
+		} else {
+			tsize = ADF_TRACK_SIZE;
+			put16(hdr + 2, EXT_TYPE_DOS);
+			put32(hdr + 4, tsize);
+			put32(hdr + 8, tsize * 8);
+			memcpy(data, img + i * ADF_TRACK_SIZE, tsize);
+		}
+		hdr += EXT_TRKHDR_SIZE;
+		data += tsize;
+	}
+
+	*size = total;
+	return buf;
+}
+
+static int save_extended(unsigned char *buf, int size)
+{
+	FILE *fp;
+	gzFile gz;
+	char modestr[8];
+
+	if(comp_level >= 0 || is_compressed_name(dest_fname)) {
+		gz_mode(modestr, sizeof modestr);
+		if(!(gz = gzopen(out_fname, modestr))) {
+			fprintf(stderr, "failed to open %s for writing: %s\n", out_fname, strerror(errno));
+			return -1;
+		}
+		if(gzwrite(gz, buf, size) != size || gzclose(gz) != Z_OK) {
+			fprintf(stderr, "failed to write extended image %s\n", out_fname);
+			return -1;
+		}
+		return 0;
+	}
+
+	if(!(fp = fopen(tmp_fname, "wb"))) {
+		fprintf(stderr, "failed to open %s for writing: %s\n", tmp_fname, strerror(errno));
+		return -1;
+	}
+	if(fwrite(buf, 1, size, fp) != size || fclose(fp) == EOF) {
+		fprintf(stderr, "failed to write extended image %s: %s\n", tmp_fname, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void free_raw(void)
+{
+	int i;
+
+	for(i=0; i<ADF_NUM_TRACKS; i++) {
+		free(raw_mfm[i]);
+		raw_mfm[i] = 0;
+		raw_bits[i] = 0;
+	}
+	nraw = 0;
+}
+
+unsigned char *adf_map(const char *fname)
+{
+	int fd;
+	struct stat st;
+	unsigned char *ptr;
+
+	if((fd = open(fname, O_RDONLY)) == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", fname, strerror(errno));
+		return 0;
+	}
+	fstat(fd, &st);
+
+	if(st.st_size == ADF_SIZE) {
+		ptr = mmap(0, ADF_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if(ptr == MAP_FAILED) {
+			fprintf(stderr, "failed to map %s: %s\n", fname, strerror(errno));
+			return 0;
+		}
+		return ptr;
+	}
+	close(fd);
+
+	/* probably compressed, decompress it to an anonymous mapping, so that
+	 * adf_unmap doesn't have to care
+	 */
+	ptr = mmap(0, ADF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(ptr == MAP_FAILED) {
+		fprintf(stderr, "failed to allocate memory for %s: %s\n", fname, strerror(errno));
+		return 0;
+	}
+	if(load_image(fname, ptr) == -1) {
+		munmap(ptr, ADF_SIZE);
+		return 0;
+	}
+	return ptr;
+}
+
+void adf_unmap(unsigned char *ptr)
+{
+	if(ptr) {
+		munmap(ptr, ADF_SIZE);
+	}
+}
+
+/* reads a whole image, plain or gzip compressed, into dest */
+static int load_image(const char *fname, unsigned char *dest)
+{
+	gzFile gz;
+	int res;
+
+	if(!(gz = gzopen(fname, "rb"))) {
+		fprintf(stderr, "failed to open %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	res = gzread(gz, dest, ADF_SIZE);
+	/* make sure there's nothing after the image */
+	if(res == ADF_SIZE && gzgetc(gz) != -1) {
+		res = -1;
+	}
+	gzclose(gz);
+
+	if(res != ADF_SIZE) {
+		fprintf(stderr, "%s is not a valid ADF image\n", fname);
+		return -1;
+	}
+	return 0;
+}
+
+static void gz_mode(char *modestr, int size)
+{
+	if(comp_level >= 0) {
+		snprintf(modestr, size, "wb%c", '0' + comp_level);
+	} else {
+		snprintf(modestr, size, "wb");
+	}
+}
+
+static int is_compressed_name(const char *fname)
+{
+	const char *suffix = strrchr(fname, '.');
+	return suffix && (strcasecmp(suffix, ".adz") == 0 || strcasecmp(suffix, ".gz") == 0);
+}
+
+static char *secmap_fname(const char *fname)
+{
+	static char *buf;
+	static int bufsz;
+	int len = strlen(fname) + 8;
+
+	if(len > bufsz) {
+		free(buf);
+		if(!(buf = malloc(len))) {
+			bufsz = 0;
+			return 0;
+		}
+		bufsz = len;
+	}
+	sprintf(buf, "%s.secmap", fname);
+	return buf;
+}
+
+int adf_load_secmap(const char *fname, unsigned int *valid)
+{
+	FILE *fp;
+	char buf[64], *mapname;
+	int trk, nread = 0;
+	unsigned int mask;
+
+	if(!(mapname = secmap_fname(fname)) || !(fp = fopen(mapname, "r"))) {
+		return -1;
+	}
+
+	while(fgets(buf, sizeof buf, fp)) {
+		if(buf[0] == '#') continue;
+		if(sscanf(buf, "%d %x", &trk, &mask) != 2 || trk < 0 || trk >= ADF_NUM_TRACKS) {
+			fprintf(stderr, "%s: invalid line: %s", mapname, buf);
+			fclose(fp);
+			return -1;
+		}
+		valid[trk] = mask & ((1 << ADF_TRACK_SECTORS) - 1);
+		nread++;
+	}
+	fclose(fp);
+
+	if(nread != ADF_NUM_TRACKS) {
+		fprintf(stderr, "%s: incomplete sector map\n", mapname);
+		return -1;
+	}
+	return 0;
+}
+
+int adf_save_secmap(const char *fname, unsigned int *valid)
+{
+	FILE *fp;
+	char *mapname;
+	int i;
+
+	if(!(mapname = secmap_fname(fname))) {
+		return -1;
 	}
+	if(!(fp = fopen(mapname, "w"))) {
+		fprintf(stderr, "failed to open %s for writing: %s\n", mapname, strerror(errno));
+		return -1;
+	}
+
+	/* raw tracks are only kept in memory, so they have to be read again */
+	fprintf(fp, "# amigafloppy sector map: track, bitmask of valid sectors\n");
+	for(i=0; i<ADF_NUM_TRACKS; i++) {
+		fprintf(fp, "%03d %03x\n", i, raw_mfm[i] ? 0 : valid[i]);
+	}
+	if(fclose(fp) == EOF) {
+		fprintf(stderr, "failed to write %s: %s\n", mapname, strerror(errno));
+		return -1;
+	}
+	return 0;
 }
 
-int adf_write_track(void *trackbuf)
+void adf_remove_secmap(const char *fname)
 {
-	if(!fp) return -1;
-	return fwrite(trackbuf, 512, 11, fp) == 11 ? 0 : -1;
+	char *mapname;
+
+	if((mapname = secmap_fname(fname))) {
+		remove(mapname);
+	}
+}
+
+/* prints the hashes of the last committed image, and of each of its tracks */
+int adf_print_hashes(FILE *fp, int per_track)
+{
+	int i;
+
+	if(!hash_valid) return -1;
+
+	fprintf(fp, "image ");
+	hash_print(fp, &img_hashres);
+	fputc('\n', fp);
+
+	if(per_track) {
+		for(i=0; i<ADF_NUM_TRACKS; i++) {
+			fprintf(fp, "track %03d ", i);
+			hash_print(fp, trk_hashres + i);
+			fputc('\n', fp);
+		}
+	}
+	return 0;
 }
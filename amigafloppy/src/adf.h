@@ -18,9 +18,91 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef ADF_H_
 #define ADF_H_
 
-int adf_open(const char *fname);
+#include <stdio.h>
+#include "geom.h"
+
+/* sizes of the image in the selected geometry (geom.h) */
+#define ADF_SECTOR_SIZE		512
+#define ADF_TRACK_SECTORS	(geom->nsec)
+#define ADF_NUM_TRACKS		(geom->ncyl * 2)
+#define ADF_TRACK_SIZE		(ADF_SECTOR_SIZE * ADF_TRACK_SECTORS)
+#define ADF_SIZE			(ADF_TRACK_SIZE * ADF_NUM_TRACKS)
+
+/* upper limits over all geometries, for static arrays */
+#define ADF_MAX_TRACKS		(GEOM_MAX_CYL * 2)
+#define ADF_MAX_TRACK_SIZE	(ADF_SECTOR_SIZE * GEOM_MAX_SECTORS)
+
+/* adf_open modes */
+enum {
+	ADF_NEW,		/* start with a blank image */
+	ADF_RESUME,		/* continue filling an existing <fname>.part */
+	ADF_REPAIR		/* start with a copy of the existing complete image */
+};
+
+/* The image is built in a memory-mapped temporary file (<fname>.part), which
+ * replaces the destination only when adf_commit is called. adf_close without a
+ * prior adf_commit discards it, so a failed run never leaves a partial image,
+ * unless adf_suspend is called to flush it and keep it around for resuming.
+ * A .part opened with ADF_RESUME is never discarded: adf_close suspends it.
+ *
+ * If the filename ends in .adz or .gz, or a compression level has been set
+ * with adf_compression, the image is instead kept in memory and gzip
+ * compressed to <fname>.part.new by a writer thread, as tracks are marked
+ * final with adf_track_done, in order. It replaces <fname>.part only when
+ * suspended, so a resumed .part is never lost to a run which dies halfway.
+ *
+ * The image name "-" streams the image to stdout (or the fd set with
+ * adf_stream_fd) in the same way, with nothing kept on disk, so such an image
+ * can't be suspended and resumed.
+ *
+ * With adf_hashing enabled, the image and each of its tracks are hashed in
+ * order as they become final, and the hashes of a committed image are
+ * available to adf_print_hashes.
+ */
+void adf_compression(int level);
+void adf_hashing(int enable);
+void adf_stream_fd(int fd);
+int adf_open(const char *fname, int mode);
+int adf_commit(void);
+int adf_suspend(void);
 void adf_close(void);
 
-int adf_write_track(void *trackbuf);
+/* pointers to the final position of a track or sector inside the mapped image.
+ * Tracks are numbered cylinder * 2 + head, and may be filled in any order.
+ */
+unsigned char *adf_track(int trk);
+unsigned char *adf_sector(int trk, int sec);
+
+int adf_write_track(int trk, void *trackbuf);
+
+/* marks a track as final: it will not be written to again */
+void adf_track_done(int trk);
+
+/* Stores a track which can't be decoded as AmigaDOS as raw MFM (one revolution
+ * of bits), leaving its data in the plain image zeroed. If there are any raw
+ * tracks, adf_commit writes an extended ADF (UAE-1ADF) instead, except when
+ * streaming to stdout. Hashes are always of the plain image. Raw tracks are
+ * kept in memory only, and saved as unread in the sector map.
+ */
+int adf_raw_track(int trk, const unsigned char *mfm, int bits);
+int adf_is_raw(int trk);
+
+/* maps an existing image read-only, for use as a reference. Compressed images
+ * are decompressed to memory.
+ */
+unsigned char *adf_map(const char *fname);
+void adf_unmap(unsigned char *ptr);
+
+/* The sector map (<fname>.secmap) is a sidecar text file recording which
+ * sectors of the image have been read and validated, one line per track.
+ */
+int adf_load_secmap(const char *fname, unsigned int *valid);
+int adf_save_secmap(const char *fname, unsigned int *valid);
+void adf_remove_secmap(const char *fname);
+
+/* prints the CRC32, MD5 and SHA-1 of the whole image, and optionally of each
+ * track. Returns -1 if hashing wasn't enabled or the image wasn't committed.
+ */
+int adf_print_hashes(FILE *fp, int per_track);
 
 #endif	/* ADF_H_ */
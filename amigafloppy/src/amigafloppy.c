@@ -0,0 +1,391 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "amigafloppy.h"
+#include "dev.h"
+
+#define NUM_TRACKS(dev)		((dev)->geom->ncyl * 2)
+#define FULL_MASK(dev)		((1u << (dev)->geom->nsec) - 1)
+
+#define MAX_REPAIR_PASSES	3
+/* give up on the disk after this many failed reads or seeks in a row */
+#define MAX_DEV_FAILURES	3
+/* extra reads per track at most, to have enough copies of its bad sectors to
+ * vote, if retries are allowed at all
+ */
+#define MAX_VOTE_READS		3
+
+static int read_attempts(struct afl_device *dev, int trk, unsigned int *valid, int count);
+static void recover_pass(struct afl_device *dev, unsigned int *valid, int extra_reads);
+static int need_copies(struct afl_device *dev, int trk, unsigned int valid);
+static void deliver(struct afl_device *dev, int trk, unsigned char *buf, unsigned int valid,
+		unsigned int newmask);
+static int take_raw(struct afl_device *dev, int trk);
+static int check_status(struct afl_device *dev, int trk);
+static int device_failed(struct afl_device *dev);
+static int count_bad(struct afl_device *dev, unsigned int mask);
+
+struct afl_device *afl_open(const char *devname, const char *geometry)
+{
+	struct afl_device *dev;
+	const struct geometry *g;
+
+	if(!(g = geom_find(geometry))) {
+		fprintf(stderr, "unknown disk geometry: %s\n", geometry);
+		return 0;
+	}
+	if(!(dev = calloc(1, sizeof *dev))) {
+		fprintf(stderr, "failed to allocate device\n");
+		return 0;
+	}
+	dev->geom = g;
+
+	if(init_device(dev, devname) == -1) {
+		free(dev);
+		return 0;
+	}
+	return dev;
+}
+
+void afl_close(struct afl_device *dev)
+{
+	if(!dev) return;
+
+	shutdown_device(dev);
+	free(dev);
+}
+
+void afl_set_callbacks(struct afl_device *dev, const struct afl_callbacks *cb, void *cls)
+{
+	if(cb) {
+		dev->cb = *cb;
+	} else {
+		memset(&dev->cb, 0, sizeof dev->cb);
+	}
+	dev->cls = cls;
+}
+
+int afl_num_tracks(struct afl_device *dev)
+{
+	return NUM_TRACKS(dev);
+}
+
+int afl_track_sectors(struct afl_device *dev)
+{
+	return dev->geom->nsec;
+}
+
+int afl_read_disk(struct afl_device *dev, unsigned int *valid, int retries)
+{
+	int i, pass, npasses, budget, tries, nbad, first_seek, ntracks = NUM_TRACKS(dev);
+	unsigned int full = FULL_MASK(dev);
+	struct afl_callbacks *cb = &dev->cb;
+
+	dev->aborted = 0;
+	dev->stopped = 0;
+	dev->dev_failures = 0;
+	dev->flux = 0;
+	memset(dev->noflux, 0, sizeof dev->noflux);
+
+	/* every bad copy of a sector is kept for recovery at the end */
+	if(!(dev->votes = vote_create())) {
+		dev_message(dev, AFL_ERROR, "failed to allocate the sector vote store");
+	}
+
+	/* first pass: try every track once, in order, without dwelling on errors */
+	for(i=0; i<ntracks && !dev->aborted && !dev->stopped; i++) {
+		if(cb->progress) {
+			cb->progress(dev->cls, 0, i);
+		}
+		if(valid[i] != full) {
+			read_attempts(dev, i, valid + i, 1);
+		}
+	}
+	if(cb->progress) {
+		cb->progress(dev->cls, 0, -1);
+	}
+
+	budget = retries;
+	npasses = budget < MAX_REPAIR_PASSES ? budget : MAX_REPAIR_PASSES;
+
+	/* repair passes: the head is at the last cylinder after the first pass, so
+	 * sweep back down, and then alternate. Every pass re-seeks to the failed
+	 * tracks, which often helps where back-to-back retries don't. Where the
+	 * firmware can capture flux timings, the retries decode them with a PLL,
+	 * which copes with marginal tracks better than its fixed thresholds.
+	 */
+	dev->flux = 1;
+	for(pass=0; pass<npasses && !dev->aborted && !dev->stopped; pass++) {
+		int dir = pass & 1 ? 1 : -1;
+
+		nbad = 0;
+		for(i=0; i<ntracks; i++) {
+			nbad += count_bad(dev, valid[i]);
+		}
+		if(!nbad) break;
+
+		tries = (budget + npasses - pass - 1) / (npasses - pass);
+		budget -= tries;
+
+		dev_message(dev, AFL_INFO, "Repair pass %d: %d bad sectors, %d tries per track%s", pass + 1,
+				nbad, tries, dev->use_flux ? ", with flux capture" : "");
+
+		first_seek = 1;
+		for(i=0; i<ntracks && !dev->aborted && !dev->stopped; i++) {
+			int trk = dir > 0 ? i : ntracks - 1 - i;
+			if(valid[trk] == full || dev->noflux[trk]) continue;
+
+			if(cb->progress) {
+				cb->progress(dev->cls, pass + 1, trk);
+			}
+			/* make sure the head physically moves before the first retry of the pass */
+			if(first_seek) {
+				seek_cylinder(dev, trk >> 1, 1);
+				first_seek = 0;
+			}
+			read_attempts(dev, trk, valid + trk, tries);
+		}
+		if(cb->progress) {
+			cb->progress(dev->cls, pass + 1, -1);
+		}
+	}
+
+	if(dev->votes) {
+		if(!dev->aborted && !dev->stopped) {
+			recover_pass(dev, valid, retries > 0);
+		}
+		vote_free(dev->votes);
+		dev->votes = 0;
+	}
+	dev->flux = 0;
+
+	if(dev->aborted) {
+		dev_message(dev, AFL_ERROR, "interrupted");
+		return -1;
+	}
+	if(dev->stopped) {
+		return -1;
+	}
+
+	nbad = 0;
+	for(i=0; i<ntracks; i++) {
+		int j, len;
+		char buf[128];
+
+		if(valid[i] == full) continue;
+
+		nbad += count_bad(dev, valid[i]);
+		if(dev->noflux[i]) {
+			dev_message(dev, AFL_ERROR, "failed to read track %d (C:%02d H:%d), no flux transitions (unformatted?)",
+					i, i >> 1, i & 1);
+			continue;
+		}
+
+		len = 0;
+		for(j=0; j<dev->geom->nsec; j++) {
+			if(!(valid[i] & (1 << j))) {
+				len += sprintf(buf + len, " %d", j);
+			}
+		}
+		dev_message(dev, AFL_ERROR, "failed to read track %d (C:%02d H:%d), bad sectors:%s", i, i >> 1, i & 1, buf);
+	}
+	if(nbad) {
+		dev_message(dev, AFL_ERROR, "%d bad sectors", nbad);
+		return -1;
+	}
+	return 0;
+}
+
+int afl_verify_track(struct afl_device *dev, const unsigned char *data)
+{
+	int i, res;
+	unsigned int valid = 0, full = FULL_MASK(dev);
+
+	for(i=0; i<2 && valid != full; i++) {
+		if((res = read_track(dev, dev->trkbuf)) != -1) {
+			valid |= res;
+		}
+	}
+	return valid == full && memcmp(dev->trkbuf, data, dev->geom->nsec * 512) == 0;
+}
+
+void afl_abort(struct afl_device *dev)
+{
+	dev->aborted = 1;
+}
+
+/* up to count reads of a track, until all its sectors are valid */
+static int read_attempts(struct afl_device *dev, int trk, unsigned int *valid, int count)
+{
+	int i, res;
+	unsigned int full = FULL_MASK(dev), newmask;
+	unsigned char *buf;
+	struct afl_callbacks *cb = &dev->cb;
+
+	buf = cb->trackbuf ? cb->trackbuf(dev->cls, trk) : dev->trkbuf;
+
+	for(i=0; i<count; i++) {
+		res = read_track_at(dev, trk, buf);
+		if(check_status(dev, trk) == -1) {
+			break;
+		}
+		if(res != -1) {
+			/* a track without a single valid AmigaDOS header isn't going to
+			 * get any better by retrying: hand it over raw, and move on
+			 */
+			if(!res && !*valid && take_raw(dev, trk)) {
+				*valid = full;
+				break;
+			}
+			newmask = res & ~*valid;
+			*valid |= res;
+
+			deliver(dev, trk, buf, *valid, newmask);
+			if(*valid == full || dev->stopped) {
+				break;
+			}
+		}
+	}
+	return *valid == full ? 0 : -1;
+}
+
+/* Sectors which failed every read so far may still be recovered from their
+ * bad copies, by a bitwise majority, or by correcting a bit or two. Tracks
+ * with fewer than VOTE_MIN_COPIES copies of a bad sector are read a few more
+ * times first, which might of course also just read them.
+ */
+static void recover_pass(struct afl_device *dev, unsigned int *valid, int extra_reads)
+{
+	int i, n, ntracks = NUM_TRACKS(dev);
+	unsigned int full = FULL_MASK(dev), newmask;
+	unsigned char *buf;
+	struct afl_callbacks *cb = &dev->cb;
+
+	for(i=0; i<ntracks && !dev->aborted && !dev->stopped; i++) {
+		if(valid[i] == full || dev->noflux[i]) continue;
+
+		for(n=0; extra_reads && n<MAX_VOTE_READS && need_copies(dev, i, valid[i]); n++) {
+			if(read_attempts(dev, i, valid + i, 1) == 0 || dev->stopped || dev->noflux[i]) {
+				break;
+			}
+		}
+		if(valid[i] == full || dev->stopped || dev->noflux[i]) continue;
+
+		buf = cb->trackbuf ? cb->trackbuf(dev->cls, i) : dev->trkbuf;
+		if((newmask = recover_track(dev, i, buf, valid[i]))) {
+			valid[i] |= newmask;
+			deliver(dev, i, buf, valid[i], newmask);
+		}
+	}
+}
+
+/* whether any bad sector of a track, which was seen at all, is short of copies */
+static int need_copies(struct afl_device *dev, int trk, unsigned int valid)
+{
+	int i, n;
+
+	for(i=0; i<dev->geom->nsec; i++) {
+		if(valid & (1 << i)) continue;
+
+		n = vote_copies(dev->votes, trk, i);
+		if(n > 0 && n < VOTE_MIN_COPIES) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* hands the newly valid sectors of a track to the callbacks */
+static void deliver(struct afl_device *dev, int trk, unsigned char *buf, unsigned int valid,
+		unsigned int newmask)
+{
+	int i;
+	struct afl_callbacks *cb = &dev->cb;
+
+	if(cb->sector) {
+		for(i=0; i<dev->geom->nsec; i++) {
+			if(newmask & (1 << i)) {
+				cb->sector(dev->cls, trk, i, buf + i * 512);
+			}
+		}
+	}
+	if(cb->track && cb->track(dev->cls, trk, buf, valid, newmask) == -1) {
+		dev->stopped = 1;
+	}
+}
+
+static int take_raw(struct afl_device *dev, int trk)
+{
+	int bits, dos;
+	unsigned char *mfm;
+
+	if(!dev->cb.raw_track) {
+		return 0;
+	}
+	if((bits = last_track_raw(dev, &mfm, &dos)) == -1 || dos) {
+		return 0;
+	}
+	return dev->cb.raw_track(dev->cls, trk, mfm, bits) == 0;
+}
+
+/* an unformatted track, or a device which stopped answering, won't get any
+ * better by retrying: the former is left alone for the rest of the read, and
+ * the whole read is abandoned after a few of the latter in a row
+ */
+static int check_status(struct afl_device *dev, int trk)
+{
+	switch(last_read_status(dev)) {
+	case READ_NO_FLUX:
+		dev->noflux[trk] = 1;
+		return -1;
+
+	case READ_SEEK:
+		device_failed(dev);
+		return -1;
+
+	case READ_TIMEOUT:
+	case READ_NO_INDEX:
+		return device_failed(dev);
+
+	default:
+		dev->dev_failures = 0;
+	}
+	return 0;
+}
+
+static int device_failed(struct afl_device *dev)
+{
+	if(++dev->dev_failures >= MAX_DEV_FAILURES) {
+		dev_message(dev, AFL_ERROR, "the device isn't responding, giving up");
+		dev->stopped = 1;
+		return -1;
+	}
+	return 0;
+}
+
+static int count_bad(struct afl_device *dev, unsigned int mask)
+{
+	int i, count = 0;
+
+	for(i=0; i<dev->geom->nsec; i++) {
+		if(!(mask & (1 << i))) count++;
+	}
+	return count;
+}
@@ -0,0 +1,163 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AMIGAFLOPPY_H_
+#define AMIGAFLOPPY_H_
+
+/* libamigafloppy: reading amiga disks with the USB floppy controller.
+ *
+ * Each device is a handle returned by afl_open, with its own geometry and
+ * state, so several drives can be read at once, from separate threads. A
+ * handle itself must only be used by one thread at a time, except for
+ * afl_abort. Nothing is written anywhere: the data and the events of a read
+ * are handed to the callbacks as they happen.
+ */
+
+struct afl_device;
+
+/* message levels */
+enum {
+	AFL_ERROR,
+	AFL_INFO
+};
+
+/* All callbacks are optional, and get the cls pointer given along with them.
+ * Tracks are numbered cylinder * 2 + head.
+ */
+struct afl_callbacks {
+	/* buffer to decode a track into, of afl_track_sectors * 512 bytes. Each
+	 * good sector is decoded straight to its place in it, and sectors already
+	 * valid are left alone. Default: a buffer in the handle.
+	 */
+	unsigned char *(*trackbuf)(void *cls, int trk);
+	/* each newly valid sector, right after the read that decoded it. data
+	 * points into the track buffer.
+	 */
+	void (*sector)(void *cls, int trk, int sec, const unsigned char *data);
+	/* after each read of a track, with the mask of the sectors valid so far,
+	 * and of those which became valid with this read. Returning -1 stops the
+	 * whole read.
+	 */
+	int (*track)(void *cls, int trk, const unsigned char *data, unsigned int valid,
+			unsigned int newmask);
+	/* a track without a single valid AmigaDOS sector header, as one revolution
+	 * of raw MFM starting at the first sync word, if any. Returning 0 takes it
+	 * as fully read, so it isn't retried.
+	 */
+	int (*raw_track)(void *cls, int trk, const unsigned char *mfm, int bits);
+	/* before each track of a pass: pass 0 is the first pass over the disk,
+	 * the rest are repair passes. trk is -1 when a pass is over.
+	 */
+	void (*progress)(void *cls, int pass, int trk);
+	/* errors, and informational messages. Default: errors go to stderr. */
+	void (*message)(void *cls, int level, const char *msg);
+};
+
+/* statistics of the track data transfers from the device. Link errors are
+ * transfers which firmware 1.5 and later reported as different from what
+ * arrived, and which were read again without counting as a bad read.
+ */
+struct afl_link_stats {
+	long reads, bytes;
+	long early;		/* reads cut short once all sectors were in */
+	long errors, retries;
+	long overruns;
+};
+
+/* Per-drive tuning, as measured by afl_calibrate. Zero fields keep the
+ * defaults. The step timing and the thresholds need firmware 2.0. The
+ * thresholds, read slack and retries only hold for the capture mode they were
+ * measured in, and are ignored for devices opened for the other one.
+ */
+enum {
+	AFL_DD,		/* the capture modes, as in geom.h */
+	AFL_HD
+};
+
+struct afl_profile {
+	int density;		/* capture mode it was measured in, AFL_DD or AFL_HD */
+	int step_ms;		/* interval between head step pulses */
+	int settle_ms;		/* time for the head to settle after a seek */
+	int short_max, long_min;	/* pulse interval thresholds, in 16MHz ticks */
+	int read_slack_ms;	/* time a read may take beyond the transfer itself */
+	int retries;		/* retries for afl_read_disk which suit the drive */
+	long rev_usec;		/* the measured revolution, for reference */
+};
+
+/* opens the device and sets it up for a geometry (e.g. "dd", "hd82").
+ * Returns 0 on failure. Serial session recording and replay (ser_record and
+ * ser_replay in serial.h) are process-wide, and apply only to the next
+ * afl_open: the other handles open their devices as usual.
+ */
+struct afl_device *afl_open(const char *devname, const char *geometry);
+void afl_close(struct afl_device *dev);
+
+void afl_set_callbacks(struct afl_device *dev, const struct afl_callbacks *cb, void *cls);
+
+int afl_num_tracks(struct afl_device *dev);
+int afl_track_sectors(struct afl_device *dev);
+void afl_fw_version(struct afl_device *dev, int *major, int *minor);
+/* the measured length of a revolution (firmware 1.7 and later), after afl_begin_read */
+long afl_rev_usec(struct afl_device *dev);
+void afl_link_stats(struct afl_device *dev, struct afl_link_stats *st);
+
+/* applies a profile to an open device. Returns -1 if the device refused it. */
+int afl_set_profile(struct afl_device *dev, const struct afl_profile *prof);
+
+/* Measures a profile for the drive on a known-good AmigaDOS disk, after
+ * afl_begin_read: the speed of the drive, the fastest step and settle timing
+ * which still find every track, the pulse thresholds which suit its speed, the
+ * read slack, and the retries its error rate calls for. Takes a minute or two,
+ * and leaves the profile applied. Returns -1 if it failed.
+ */
+int afl_calibrate(struct afl_device *dev, struct afl_profile *prof);
+
+/* afl_begin_read turns the motor on, and with firmware 1.7 or later times a
+ * revolution, failing if there's no disk. afl_end_access turns it off.
+ */
+int afl_begin_read(struct afl_device *dev);
+int afl_begin_write(struct afl_device *dev);
+int afl_end_access(struct afl_device *dev);
+
+/* Reads the whole disk. A first pass reads every track once, and then up to 3
+ * repair passes sweep over the tracks which still have bad sectors, alternating
+ * direction like an elevator, with the retry budget spread across them.
+ *
+ * valid holds a bitmask of good sectors for each of the afl_num_tracks tracks,
+ * and is updated as sectors are read. Tracks which are already fully valid on
+ * entry are not read at all.
+ *
+ * Returns 0 if every sector was read successfully, -1 otherwise.
+ */
+int afl_read_disk(struct afl_device *dev, unsigned int *valid, int retries);
+
+/* Reads the current track back, and compares it with data, its
+ * afl_track_sectors * 512 bytes, to verify a write. A second read is allowed,
+ * so that a marginal read doesn't count as a bad write. The contents are
+ * compared in full rather than by their checksums, since the xor checksum
+ * can't tell apart data which differs only by reordered longwords, and the
+ * read dominates the cost anyway. Returns 1 if the track matches, 0 otherwise.
+ */
+int afl_verify_track(struct afl_device *dev, const unsigned char *data);
+
+/* makes afl_read_disk stop after the current track. Safe to call from a signal
+ * handler or another thread. It only applies to the read in progress: every
+ * afl_read_disk starts out not aborted.
+ */
+void afl_abort(struct afl_device *dev);
+
+#endif	/* AMIGAFLOPPY_H_ */
@@ -0,0 +1,387 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sys/time.h>
+#include "amigafloppy.h"
+#include "dev.h"
+#include "pll.h"
+
+#define CAL_TRACKS		8	/* tracks sampled, spread across the disk */
+#define CAL_READS		3	/* reads of each, for the error rate */
+#define CAL_ROTATIONS	5
+/* every step and settle time is tried this many times before it's taken */
+#define SEEK_TEST_RUNS	2
+/* the read slack is twice the worst latency seen, within these bounds */
+#define SLACK_MIN_MSEC	40
+#define SLACK_MAX_MSEC	500
+/* thresholds further off the defaults than this are not to be trusted, and
+ * closer than this not worth changing
+ */
+#define THRESH_MAX_DEV_PCT	30
+#define THRESH_MIN_DEV		3
+
+#define FULL_MASK(dev)	((1u << (dev)->geom->nsec) - 1)
+
+static int measure_speed(struct afl_device *dev, struct afl_profile *prof);
+static int tune_thresholds(struct afl_device *dev, struct afl_profile *prof, const int *trk);
+static void flux_thresholds(struct afl_device *dev, const long *hist, int *short_max, int *long_min);
+static int tune_seeks(struct afl_device *dev, struct afl_profile *prof, const int *trk,
+		const unsigned char *good);
+static int seek_test(struct afl_device *dev, const int *trk, const unsigned char *good);
+static int test_reads(struct afl_device *dev, const int *trk, int nreads, unsigned char *good,
+		long *latency);
+static int device_error(struct afl_device *dev);
+static long get_msec(void);
+
+static const int step_tries[] = {2, 3, 4, 5, 6, 8, 10};
+static const int settle_tries[] = {5, 10, 15, 20, 30, 45, 60, 80, 100};
+
+int afl_calibrate(struct afl_device *dev, struct afl_profile *prof)
+{
+	int i, nfail, nreads, ngood, res = -1, trk[CAL_TRACKS];
+	unsigned char good[CAL_TRACKS];
+	long latency = LONG_MIN;
+
+	for(i=0; i<CAL_TRACKS; i++) {
+		trk[i] = i * (dev->geom->ncyl * 2 - 1) / (CAL_TRACKS - 1);
+	}
+
+	/* start from the defaults, and keep the errors of the test reads quiet */
+	memset(prof, 0, sizeof *prof);
+	prof->density = dev->geom->density;
+	if(afl_set_profile(dev, prof) == -1) {
+		return -1;
+	}
+	dev->quiet = 1;
+
+	if(measure_speed(dev, prof) == -1 || tune_thresholds(dev, prof, trk) == -1) {
+		goto done;
+	}
+
+	/* the error rate of the drive with those, and how long reads take */
+	nreads = CAL_TRACKS * CAL_READS;
+	if((nfail = test_reads(dev, trk, CAL_READS, good, &latency)) == -1) {
+		goto done;
+	}
+	for(i=ngood=0; i<CAL_TRACKS; i++) {
+		ngood += good[i];
+	}
+	if(!ngood) {
+		dev_message(dev, AFL_ERROR, "calibration needs a known-good AmigaDOS disk, none of the tracks tried could be read");
+		goto done;
+	}
+	prof->retries = nfail == 0 ? 3 : (nfail * 10 < nreads ? 5 : 8);
+	dev_message(dev, AFL_INFO, "Read errors: %d of %d reads, %d retries", nfail, nreads, prof->retries);
+
+	if(latency != LONG_MIN) {
+		latency *= 2;
+		prof->read_slack_ms = latency < SLACK_MIN_MSEC ? SLACK_MIN_MSEC :
+			(latency > SLACK_MAX_MSEC ? SLACK_MAX_MSEC : latency);
+		dev_message(dev, AFL_INFO, "Read slack: %d ms", prof->read_slack_ms);
+	}
+
+	if(tune_seeks(dev, prof, trk, good) == -1) {
+		goto done;
+	}
+	res = 0;
+
+done:
+	dev->quiet = 0;
+	if(res == -1) {
+		memset(prof, 0, sizeof *prof);
+		prof->density = dev->geom->density;
+	}
+	if(afl_set_profile(dev, prof) == -1) {
+		return -1;
+	}
+	return res;
+}
+
+static int measure_speed(struct afl_device *dev, struct afl_profile *prof)
+{
+	int i;
+	long sum = 0, min = LONG_MAX, max = 0;
+
+	if(!FW_AT_LEAST(1, 7)) {
+		dev_message(dev, AFL_INFO, "Firmware %d.%d can't time revolutions, assuming 300 rpm",
+				dev->fw_major, dev->fw_minor);
+		prof->rev_usec = dev->rev_usec;
+		return 0;
+	}
+
+	for(i=0; i<CAL_ROTATIONS; i++) {
+		if(measure_rotation(dev) == -1) {
+			return -1;
+		}
+		sum += dev->rev_usec;
+		if(dev->rev_usec < min) min = dev->rev_usec;
+		if(dev->rev_usec > max) max = dev->rev_usec;
+	}
+	dev->rev_usec = prof->rev_usec = sum / CAL_ROTATIONS;
+
+	dev_message(dev, AFL_INFO, "Drive speed: %.2f rpm (%.2f-%.2f)", 60000000.0 / prof->rev_usec,
+			60000000.0 / max, 60000000.0 / min);
+	return 0;
+}
+
+/* Where the firmware can capture flux timings, the thresholds go halfway
+ * between the peaks of the pulse intervals the drive actually reads. Otherwise
+ * the defaults are scaled by the speed of the drive. Either way they are only
+ * kept if they read at least as well as the defaults.
+ */
+static int tune_thresholds(struct afl_device *dev, struct afl_profile *prof, const int *trk)
+{
+	int i, res, short_max, long_min, short_def, long_def, nfail_def, nfail;
+	long hist[16] = {0};
+
+	if(!FW_AT_LEAST(2, 0)) {
+		dev_message(dev, AFL_INFO, "Firmware %d.%d can't change the pulse thresholds or the step timing, "
+				"version 2.0 is needed", dev->fw_major, dev->fw_minor);
+		return 0;
+	}
+	short_def = dev->geom->density == GEOM_HD ? HD_SHORT_MAX : DD_SHORT_MAX;
+	long_def = dev->geom->density == GEOM_HD ? HD_LONG_MIN : DD_LONG_MIN;
+
+	if(dev->use_flux) {
+		dev->flux = 1;
+		dev->flux_hist = hist;
+		for(i=0; i<CAL_TRACKS; i++) {
+			res = read_track_at(dev, trk[i], dev->trkbuf);
+			if(res == -1 && device_error(dev)) break;
+		}
+		dev->flux = 0;
+		dev->flux_hist = 0;
+		if(i < CAL_TRACKS) {
+			return -1;
+		}
+		flux_thresholds(dev, hist, &short_max, &long_min);
+	} else {
+		short_max = (short_def * dev->rev_usec + NOMINAL_REV_USEC / 2) / NOMINAL_REV_USEC;
+		long_min = (long_def * dev->rev_usec + NOMINAL_REV_USEC / 2) / NOMINAL_REV_USEC;
+	}
+
+	if(abs(short_max - short_def) * 100 > short_def * THRESH_MAX_DEV_PCT ||
+			abs(long_min - long_def) * 100 > long_def * THRESH_MAX_DEV_PCT || short_max >= long_min) {
+		dev_message(dev, AFL_INFO, "Pulse thresholds: %d/%d is too far off, keeping the defaults",
+				short_max, long_min);
+		return 0;
+	}
+	if(abs(short_max - short_def) < THRESH_MIN_DEV && abs(long_min - long_def) < THRESH_MIN_DEV) {
+		dev_message(dev, AFL_INFO, "Pulse thresholds: the defaults (%d/%d)", short_def, long_def);
+		return 0;
+	}
+
+	if((nfail_def = test_reads(dev, trk, 1, 0, 0)) == -1 ||
+			set_thresholds(dev, short_max, long_min) == -1 ||
+			(nfail = test_reads(dev, trk, 1, 0, 0)) == -1) {
+		return -1;
+	}
+	if(nfail > nfail_def) {
+		dev_message(dev, AFL_INFO, "Pulse thresholds: %d/%d read worse than the defaults, keeping those",
+				short_max, long_min);
+		return set_thresholds(dev, 0, 0);
+	}
+	prof->short_max = short_max;
+	prof->long_min = long_min;
+	dev_message(dev, AFL_INFO, "Pulse thresholds: %d/%d (defaults: %d/%d)", short_max, long_min,
+			short_def, long_def);
+	return 0;
+}
+
+/* the peaks of the 2, 3 and 4 cell intervals, by 1D k-means over the
+ * histogram of flux nibbles, which count quarters of a cell
+ */
+static void flux_thresholds(struct afl_device *dev, const long *hist, int *short_max, int *long_min)
+{
+	int i, j, k, iter;
+	double c[3] = {8, 12, 16}, sum[3], n[3], dist, best;
+	double qticks = dev->geom->density == GEOM_HD ? 4.0 : 8.0;
+
+	for(iter=0; iter<16; iter++) {
+		memset(sum, 0, sizeof sum);
+		memset(n, 0, sizeof n);
+		for(i=1; i<16; i++) {
+			best = 1e9;
+			for(j=k=0; j<3; j++) {
+				if((dist = i + FLUX_BIAS - c[j]) < 0) dist = -dist;
+				if(dist < best) {
+					best = dist;
+					k = j;
+				}
+			}
+			sum[k] += (double)hist[i] * (i + FLUX_BIAS);
+			n[k] += hist[i];
+		}
+		for(j=0; j<3; j++) {
+			if(n[j] > 0) c[j] = sum[j] / n[j];
+		}
+	}
+
+	*short_max = (int)((c[0] + c[1]) / 2.0 * qticks + 0.5);
+	*long_min = (int)((c[1] + c[2]) / 2.0 * qticks + 0.5);
+}
+
+/* The settle time is found first, at the default step interval, and then the
+ * step interval at that settle time: the shortest of each which still lands
+ * on every track and reads it, with a margin on top.
+ */
+static int tune_seeks(struct afl_device *dev, struct afl_profile *prof, const int *trk,
+		const unsigned char *good)
+{
+	int i, res, settle, step;
+
+	if(!FW_AT_LEAST(2, 0)) {
+		return 0;
+	}
+
+	settle = step = 0;
+	for(i=0; i<sizeof settle_tries / sizeof *settle_tries; i++) {
+		if(set_step_timing(dev, STEP_MS_DEFAULT, settle_tries[i]) == -1 ||
+				(res = seek_test(dev, trk, good)) == -1) {
+			return -1;
+		}
+		if(res) {
+			settle = settle_tries[i];
+			break;
+		}
+	}
+	if(!settle) {
+		dev_message(dev, AFL_INFO, "Seeks fail even at the default timing, keeping it");
+		return set_step_timing(dev, STEP_MS_DEFAULT, SETTLE_MS_DEFAULT);
+	}
+
+	for(i=0; i<sizeof step_tries / sizeof *step_tries; i++) {
+		if(set_step_timing(dev, step_tries[i], settle) == -1 ||
+				(res = seek_test(dev, trk, good)) == -1) {
+			return -1;
+		}
+		if(res) {
+			step = step_tries[i];
+			break;
+		}
+	}
+	if(!step) {
+		step = STEP_MS_DEFAULT;
+	}
+
+	prof->settle_ms = settle + settle / 2 + 5;
+	if(prof->settle_ms > SETTLE_MS_DEFAULT) prof->settle_ms = SETTLE_MS_DEFAULT;
+	prof->step_ms = step + step / 4 + 1;
+	if(prof->step_ms > STEP_MS_DEFAULT) prof->step_ms = STEP_MS_DEFAULT;
+
+	dev_message(dev, AFL_INFO, "Head timing: step %d ms, settle %d ms (reliable from %d/%d, defaults: %d/%d)",
+			prof->step_ms, prof->settle_ms, step, settle, STEP_MS_DEFAULT, SETTLE_MS_DEFAULT);
+	return 0;
+}
+
+/* Seeks back and forth over the good tracks, long strokes first, from track
+ * 0, and reads each right after the seek. Lost steps show up as headers of
+ * the wrong track, and too short a settle time as bad sectors. Returns 1 if
+ * every read was right, 0 if not, and -1 on device error.
+ */
+static int seek_test(struct afl_device *dev, const int *trk, const unsigned char *good)
+{
+	int i, run, idx, res;
+
+	for(run=0; run<SEEK_TEST_RUNS; run++) {
+		if(move_head(dev, 0) <= 0) {
+			dev_message(dev, AFL_ERROR, "failed to move the head back to track 0");
+			dev->cyl = -1;
+			return -1;
+		}
+		dev->cyl = 0;
+
+		for(i=0; i<CAL_TRACKS; i++) {
+			idx = i & 1 ? CAL_TRACKS - 1 - i / 2 : i / 2;
+			if(!good[idx]) continue;
+
+			res = read_track_at(dev, trk[idx], dev->trkbuf);
+			if(res == -1 && device_error(dev)) {
+				return -1;
+			}
+			if(res != FULL_MASK(dev) || dev->hdr_track != trk[idx]) {
+				dev->cyl = -1;
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/* Reads each track nreads times, seeking to it for the first. Returns the
+ * number of reads which missed any sector, or -1 on device error. Sets good
+ * to whether each track read completely at least once, and latency to the
+ * longest any read without a seek took beyond the transfer itself, if any ran
+ * its full length.
+ */
+static int test_reads(struct afl_device *dev, const int *trk, int nreads, unsigned char *good,
+		long *latency)
+{
+	int i, j, res, nfail = 0;
+	long start, early, t;
+
+	for(i=0; i<CAL_TRACKS; i++) {
+		if(good) good[i] = 0;
+
+		for(j=0; j<nreads; j++) {
+			early = dev->lstats.early;
+			start = get_msec();
+			res = read_track_at(dev, trk[i], dev->trkbuf);
+			t = get_msec() - start - track_msec(dev);
+
+			if(res == -1 && device_error(dev)) {
+				return -1;
+			}
+			if(res != FULL_MASK(dev) || dev->hdr_track != trk[i]) {
+				nfail++;
+				continue;
+			}
+			if(good) good[i] = 1;
+			if(latency && j > 0 && dev->lstats.early == early && t > *latency) {
+				*latency = t;
+			}
+		}
+	}
+	return nfail;
+}
+
+/* the reads fail for the disk's sake, unless the device itself stopped answering */
+static int device_error(struct afl_device *dev)
+{
+	switch(last_read_status(dev)) {
+	case READ_TIMEOUT:
+	case READ_NO_INDEX:
+	case READ_LINK:
+		dev_message(dev, AFL_ERROR, "the device failed during calibration");
+		return 1;
+	default:
+		break;
+	}
+	return 0;
+}
+
+static long get_msec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, 0);
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
@@ -0,0 +1,217 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include <stdint.h>
+#include "correct.h"
+#include "vote.h"
+
+#define NBITS			(VOTE_SIZE * 8)
+/* the checksum field is 8 bytes of MFM, followed by the data */
+#define CSUM_BITS		64
+/* candidates considered at most, which also bounds the pairs */
+#define MAX_SUSPECTS	256
+
+/* a wrong single bit passes the checksum 1 time in 16, once for each lane,
+ * and a wrong pair about 1 time in 128
+ */
+#define SINGLE_ODDS		16
+#define PAIR_ODDS		128
+#define MAX_RISK_PCT	25
+
+#define BIT(p)		((mfm[(p) >> 3] >> (7 - ((p) & 7))) & 1)
+#define FLIP(p)		(mfm[(p) >> 3] ^= 0x80 >> ((p) & 7))
+
+static int find_suspects(const unsigned char *mfm, const unsigned char *weak, int *susp);
+static int flip(unsigned char *mfm, int p);
+static void unflip(unsigned char *mfm, int p, int clk);
+static uint32_t syndrome(const unsigned char *mfm);
+static uint32_t lane(int p);
+static int violations(const unsigned char *mfm, int p, int q);
+static int violation(const unsigned char *mfm, int c);
+static uint32_t get32(const unsigned char *p);
+
+int correct_sector(unsigned char *mfm, const unsigned char *weak, struct correction *res)
+{
+	int i, j, nsusp, before, clk[2], match[2] = {0, 0};
+	uint32_t syn, lane_a, lane_b;
+	int susp[MAX_SUSPECTS];
+
+	memset(res, 0, sizeof *res);
+
+	if(!(syn = syndrome(mfm))) {
+		return 0;
+	}
+	lane_a = syn & -syn;
+	lane_b = syn ^ lane_a;
+	if(lane_b & (lane_b - 1)) {
+		return 0;	/* more than two bits off */
+	}
+	res->nbits = lane_b ? 2 : 1;
+
+	nsusp = find_suspects(mfm, weak, susp);
+
+	/* a candidate is plausible if it doesn't add to the clock violations
+	 * around it, which a misplaced transition would have caused
+	 */
+	for(i=0; i<nsusp; i++) {
+		if(lane(susp[i]) != lane_a) continue;
+
+		if(!lane_b) {
+			before = violations(mfm, susp[i], -1);
+			clk[0] = flip(mfm, susp[i]);
+			if(violations(mfm, susp[i], -1) <= before && !res->nmatched++) {
+				match[0] = susp[i];
+			}
+			unflip(mfm, susp[i], clk[0]);
+			continue;
+		}
+
+		for(j=0; j<nsusp; j++) {
+			if(lane(susp[j]) != lane_b) continue;
+
+			before = violations(mfm, susp[i], susp[j]);
+			clk[0] = flip(mfm, susp[i]);
+			clk[1] = flip(mfm, susp[j]);
+			if(violations(mfm, susp[i], susp[j]) <= before && !res->nmatched++) {
+				match[0] = susp[i];
+				match[1] = susp[j];
+			}
+			unflip(mfm, susp[j], clk[1]);
+			unflip(mfm, susp[i], clk[0]);
+		}
+	}
+
+	if(lane_b) {
+		res->ntried = nsusp * (nsusp - 1) / 2;
+		res->risk_pct = (res->ntried - 1) * 100 / PAIR_ODDS;
+	} else {
+		res->ntried = nsusp;
+		res->risk_pct = (res->ntried - 1) * 100 / SINGLE_ODDS;
+	}
+	if(res->risk_pct > 100) res->risk_pct = 100;
+
+	if(res->nmatched != 1 || res->risk_pct > MAX_RISK_PCT) {
+		return 0;
+	}
+	flip(mfm, match[0]);
+	if(lane_b) {
+		flip(mfm, match[1]);
+	}
+	return res->nbits;
+}
+
+/* Flips data bit p, and if a pulse moving between it and one of its clock
+ * bits fits better than it just appearing or vanishing, moves that clock bit
+ * the other way. Returns the clock bit moved, or -1.
+ */
+static int flip(unsigned char *mfm, int p)
+{
+	int i, c, v, best, pick = -1;
+
+	FLIP(p);
+	best = violations(mfm, p, -1);
+
+	for(i=-1; i<=1; i+=2) {
+		c = p + i;
+		if(c <= 0 || c >= NBITS - 1 || BIT(c) != BIT(p)) continue;
+
+		FLIP(c);
+		if((v = violations(mfm, p, -1)) < best) {
+			best = v;
+			pick = c;
+		}
+		FLIP(c);
+	}
+	if(pick >= 0) {
+		FLIP(pick);
+	}
+	return pick;
+}
+
+static void unflip(unsigned char *mfm, int p, int clk)
+{
+	FLIP(p);
+	if(clk >= 0) {
+		FLIP(clk);
+	}
+}
+
+/* data bits are the odd ones, each between two clock bits */
+static int find_suspects(const unsigned char *mfm, const unsigned char *weak, int *susp)
+{
+	int p, n = 0;
+
+	for(p=1; p<NBITS && n < MAX_SUSPECTS; p+=2) {
+		if((weak && ((weak[p >> 3] >> (7 - (p & 7))) & 1)) ||
+				violation(mfm, p - 1) || violation(mfm, p + 1)) {
+			susp[n++] = p;
+		}
+	}
+	return n;
+}
+
+/* the difference between the checksum of the data, and the one stored */
+static uint32_t syndrome(const unsigned char *mfm)
+{
+	int i;
+	uint32_t sum = 0, stored;
+
+	for(i=CSUM_BITS / 8; i<VOTE_SIZE; i+=4) {
+		sum ^= get32(mfm + i);
+	}
+	stored = ((get32(mfm) & 0x55555555) << 1) | (get32(mfm + 4) & 0x55555555);
+	return (sum & 0x55555555) ^ stored;
+}
+
+/* the bit of the syndrome which flipping data bit p flips: the data bits
+ * fold into the even bits of the sum, while the stored checksum has its odd
+ * bits first, and its even bits next
+ */
+static uint32_t lane(int p)
+{
+	int byte = p >> 3;
+	int pos = (3 - (byte & 3)) * 8 + 7 - (p & 7);
+
+	return byte < 4 ? 1u << (pos + 1) : 1u << pos;
+}
+
+/* clock violations next to data bits p and q (-1 for none) */
+static int violations(const unsigned char *mfm, int p, int q)
+{
+	int count = violation(mfm, p - 1) + violation(mfm, p + 1);
+
+	if(q >= 0) {
+		if(q - 1 != p + 1 && q - 1 != p - 1) count += violation(mfm, q - 1);
+		if(q + 1 != p - 1 && q + 1 != p + 1) count += violation(mfm, q + 1);
+	}
+	return count;
+}
+
+/* an MFM clock bit is set only between two zero data bits */
+static int violation(const unsigned char *mfm, int c)
+{
+	if(c <= 0 || c >= NBITS - 1) {
+		return 0;
+	}
+	return BIT(c) != !(BIT(c - 1) | BIT(c + 1));
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
@@ -0,0 +1,43 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef CORRECT_H_
+#define CORRECT_H_
+
+/* A sector which still fails its data checksum is often only a bit or two
+ * off, from a flux transition which landed in the wrong bit cell. The Amiga
+ * checksum is an XOR of the data bits folded into 16 lanes, so each flipped
+ * data bit flips exactly one bit of it: the difference between the checksum
+ * and the one stored says how many bits are wrong, and in which lanes. The
+ * candidates for each are the data bits next to an MFM clock violation,
+ * which is where a misplaced transition shows, and the weak bits of a vote.
+ */
+struct correction {
+	int nbits;		/* bits corrected */
+	int ntried;		/* candidates which could have matched the checksum */
+	int nmatched;	/* plausible candidates which did */
+	int risk_pct;	/* chance one of the others would match by coincidence */
+};
+
+/* Corrects a sector (VOTE_SIZE bytes of MFM, from its data checksum field
+ * on) in place, if there's a single plausible correction of up to two bits
+ * with an acceptable risk. weak is an optional bitmap of suspicious bits.
+ * Returns the number of bits corrected, 0 if none, with the details in res.
+ */
+int correct_sector(unsigned char *mfm, const unsigned char *weak, struct correction *res);
+
+#endif	/* CORRECT_H_ */
@@ -0,0 +1,842 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/* amigafloppyd: keeps the drives open, with the motor running between jobs,
+ * and takes jobs over a unix socket, one line each:
+ *
+ *   read <drive> <image>      read the disk to an image
+ *   write <drive> <image>     write an image to the disk
+ *   verify <drive> <image>    write, and read every track back to check it
+ *   compare <drive> <image>   compare the disk against an image
+ *   status                    list the drives and their queues
+ *
+ * <drive> is the index of the drive on the command line, or its device file.
+ * Images are plain ADF files, in the geometry the daemon was started with,
+ * and relative paths are relative to the working directory of the daemon.
+ * Each job gets the messages of the read back as "info:" and "error:" lines,
+ * and finally "ok", or "failed: <reason>". Jobs for the same drive run one
+ * after the other, in the order they came in, and a job is abandoned if its
+ * client goes away.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "amigafloppy.h"
+#include "dev.h"
+#include "opt.h"
+
+#define SOCK_DEFAULT	"/tmp/amigafloppyd.sock"
+#define IDLE_DEFAULT	30
+#define MAX_DRIVES		8
+#define MAX_LINE		1024
+#define RETRIES_DEFAULT	5
+#define WRITE_RETRIES	3
+/* how long a client may take to send its job line */
+#define REQUEST_MSEC	2000
+
+enum { JOB_READ, JOB_WRITE, JOB_VERIFY, JOB_COMPARE };
+enum { MOTOR_OFF, MOTOR_READ, MOTOR_WRITE };
+
+struct job {
+	int type;
+	int fd;			/* the client */
+	int gone;		/* the client went away */
+	char *path;
+	struct drive *drv;
+	struct job *next;
+};
+
+struct drive {
+	int idx;
+	char *devfile;
+	struct afl_device *dev;
+	int motor;
+	int retries;
+	long last_used;		/* msec */
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct job *queue, *tail, *cur;
+	int nqueued;
+};
+
+static void *worker(void *arg);
+static void run_job(struct drive *drv, struct job *job);
+static int spin_up(struct drive *drv, int mode);
+static int read_job(struct drive *drv, struct job *job);
+static int write_job(struct drive *drv, struct job *job);
+static int compare_job(struct drive *drv, struct job *job);
+static unsigned char *load_image(struct job *job);
+static int save_image(struct job *job, const unsigned char *img);
+static void handle_client(int fd);
+static int read_request(int fd, char *buf, int size);
+static char *next_word(char **rest, char *s);
+static struct drive *find_drive(const char *name);
+static void send_status(int fd);
+static void reply(struct job *job, const char *fmt, ...);
+static void sendstr(int fd, const char *str);
+static unsigned char *job_trackbuf(void *cls, int trk);
+static void job_progress(void *cls, int pass, int trk);
+static void job_message(void *cls, int level, const char *msg);
+static int client_gone(struct job *job);
+static void abandon(struct job *job);
+static int open_socket(const char *path);
+static long get_msec(void);
+static void sighandler(int s);
+static void print_usage(const char *argv0);
+
+static struct drive drives[MAX_DRIVES];
+static int num_drives;
+static const struct geometry *dgeom;
+static int idle_sec = IDLE_DEFAULT;
+static int retries = RETRIES_DEFAULT, retries_given;
+static volatile sig_atomic_t quit;
+
+/* the image buffer of the job running on each drive */
+static unsigned char *job_img[MAX_DRIVES];
+
+int main(int argc, char **argv)
+{
+	int i, sock, fd, status = 1;
+	char *endp, *sockpath = SOCK_DEFAULT, *geomname = "dd";
+	const struct afl_profile *prof;
+	struct pollfd pfd;
+
+	for(i=1; i<argc; i++) {
+		if(strcmp(argv[i], "-s") == 0 && argv[i + 1]) {
+			sockpath = argv[++i];
+		} else if(strcmp(argv[i], "-t") == 0 && argv[i + 1]) {
+			idle_sec = strtol(argv[++i], &endp, 10);
+			if(endp == argv[i] || idle_sec < 0) {
+				fprintf(stderr, "-t must be followed by the idle timeout in seconds\n");
+				return 1;
+			}
+		} else if(strcmp(argv[i], "-r") == 0 && argv[i + 1]) {
+			retries = strtol(argv[++i], &endp, 10);
+			if(endp == argv[i] || retries < 0) {
+				fprintf(stderr, "-r must be followed by the number of retries\n");
+				return 1;
+			}
+			retries_given = 1;
+		} else if(strcmp(argv[i], "--geometry") == 0 && argv[i + 1]) {
+			geomname = argv[++i];
+		} else if(strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+			print_usage(argv[0]);
+			return 0;
+		} else if(argv[i][0] == '-') {
+			fprintf(stderr, "invalid option: %s\n\n", argv[i]);
+			print_usage(argv[0]);
+			return 1;
+		} else {
+			if(num_drives >= MAX_DRIVES) {
+				fprintf(stderr, "too many drives, at most %d\n", MAX_DRIVES);
+				return 1;
+			}
+			drives[num_drives++].devfile = argv[i];
+		}
+	}
+	if(!num_drives) {
+		print_usage(argv[0]);
+		return 1;
+	}
+	if(!(dgeom = geom_find(geomname))) {
+		fprintf(stderr, "--geometry must be followed by one of: ");
+		geom_list(stderr);
+		return 1;
+	}
+	load_config();
+
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+	signal(SIGPIPE, SIG_IGN);
+
+	for(i=0; i<num_drives; i++) {
+		struct drive *drv = drives + i;
+
+		if(!(drv->dev = afl_open(drv->devfile, dgeom->name))) {
+			fprintf(stderr, "failed to open %s\n", drv->devfile);
+			goto done;
+		}
+		drv->retries = retries;
+		if((prof = drive_profile(drv->devfile, dgeom->density))) {
+			if(afl_set_profile(drv->dev, prof) == -1) {
+				afl_close(drv->dev);
+				drv->dev = 0;
+				goto done;
+			}
+			if(prof->retries > 0 && !retries_given) {
+				drv->retries = prof->retries;
+			}
+		}
+		drv->idx = i;
+		pthread_mutex_init(&drv->lock, 0);
+		pthread_cond_init(&drv->cond, 0);
+		if(pthread_create(&drv->thread, 0, worker, drv) != 0) {
+			fprintf(stderr, "failed to start the worker thread of %s\n", drv->devfile);
+			afl_close(drv->dev);
+			drv->dev = 0;
+			goto done;
+		}
+	}
+
+	if((sock = open_socket(sockpath)) == -1) {
+		goto done;
+	}
+	printf("amigafloppyd: %d drive%s, listening on %s\n", num_drives, num_drives > 1 ? "s" : "", sockpath);
+	fflush(stdout);
+
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	while(!quit) {
+		if(poll(&pfd, 1, 500) <= 0) continue;
+		if((fd = accept(sock, 0, 0)) == -1) {
+			if(errno != EINTR) perror("accept");
+			continue;
+		}
+		handle_client(fd);
+	}
+	close(sock);
+	unlink(sockpath);
+	status = 0;
+
+done:
+	/* the workers give up on their queues, and turn the motors off */
+	quit = 1;
+	for(i=0; i<num_drives; i++) {
+		struct drive *drv = drives + i;
+		if(!drv->dev) break;
+
+		pthread_mutex_lock(&drv->lock);
+		if(drv->cur) {
+			afl_abort(drv->dev);
+		}
+		pthread_cond_signal(&drv->cond);
+		pthread_mutex_unlock(&drv->lock);
+		pthread_join(drv->thread, 0);
+		afl_close(drv->dev);
+	}
+	return status;
+}
+
+/* Runs the jobs of a drive as they are queued. The motor stays on between
+ * them, and the head where the last one left it, until the drive has been
+ * idle for idle_sec.
+ */
+static void *worker(void *arg)
+{
+	struct drive *drv = arg;
+	struct job *job;
+	struct timespec ts;
+	long idle_until;
+
+	pthread_mutex_lock(&drv->lock);
+	for(;;) {
+		while(!drv->queue && !quit) {
+			if(drv->motor == MOTOR_OFF) {
+				pthread_cond_wait(&drv->cond, &drv->lock);
+				continue;
+			}
+			idle_until = drv->last_used + idle_sec * 1000L;
+			if(get_msec() >= idle_until) {
+				afl_end_access(drv->dev);
+				drv->motor = MOTOR_OFF;
+				continue;
+			}
+			ts.tv_sec = idle_until / 1000;
+			ts.tv_nsec = (idle_until % 1000) * 1000000;
+			pthread_cond_timedwait(&drv->cond, &drv->lock, &ts);
+		}
+		if(!drv->queue) break;
+
+		job = drv->queue;
+		if(!(drv->queue = job->next)) {
+			drv->tail = 0;
+		}
+		drv->nqueued--;
+		pthread_mutex_unlock(&drv->lock);
+
+		/* a client which hung up while it was queued isn't waiting for anything */
+		if(!job->gone && !client_gone(job)) {
+			pthread_mutex_lock(&drv->lock);
+			drv->cur = job;
+			pthread_mutex_unlock(&drv->lock);
+
+			if(quit) {
+				reply(job, "failed: shutting down\n");
+			} else {
+				run_job(drv, job);
+			}
+		}
+
+		pthread_mutex_lock(&drv->lock);
+		drv->cur = 0;
+		drv->last_used = get_msec();
+		close(job->fd);
+		free(job->path);
+		free(job);
+	}
+	pthread_mutex_unlock(&drv->lock);
+
+	if(drv->motor != MOTOR_OFF) {
+		afl_end_access(drv->dev);
+	}
+	return 0;
+}
+
+static void run_job(struct drive *drv, struct job *job)
+{
+	int res;
+	static const struct afl_callbacks callbacks = {
+		job_trackbuf, 0, 0, 0, job_progress, job_message
+	};
+
+	afl_set_callbacks(drv->dev, &callbacks, job);
+
+	switch(job->type) {
+	case JOB_READ:
+		res = read_job(drv, job);
+		break;
+	case JOB_WRITE:
+	case JOB_VERIFY:
+		res = write_job(drv, job);
+		break;
+	case JOB_COMPARE:
+		res = compare_job(drv, job);
+		break;
+	default:
+		res = -1;
+	}
+	if(res == 0) {
+		reply(job, "ok\n");
+	}
+	afl_set_callbacks(drv->dev, 0, 0);
+}
+
+/* Turns the motor on, unless it's still on in the same mode since the last
+ * job. A disk may have been swapped in the meantime, so a warm drive still
+ * times a revolution, which is quick, and fails if there's no disk.
+ */
+static int spin_up(struct drive *drv, int mode)
+{
+	struct afl_device *dev = drv->dev;
+
+	if(drv->motor == mode) {
+		if(mode == MOTOR_READ && FW_AT_LEAST(1, 7) && measure_rotation(dev) == -1) {
+			return -1;
+		}
+		return 0;
+	}
+	if((mode == MOTOR_READ ? afl_begin_read(dev) : afl_begin_write(dev)) == -1) {
+		afl_end_access(dev);
+		drv->motor = MOTOR_OFF;
+		return -1;
+	}
+	drv->motor = mode;
+	return 0;
+}
+
+static int read_job(struct drive *drv, struct job *job)
+{
+	int res;
+	unsigned int valid[GEOM_MAX_CYL * 2] = {0};
+
+	if(!(job_img[drv->idx] = calloc(1, dgeom->ncyl * 2 * dgeom->nsec * 512))) {
+		reply(job, "failed: out of memory\n");
+		return -1;
+	}
+	if(spin_up(drv, MOTOR_READ) == -1) {
+		reply(job, "failed: the drive didn't spin up, is there a disk in it?\n");
+		res = -1;
+	} else if((res = afl_read_disk(drv->dev, valid, drv->retries)) == -1) {
+		reply(job, "failed: the disk couldn't be read completely\n");
+	} else {
+		res = save_image(job, job_img[drv->idx]);
+	}
+	free(job_img[drv->idx]);
+	job_img[drv->idx] = 0;
+	return res;
+}
+
+static int write_job(struct drive *drv, struct job *job)
+{
+	int i, tries, nfailed = 0, ntracks = dgeom->ncyl * 2;
+	int tracksize = dgeom->nsec * 512;
+	unsigned char *img, *data, mfm[GEOM_MAX_MFM_SIZE];
+	struct afl_device *dev = drv->dev;
+
+	if(dgeom->density != GEOM_DD) {
+		reply(job, "failed: writing %s disks is not supported\n", dgeom->name);
+		return -1;
+	}
+	if(!(img = load_image(job))) {
+		return -1;
+	}
+	if(spin_up(drv, MOTOR_WRITE) == -1) {
+		reply(job, "failed: the drive didn't spin up\n");
+		free(img);
+		return -1;
+	}
+
+	for(i=0; i<ntracks && !client_gone(job) && !quit; i++) {
+		data = img + i * tracksize;
+
+		if(seek_cylinder(dev, i >> 1, 0) == -1 || select_head(dev, i & 1) == -1) {
+			reply(job, "failed: seek to track %d failed\n", i);
+			free(img);
+			return -1;
+		}
+		encode_track(dgeom, mfm, data, i);
+
+		for(tries=0; ; tries++) {
+			if(write_track(dev, mfm, dgeom->mfm_size, 1) != -1 &&
+					(job->type != JOB_VERIFY || afl_verify_track(dev, data))) {
+				break;
+			}
+			if(tries >= WRITE_RETRIES) {
+				reply(job, "error: failed to write track %d (C:%02d H:%d)\n", i, i >> 1, i & 1);
+				nfailed++;
+				break;
+			}
+		}
+	}
+	free(img);
+
+	if(job->gone || quit) {
+		return -1;
+	}
+	if(nfailed) {
+		reply(job, "failed: %d tracks\n", nfailed);
+		return -1;
+	}
+	return 0;
+}
+
+static int compare_job(struct drive *drv, struct job *job)
+{
+	int i, j, res, ndiff = 0, ntracks = dgeom->ncyl * 2, nsec = dgeom->nsec;
+	unsigned char *ref, *img;
+	unsigned int valid[GEOM_MAX_CYL * 2] = {0};
+
+	if(!(ref = load_image(job))) {
+		return -1;
+	}
+	if(!(img = job_img[drv->idx] = calloc(1, ntracks * nsec * 512))) {
+		reply(job, "failed: out of memory\n");
+		free(ref);
+		return -1;
+	}
+
+	if(spin_up(drv, MOTOR_READ) == -1) {
+		reply(job, "failed: the drive didn't spin up, is there a disk in it?\n");
+		res = -1;
+		goto end;
+	}
+	res = afl_read_disk(drv->dev, valid, drv->retries);
+
+	for(i=0; i<ntracks; i++) {
+		for(j=0; j<nsec; j++) {
+			int offs = (i * nsec + j) * 512;
+			if((valid[i] & (1 << j)) && memcmp(img + offs, ref + offs, 512) != 0) {
+				reply(job, "info: track %d (C:%02d H:%d), sector %d differs\n", i, i >> 1, i & 1, j);
+				ndiff++;
+			}
+		}
+	}
+	if(ndiff) {
+		reply(job, "failed: %d sectors differ\n", ndiff);
+		res = -1;
+	} else if(res == -1) {
+		reply(job, "failed: the disk couldn't be read completely\n");
+	}
+
+end:
+	free(img);
+	job_img[drv->idx] = 0;
+	free(ref);
+	return res;
+}
+
+static unsigned char *load_image(struct job *job)
+{
+	int fd;
+	long size = dgeom->ncyl * 2 * dgeom->nsec * 512;
+	unsigned char *img;
+	struct stat st;
+
+	if((fd = open(job->path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+		reply(job, "failed: %s: %s\n", job->path, strerror(errno));
+		if(fd != -1) close(fd);
+		return 0;
+	}
+	if(st.st_size != size) {
+		reply(job, "failed: %s is not a plain %s ADF image (%ld bytes)\n", job->path, dgeom->name, size);
+		close(fd);
+		return 0;
+	}
+	if(!(img = malloc(size))) {
+		reply(job, "failed: out of memory\n");
+		close(fd);
+		return 0;
+	}
+	if(read(fd, img, size) != size) {
+		reply(job, "failed: failed to read %s\n", job->path);
+		free(img);
+		img = 0;
+	}
+	close(fd);
+	return img;
+}
+
+/* writes to a temporary file first, so a failed job never leaves half an image */
+static int save_image(struct job *job, const unsigned char *img)
+{
+	FILE *fp;
+	char *tmpname;
+	long size = dgeom->ncyl * 2 * dgeom->nsec * 512;
+
+	if(!(tmpname = malloc(strlen(job->path) + 5))) {
+		reply(job, "failed: out of memory\n");
+		return -1;
+	}
+	sprintf(tmpname, "%s.tmp", job->path);
+
+	if(!(fp = fopen(tmpname, "wb"))) {
+		reply(job, "failed: %s: %s\n", tmpname, strerror(errno));
+		free(tmpname);
+		return -1;
+	}
+	if(fwrite(img, 1, size, fp) != size || fclose(fp) == EOF || rename(tmpname, job->path) == -1) {
+		reply(job, "failed: failed to save %s: %s\n", job->path, strerror(errno));
+		remove(tmpname);
+		free(tmpname);
+		return -1;
+	}
+	free(tmpname);
+	return 0;
+}
+
+/* reads the job line of a client, and queues it for its drive */
+static void handle_client(int fd)
+{
+	int type, nahead;
+	char buf[MAX_LINE], *line, *verb, *name, *path;
+	struct drive *drv;
+	struct job *job;
+
+	if(read_request(fd, buf, sizeof buf) == -1 || !(verb = next_word(&line, buf))) {
+		sendstr(fd, "failed: no job\n");
+		close(fd);
+		return;
+	}
+
+	if(strcmp(verb, "status") == 0) {
+		send_status(fd);
+		close(fd);
+		return;
+	}
+
+	if(strcmp(verb, "read") == 0) {
+		type = JOB_READ;
+	} else if(strcmp(verb, "write") == 0) {
+		type = JOB_WRITE;
+	} else if(strcmp(verb, "verify") == 0) {
+		type = JOB_VERIFY;
+	} else if(strcmp(verb, "compare") == 0) {
+		type = JOB_COMPARE;
+	} else {
+		sendstr(fd, "failed: unknown job, expected read, write, verify, compare or status\n");
+		close(fd);
+		return;
+	}
+
+	/* the image is the rest of the line, and may contain spaces */
+	name = next_word(&line, line);
+	path = line + strspn(line, " \t");
+	if(!name || !*path) {
+		sendstr(fd, "failed: expected <job> <drive> <image>\n");
+		close(fd);
+		return;
+	}
+	if(!(drv = find_drive(name))) {
+		sendstr(fd, "failed: no such drive\n");
+		close(fd);
+		return;
+	}
+
+	if(!(job = calloc(1, sizeof *job)) || !(job->path = malloc(strlen(path) + 1))) {
+		free(job);
+		sendstr(fd, "failed: out of memory\n");
+		close(fd);
+		return;
+	}
+	strcpy(job->path, path);
+	job->type = type;
+	job->fd = fd;
+	job->drv = drv;
+
+	/* only this thread queues jobs, so there can't be more ahead by the time it's queued */
+	pthread_mutex_lock(&drv->lock);
+	nahead = drv->nqueued + !!drv->cur;
+	pthread_mutex_unlock(&drv->lock);
+
+	if(nahead) {
+		reply(job, "info: queued behind %d job%s\n", nahead, nahead > 1 ? "s" : "");
+		if(job->gone) {
+			close(fd);
+			free(job->path);
+			free(job);
+			return;
+		}
+	}
+
+	pthread_mutex_lock(&drv->lock);
+	if(drv->tail) {
+		drv->tail->next = job;
+	} else {
+		drv->queue = job;
+	}
+	drv->tail = job;
+	drv->nqueued++;
+	pthread_cond_signal(&drv->cond);
+	pthread_mutex_unlock(&drv->lock);
+}
+
+/* reads up to the end of the first line, with a deadline */
+static int read_request(int fd, char *buf, int size)
+{
+	int len = 0, rd;
+	long deadline = get_msec() + REQUEST_MSEC, left;
+	struct pollfd pfd;
+	char *nl;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while(len < size - 1) {
+		if((left = deadline - get_msec()) <= 0 || poll(&pfd, 1, left) <= 0) {
+			return -1;
+		}
+		if((rd = read(fd, buf + len, size - 1 - len)) <= 0) {
+			break;
+		}
+		len += rd;
+		buf[len] = 0;
+		if((nl = strchr(buf, '\n'))) {
+			*nl = 0;
+			if(nl > buf && nl[-1] == '\r') nl[-1] = 0;
+			return 0;
+		}
+	}
+	buf[len] = 0;
+	return len > 0 ? 0 : -1;
+}
+
+/* splits off the next word of a line, and points rest past it */
+static char *next_word(char **rest, char *s)
+{
+	char *word;
+
+	s += strspn(s, " \t");
+	if(!*s) {
+		*rest = s;
+		return 0;
+	}
+	word = s;
+	s += strcspn(s, " \t");
+	if(*s) *s++ = 0;
+	*rest = s;
+	return word;
+}
+
+static struct drive *find_drive(const char *name)
+{
+	int i, idx;
+	char *endp;
+
+	idx = strtol(name, &endp, 10);
+	if(endp != name && !*endp) {
+		return idx >= 0 && idx < num_drives ? drives + idx : 0;
+	}
+	for(i=0; i<num_drives; i++) {
+		if(strcmp(drives[i].devfile, name) == 0) {
+			return drives + i;
+		}
+	}
+	return 0;
+}
+
+static void send_status(int fd)
+{
+	int i;
+	char buf[512];
+	static const char *motor_str[] = {"off", "reading", "writing"};
+
+	for(i=0; i<num_drives; i++) {
+		struct drive *drv = drives + i;
+
+		pthread_mutex_lock(&drv->lock);
+		sprintf(buf, "%d %s: motor %s, %s, %d queued\n", i, drv->devfile, motor_str[drv->motor],
+				drv->cur ? "busy" : "idle", drv->nqueued);
+		pthread_mutex_unlock(&drv->lock);
+		sendstr(fd, buf);
+	}
+	sendstr(fd, "ok\n");
+}
+
+static void reply(struct job *job, const char *fmt, ...)
+{
+	char buf[MAX_LINE];
+	va_list ap;
+
+	if(job->gone) return;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof buf, fmt, ap);
+	va_end(ap);
+
+	if(send(job->fd, buf, strlen(buf), MSG_NOSIGNAL) == -1) {
+		/* nobody is waiting for the result anymore */
+		abandon(job);
+	}
+}
+
+static void sendstr(int fd, const char *str)
+{
+	send(fd, str, strlen(str), MSG_NOSIGNAL);
+}
+
+static unsigned char *job_trackbuf(void *cls, int trk)
+{
+	struct job *job = cls;
+	return job_img[job->drv->idx] + trk * dgeom->nsec * 512;
+}
+
+static void job_progress(void *cls, int pass, int trk)
+{
+	struct job *job = cls;
+
+	/* afl_read_disk starts out not aborted, even if shut down before it started */
+	if(quit) {
+		afl_abort(job->drv->dev);
+	}
+	client_gone(job);
+}
+
+static void job_message(void *cls, int level, const char *msg)
+{
+	reply(cls, "%s: %s\n", level == AFL_ERROR ? "error" : "info", msg);
+}
+
+/* the client has nothing more to send, so a readable socket means it hung up */
+static int client_gone(struct job *job)
+{
+	char c;
+
+	if(!job->gone && recv(job->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+		abandon(job);
+	}
+	return job->gone;
+}
+
+/* stops the read of a job whose client went away, if it's the one running */
+static void abandon(struct job *job)
+{
+	struct drive *drv = job->drv;
+
+	job->gone = 1;
+
+	pthread_mutex_lock(&drv->lock);
+	if(job == drv->cur) {
+		afl_abort(drv->dev);
+	}
+	pthread_mutex_unlock(&drv->lock);
+}
+
+static int open_socket(const char *path)
+{
+	int s;
+	struct sockaddr_un addr;
+
+	if(strlen(path) >= sizeof addr.sun_path) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return -1;
+	}
+	if((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		perror("failed to create socket");
+		return -1;
+	}
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* a socket left over from a daemon which didn't exit cleanly */
+	if(connect(s, (struct sockaddr*)&addr, sizeof addr) == 0) {
+		fprintf(stderr, "another amigafloppyd is already listening on %s\n", path);
+		close(s);
+		return -1;
+	}
+	unlink(path);
+
+	if(bind(s, (struct sockaddr*)&addr, sizeof addr) == -1 || listen(s, 8) == -1) {
+		fprintf(stderr, "failed to listen on %s: %s\n", path, strerror(errno));
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+static long get_msec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, 0);
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void sighandler(int s)
+{
+	quit = 1;
+}
+
+static void print_usage(const char *argv0)
+{
+	printf("Usage: %s [options] <device>...\n", argv0);
+	printf("Keeps the drives ready between jobs, and runs the jobs sent to its socket,\n");
+	printf("one line each: read|write|verify|compare <drive> <image>, or status.\n");
+	printf("<drive> is the index of a device on the command line, or its name.\n");
+	printf("Options:\n");
+	printf(" -s <socket>  unix socket to listen on (default: " SOCK_DEFAULT ")\n");
+	printf(" -t <secs>    turn the motor off after this long without a job (default: %d)\n", IDLE_DEFAULT);
+	printf(" -r <retries> retries per bad track when reading (default: %d, or the\n", RETRIES_DEFAULT);
+	printf("              retries in the profile of the drive)\n");
+	printf(" --geometry <geom>  disk geometry of the images (default: dd)\n");
+	printf(" -h           print help and exit\n");
+	printf("e.g.: echo \"read 0 disk1.adf\" | nc -U " SOCK_DEFAULT "\n");
+}
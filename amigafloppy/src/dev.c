@@ -20,16 +20,22 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stddef.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <assert.h>
 #include <arpa/inet.h>
+#include <sys/time.h>
+#include <pthread.h>
 #include "dev.h"
 #include "serial.h"
-#include "opt.h"
+#include "pll.h"
+#include "correct.h"
 
 #ifdef __GNUC__
 #define PACKED	__attribute__ ((packed))
+#define FORCE_INLINE	inline __attribute__ ((always_inline))
 #else
 #define PACKED
+#define FORCE_INLINE	inline
 #endif
 
 #define MFM_HDR_FMT_OFFSET		(offsetof(struct sector_header, fmt) * 2)
@@ -37,6 +43,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define MFM_HDR_HSUM_OFFSET		(offsetof(struct sector_header, hdr_sum) * 2)
 #define MFM_HDR_DSUM_OFFSET		(offsetof(struct sector_header, data_sum) * 2)
 #define MFM_DATA_OFFSET			(sizeof(struct sector_header) * 2)
+#define MFM_SECTOR_SIZE			((sizeof(struct sector_header) + 512) * 2)
 
 struct sector_header {
 	unsigned char magic[4];
@@ -55,234 +62,1016 @@ struct sector_node {
 };
 
 #define TIMEOUT_MSEC	2000
-#define TRACK_SIZE		(0x1900 * 2 + 0x440)
-#define SECTORS_PER_TRACK	11
+#define DRAIN_MSEC		100
+#define TRACK_SIZE		(dev->geom->raw_size)
+#define SECTORS_PER_TRACK	(dev->geom->nsec)
+
+/* nominal length of one revolution of raw MFM, and how far the actual length
+ * may stray from it when looking for the point where the track repeats
+ */
+#define REV_SIZE		(dev->geom->rev_size)
+#define REV_MIN			(REV_SIZE * 92 / 100)
+#define REV_MAX			(REV_SIZE * 104 / 100)
+#define REV_MATCH_SIZE	32
+
+/* a track read captures a fixed number of bit cells, a bit more than one
+ * revolution, and the data streams out while it runs. So it takes about as
+ * long as that fraction of the measured revolution, plus USB latency.
+ */
+#define READ_SLACK_MSEC		150
+
+/* flags in the byte following the read command, and the trailer firmware 1.5
+ * sends after the end of the track data: byte count, sum of the bytes, and
+ * bytes lost to UART overruns, 16 bits each
+ */
+#define RDFLAG_WAIT_INDEX	0x01
+#define RDFLAG_TRAILER		0x02
+#define RDFLAG_TERNARY		0x04
+#define RDFLAG_ABORTABLE	0x08
+#define RDFLAG_FLUX			0x10
+#define TRAILER_SIZE		6
+#define TRAILER_STATUS_SIZE	7	/* with the read status, from firmware 1.7 */
+
+#define RDSTATUS_OK			0
+#define RDSTATUS_NO_FLUX	1
+#define RDSTATUS_NO_INDEX	2
+#define RDSTATUS_ABORTED	3
+
+/* with firmware 1.8, a read can be cut short by sending READ_ABORT, once what
+ * has been received so far has every sector. That's checked every time
+ * another ABORT_CHECK_STEP bytes of track data come in.
+ */
+#define READ_ABORT			'A'
+#define ABORT_CHECK_STEP	512
+
+/* firmware 1.6 can pack the pulse intervals as base-3 digits, 5 per byte,
+ * instead of 4 two-bit codes. Bytes above the 243 codes mark the end of data.
+ */
+#define TERNARY_CODES	243
+#define TERNARY_END		0xff
+
+/* firmware 1.9 can send the pulse intervals themselves instead (see pll.h),
+ * at two to a byte. The UART only keeps up with that for DD.
+ */
+#define FLUX_READ		(dev->flux && dev->use_flux)
+
+/* A flux read ends after 32 quarter cells per raw byte, and the firmware
+ * counts every interval as at least 4 of them, so a noisy track can take up to
+ * 4 bytes per raw byte, twice as many as a clean one.
+ */
+#define FLUX_MAX_SIZE	(TRACK_SIZE * 4)
+#define REPLY_MAX_SIZE	(DD_RAW_SIZE * 4 > GEOM_MAX_RAW_SIZE ? DD_RAW_SIZE * 4 : GEOM_MAX_RAW_SIZE)
+
+/* a transfer which doesn't match its trailer is retried this many times,
+ * before giving up on the track as a communication error
+ */
+#define LINK_RETRIES	3
+
+#define MSG_SIZE		256
+
+/* Commands can be sent back to back, and their replies matched in order
+ * afterwards, saving a USB round trip each. The firmware takes them from the
+ * UART one by one, and the UART holds up to 3 bytes while a command is busy:
+ * so a queue can have a slow command (a seek) followed by at most 3 bytes.
+ */
+#define CMDQ_BYTES		8
+#define CMDQ_CMDS		4
+
+struct cmd_queue {
+	unsigned char buf[CMDQ_BYTES];
+	int len, ncmd;
+	int failed;		/* which command failed */
+	char what[CMDQ_CMDS][32];	/* for error messages */
+};
 
-static int uncompress(unsigned char *dest, unsigned char *src, int size);
-static int align_track(unsigned char *buf, int size);
-static struct sector_node *find_sectors(unsigned char *buf, int size);
+static int get_fw_version(struct afl_device *dev, int *major, int *minor);
+static int receive_track(struct afl_device *dev, unsigned char *buf, struct cmd_queue *q);
+static unsigned int decode_track(struct afl_device *dev, unsigned char *resbuf, unsigned char *mfm,
+		unsigned char *weak, int size, int *dos, int vote);
+static int have_all_sectors(struct afl_device *dev, unsigned char *buf, int size);
+static int uncompress(struct afl_device *dev, unsigned char *dest, unsigned char *weak,
+		unsigned char *src, int size);
+static FORCE_INLINE int uncompress_len(unsigned char *dest, unsigned char *src, int size,
+		const int maxlen, const int ternary);
+static void init_ternary(void);
+static long read_timeout(struct afl_device *dev);
+static void drain(struct afl_device *dev);
+static long get_msec(void);
+static int setup_capture(struct afl_device *dev);
+static void copy_bits(unsigned char *dest, unsigned char *src, int size, int shift);
+static int find_sync(unsigned char *buf, int size);
+static int align_track(struct afl_device *dev, unsigned char *buf, unsigned char *weak, int size);
+static struct sector_node *find_sectors(struct afl_device *dev, unsigned char *buf, int size);
 static void debug_print(unsigned char *dest, int size);
 static void dbg_print_header(struct sector_header *hdr);
 static void decode_mfm(unsigned char *dest, unsigned char *src, int blksz);
 static uint32_t checksum(void *buf, int size);
+static uint32_t mfm_checksum(unsigned char *src, int blksz);
+static void encode_mfm(unsigned char *dest, const unsigned char *src, int blksz);
+static void add_clock_bits(unsigned char *buf, int size, int prevbit);
+static int read_byte(struct afl_device *dev);
+static int command(struct afl_device *dev, char c);
+static void cmdq_add(struct cmd_queue *q, const char *cmd, int len, const char *what);
+static int cmdq_submit(struct afl_device *dev, struct cmd_queue *q);
+static void queue_seek(struct cmd_queue *q, int cyl);
+static int track_period(struct afl_device *dev, unsigned char *buf, int size);
+
+/* the three symbols (as two-bit codes 1-3) in each base-3 packed byte */
+static unsigned char ternary_sym[TERNARY_CODES][5];
+static pthread_once_t ternary_once = PTHREAD_ONCE_INIT;
 
-static int dev_fd = -1;
+static const unsigned char magic[] = { 0xaa, 0xaa, 0xaa, 0xaa, 0x44, 0x89, 0x44, 0x89 };
 
-int init_device(const char *devname)
+int init_device(struct afl_device *dev, const char *devname)
 {
-	int major, minor;
+	dev->cyl = dev->head = -1;
+	dev->rev_usec = NOMINAL_REV_USEC;
+	dev->read_slack = READ_SLACK_MSEC;
+	dev->hdr_track = -1;
 
-	if((dev_fd = ser_open(devname, 2000000, SER_HWFLOW)) == -1) {
+	if((dev->fd = ser_open(devname, 2000000, SER_HWFLOW)) == -1) {
 		return -1;
 	}
-	ser_nonblock(dev_fd);
+	ser_nonblock(dev->fd);
 
-	if(get_fw_version(&major, &minor) == -1) {
-		ser_close(dev_fd);
-		dev_fd = -1;
+	if(get_fw_version(dev, &dev->fw_major, &dev->fw_minor) == -1) {
+		ser_close(dev->fd);
+		dev->fd = -1;
 		return -1;
 	}
-	if(opt.verbose) {
-		printf("Firmware version: %d.%d\n", major, minor);
+
+	dev->use_trailer = FW_AT_LEAST(1, 5);
+	dev->trailer_size = FW_AT_LEAST(1, 7) ? TRAILER_STATUS_SIZE : TRAILER_SIZE;
+	if((dev->use_ternary = FW_AT_LEAST(1, 6))) {
+		pthread_once(&ternary_once, init_ternary);
 	}
+	dev->use_abort = FW_AT_LEAST(1, 8);
+	dev->use_flux = FW_AT_LEAST(1, 9) && dev->geom->density == GEOM_DD;
 
-	return dev_fd;
+	if(setup_capture(dev) == -1) {
+		ser_close(dev->fd);
+		dev->fd = -1;
+		return -1;
+	}
+	return 0;
 }
 
-void shutdown_device(void)
+/* Firmware 1.4 added HD capture, selected with the 'D' command, and seeking
+ * up to cylinder 83. Older firmware only does DD, up to cylinder 81.
+ */
+static int setup_capture(struct afl_device *dev)
 {
-	ser_close(dev_fd);
+	unsigned char buf[2];
+
+	if(!FW_AT_LEAST(1, 4)) {
+		if(dev->geom->density != GEOM_DD || dev->geom->ncyl > 82) {
+			dev_message(dev, AFL_ERROR, "firmware %d.%d can't read %s disks, version 1.4 or later is needed",
+					dev->fw_major, dev->fw_minor, dev->geom->name);
+			return -1;
+		}
+		return 0;
+	}
+
+	buf[0] = 'D';
+	buf[1] = dev->geom->density;
+	if(ser_write(dev->fd, buf, 2) != 2 || wait_response(dev) <= 0) {
+		dev_message(dev, AFL_ERROR, "failed to set the capture mode for %s disks", dev->geom->name);
+		return -1;
+	}
+	return 0;
 }
 
-int wait_response(void)
+void shutdown_device(struct afl_device *dev)
 {
-	char res;
+	if(dev->fd >= 0) {
+		ser_close(dev->fd);
+		dev->fd = -1;
+	}
+}
+
+void dev_message(struct afl_device *dev, int level, const char *fmt, ...)
+{
+	va_list ap;
+	char buf[MSG_SIZE];
 
-	if(dev_fd < 0) return -1;
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof buf, fmt, ap);
+	va_end(ap);
 
-	if(!ser_wait(dev_fd, TIMEOUT_MSEC)) {
-		fprintf(stderr, "timeout while waiting for response from device\n");
-		return -1;
+	if(dev->cb.message) {
+		dev->cb.message(dev->cls, level, buf);
+	} else if(level == AFL_ERROR) {
+		fprintf(stderr, "%s\n", buf);
 	}
-	if(ser_read(dev_fd, &res, 1) != 1) {
-		fprintf(stderr, "failed to read response from device\n");
+}
+
+int wait_response(struct afl_device *dev)
+{
+	int res;
+
+	if((res = read_byte(dev)) == -1) {
 		return -1;
 	}
 	return res == '1' ? 1 : 0;
 }
 
-static int command(char c)
+static int read_byte(struct afl_device *dev)
+{
+	unsigned char res;
+
+	if(dev->fd < 0) return -1;
+
+	if(!ser_wait(dev->fd, TIMEOUT_MSEC)) {
+		dev_message(dev, AFL_ERROR, "timeout while waiting for response from device");
+		return -1;
+	}
+	if(ser_read(dev->fd, &res, 1) != 1) {
+		dev_message(dev, AFL_ERROR, "failed to read response from device");
+		return -1;
+	}
+	return res;
+}
+
+static int command(struct afl_device *dev, char c)
+{
+	if(dev->fd < 0) return -1;
+
+	if(ser_write(dev->fd, &c, 1) != 1) {
+		dev_message(dev, AFL_ERROR, "failed to send command to the device");
+		return -1;
+	}
+	return wait_response(dev);
+}
+
+static void cmdq_add(struct cmd_queue *q, const char *cmd, int len, const char *what)
 {
-	if(dev_fd < 0) return -1;
+	assert(q->len + len <= CMDQ_BYTES && q->ncmd < CMDQ_CMDS);
 
-	if(ser_write(dev_fd, &c, 1) != 1) {
-		fprintf(stderr, "failed to send command to the device\n");
+	memcpy(q->buf + q->len, cmd, len);
+	q->len += len;
+	strcpy(q->what[q->ncmd++], what);
+}
+
+/* Sends all the queued commands at once, and then checks their replies in
+ * order. After a failure the commands behind it still run, so everything they
+ * send is drained, and the caller has to assume nothing about where the head
+ * is. Returns 0 if every command succeeded, -1 otherwise. q->failed is the
+ * index of the failed command, or the number of commands if none failed.
+ */
+static int cmdq_submit(struct afl_device *dev, struct cmd_queue *q)
+{
+	int i, res;
+
+	if(!q->len) return 0;
+
+	q->failed = 0;
+	if(dev->fd < 0) return -1;
+
+	if(ser_write(dev->fd, q->buf, q->len) != q->len) {
+		dev_message(dev, AFL_ERROR, "failed to send command to the device");
 		return -1;
 	}
-	return wait_response();
+	for(i=0; i<q->ncmd; i++) {
+		if((res = wait_response(dev)) <= 0) {
+			if(res == 0) {
+				dev_message(dev, AFL_ERROR, "failed to %s", q->what[i]);
+			} else {
+				dev->rd_status = READ_TIMEOUT;
+			}
+			q->failed = i;
+			drain(dev);
+			return -1;
+		}
+	}
+	q->failed = q->ncmd;
+	return 0;
 }
 
-int get_fw_version(int *major, int *minor)
+static int get_fw_version(struct afl_device *dev, int *major, int *minor)
 {
 	char buf[5] = {0};
 
-	if(command('?') <= 0) {
+	if(command(dev, '?') <= 0) {
 		return -1;
 	}
 
-	if(ser_read(dev_fd, buf, 4) != 4) {
-		fprintf(stderr, "failed to read firmware version\n");
+	if(ser_read(dev->fd, buf, 4) != 4) {
+		dev_message(dev, AFL_ERROR, "failed to read firmware version");
 		return -1;
 	}
 
 	if(sscanf(buf, "V%d.%d", major, minor) != 2) {
-		fprintf(stderr, "got malformed response to version command\n");
+		dev_message(dev, AFL_ERROR, "got malformed response to version command");
+		return -1;
+	}
+	return 0;
+}
+
+void afl_fw_version(struct afl_device *dev, int *major, int *minor)
+{
+	*major = dev->fw_major;
+	*minor = dev->fw_minor;
+}
+
+long afl_rev_usec(struct afl_device *dev)
+{
+	return dev->rev_usec;
+}
+
+int afl_begin_read(struct afl_device *dev)
+{
+	if(command(dev, '+') <= 0) {
+		dev_message(dev, AFL_ERROR, "begin_read failed");
+		return -1;
+	}
+	if(FW_AT_LEAST(1, 7) && measure_rotation(dev) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+/* times a revolution of the disk, to know how long reads should take, and to
+ * fail right away if there's no disk in the drive
+ */
+int measure_rotation(struct afl_device *dev)
+{
+	int res, hi, lo;
+
+	if((res = command(dev, 'R')) == -1) {
+		return -1;
+	}
+	if(!res) {
+		dev_message(dev, AFL_ERROR, "no index pulses: no disk in the drive, or it's not spinning");
+		dev->rd_status = READ_NO_INDEX;
+		return -1;
+	}
+	if((hi = read_byte(dev)) == -1 || (lo = read_byte(dev)) == -1) {
+		return -1;
+	}
+	dev->rev_usec = ((hi << 8) | lo) * 4;
+	return 0;
+}
+
+/* Zero fields of the profile keep the defaults. Only the read slack applies
+ * to firmware older than 2.0. A profile measured in the other capture mode
+ * only sets the step timing: its thresholds would misclassify every pulse.
+ */
+int afl_set_profile(struct afl_device *dev, const struct afl_profile *prof)
+{
+	int same = prof->density == dev->geom->density;
+
+	dev->read_slack = same && prof->read_slack_ms > 0 ? prof->read_slack_ms : READ_SLACK_MSEC;
+
+	if(!FW_AT_LEAST(2, 0)) {
+		return 0;
+	}
+	if(set_step_timing(dev, prof->step_ms > 0 ? prof->step_ms : STEP_MS_DEFAULT,
+				prof->settle_ms > 0 ? prof->settle_ms : SETTLE_MS_DEFAULT) == -1) {
+		return -1;
+	}
+	if(!same) {
+		return set_thresholds(dev, 0, 0);
+	}
+	return set_thresholds(dev, prof->short_max, prof->long_min);
+}
+
+int set_step_timing(struct afl_device *dev, int step_ms, int settle_ms)
+{
+	char buf[3];
+
+	buf[0] = 'T';
+	buf[1] = step_ms;
+	buf[2] = settle_ms;
+	if(step_ms < STEP_MS_MIN || step_ms > 255 || settle_ms < 0 || settle_ms > 255 ||
+			ser_write(dev->fd, buf, 3) != 3 || wait_response(dev) <= 0) {
+		dev_message(dev, AFL_ERROR, "failed to set the step timing (%d/%d ms)", step_ms, settle_ms);
 		return -1;
 	}
 	return 0;
 }
 
-int begin_read(void)
+int set_thresholds(struct afl_device *dev, int short_max, int long_min)
 {
-	if(command('+') <= 0) {
-		fprintf(stderr, "begin_read failed\n");
+	char buf[3];
+
+	if(short_max <= 0 || long_min <= 0) {
+		short_max = dev->geom->density == GEOM_HD ? HD_SHORT_MAX : DD_SHORT_MAX;
+		long_min = dev->geom->density == GEOM_HD ? HD_LONG_MIN : DD_LONG_MIN;
+	}
+
+	buf[0] = 'C';
+	buf[1] = short_max;
+	buf[2] = long_min;
+	if(short_max >= long_min || long_min > 255 || ser_write(dev->fd, buf, 3) != 3 ||
+			wait_response(dev) <= 0) {
+		dev_message(dev, AFL_ERROR, "failed to set the pulse thresholds (%d/%d)", short_max, long_min);
 		return -1;
 	}
 	return 0;
 }
 
-int begin_write(void)
+int afl_begin_write(struct afl_device *dev)
 {
-	if(command('~') <= 0) {
-		fprintf(stderr, "begin_write failed\n");
+	if(command(dev, '~') <= 0) {
+		dev_message(dev, AFL_ERROR, "begin_write failed");
 		return -1;
 	}
 	return 0;
 }
 
-int end_access(void)
+int afl_end_access(struct afl_device *dev)
 {
-	if(command('-') <= 0) {
-		fprintf(stderr, "end_access failed\n");
+	if(command(dev, '-') <= 0) {
+		dev_message(dev, AFL_ERROR, "end_access failed");
 		return -1;
 	}
 	return 0;
 }
 
-int select_head(int s)
+int select_head(struct afl_device *dev, int s)
 {
-	if(command(s ? '[' : ']') <= 0) {
-		fprintf(stderr, "select_head(%d) failed\n", s);
+	if(command(dev, s ? '[' : ']') <= 0) {
+		dev_message(dev, AFL_ERROR, "select_head(%d) failed", s);
+		dev->head = -1;
 		return -1;
 	}
+	dev->head = s;
 	return 0;
 }
 
-int move_head(int track)
+int move_head(struct afl_device *dev, int track)
 {
 	char buf[4];
 
 	if(track > 99) {
-		fprintf(stderr, "move_head(%d): invalid track number\n", track);
+		dev_message(dev, AFL_ERROR, "move_head(%d): invalid track number", track);
 		return -1;
 	}
 
 	if(track <= 0) {
-		return command('.');
+		return command(dev, '.');
 	}
 	sprintf(buf, "#%02d", track);
 
-	ser_write(dev_fd, buf, 3);
-	return wait_response();
+	ser_write(dev->fd, buf, 3);
+	return wait_response(dev);
 }
 
-int read_track(unsigned char *resbuf)
+int seek_cylinder(struct afl_device *dev, int cyl, int reseek)
 {
-	unsigned char *ptr, buf[TRACK_SIZE];
-	char waitidx = 0;
-	int i, sz, rdbytes, total_read = 0;
-	struct sector_node *slist;
+	struct cmd_queue q = {{0}};
+
+	if(cyl == dev->cyl) {
+		if(!reseek) return 0;
+		/* step away and back again, to have the head settle anew */
+		dev->cyl = -1;
+		queue_seek(&q, cyl > 0 ? cyl - 1 : cyl + 1);
+	}
+	queue_seek(&q, cyl);
 
-	if(command('<') <= 0) {
+	if(cmdq_submit(dev, &q) == -1) {
+		dev->cyl = -1;
 		return -1;
 	}
-	ser_write(dev_fd, &waitidx, 1);
+	dev->cyl = cyl;
+	return 0;
+}
 
-	ptr = buf;
+static void queue_seek(struct cmd_queue *q, int cyl)
+{
+	char cmd[16], what[32];
+
+	sprintf(what, "seek to cylinder %d", cyl);
+	if(cyl <= 0) {
+		cmdq_add(q, ".", 1, what);
+	} else {
+		sprintf(cmd, "#%02d", cyl);
+		cmdq_add(q, cmd, 3, what);
+	}
+}
+
+int read_track(struct afl_device *dev, unsigned char *resbuf)
+{
+	return read_track_at(dev, -1, resbuf);
+}
+
+/* a negative trk reads wherever the head is */
+int read_track_at(struct afl_device *dev, int trk, unsigned char *resbuf)
+{
+	unsigned char buf[REPLY_MAX_SIZE + TRAILER_STATUS_SIZE + 1], mfmbuf[GEOM_MAX_RAW_SIZE];
+	unsigned char weakbuf[GEOM_MAX_RAW_SIZE], *weak = FLUX_READ ? weakbuf : 0;
+	int i, total_read;
+	struct cmd_queue q = {{0}};
+
+	dev->rawtrk_size = dev->rawtrk_dos = 0;
+	dev->rd_status = READ_OK;
+
+	/* positioning goes out along with the read, for whatever has changed */
+	if(trk >= 0) {
+		if(trk >> 1 != dev->cyl) {
+			queue_seek(&q, trk >> 1);
+		}
+		if((trk & 1) != dev->head) {
+			cmdq_add(&q, trk & 1 ? "[" : "]", 1, trk & 1 ? "select head 1" : "select head 0");
+		}
+		dev->cyl = trk >> 1;
+		dev->head = trk & 1;
+	}
+
+	/* a bad transfer says nothing about the disk, so read it again right
+	 * away, rather than letting it count as a failed read of the track
+	 */
+	for(i=0; ; i++) {
+		if((total_read = receive_track(dev, buf, &q)) >= 0) {
+			break;
+		}
+		if(total_read == -1) {
+			if(q.failed < q.ncmd - 1 && dev->rd_status == READ_OK) {
+				dev->rd_status = READ_SEEK;
+			}
+			return -1;
+		}
+		q.len = q.ncmd = 0;
+		if(i >= LINK_RETRIES) {
+			dev->rd_status = READ_LINK;
+			return -1;
+		}
+		dev->lstats.retries++;
+	}
+
+	if(FLUX_READ && dev->flux_hist) {
+		for(i=0; i<total_read - 1; i++) {
+			dev->flux_hist[buf[i] >> 4]++;
+			dev->flux_hist[buf[i] & 0xf]++;
+		}
+	}
+
+	dev->rawtrk_size = uncompress(dev, dev->rawtrk, weak, buf, total_read);
+	memcpy(mfmbuf, dev->rawtrk, dev->rawtrk_size);
+
+	return decode_track(dev, resbuf, mfmbuf, weak, dev->rawtrk_size, &dev->rawtrk_dos, 1);
+}
+
+/* Finds the sectors in a buffer of raw MFM, and validates each against its data
+ * checksum while still MFM encoded. Only then the good ones are decoded straight
+ * to their final position in resbuf, if given. The same sector may appear
+ * twice, and only one of the copies needs to be good. Sets dos to whether any
+ * valid sector header was found. Returns the mask of good sectors.
+ * With vote, bad sectors are kept in dev->votes for recover_track, along with
+ * their weak bits, if there's a bitmap of them parallel to mfm.
+ */
+static unsigned int decode_track(struct afl_device *dev, unsigned char *resbuf, unsigned char *mfm,
+		unsigned char *weak, int size, int *dos, int vote)
+{
+	unsigned int found = 0;
+	struct sector_node *slist, *sec;
+
+	dev->hdr_track = -1;
+	if((size = align_track(dev, mfm, weak, size)) == -1) {
+		return 0;
+	}
+
+	if((slist = find_sectors(dev, mfm, size)) && dos) {
+		*dos = 1;
+	}
+
+	while(slist) {
+		int idx;
+
+		sec = slist;
+		slist = slist->next;
+		idx = sec->hdr.sector;
+		if(dev->hdr_track < 0) {
+			dev->hdr_track = sec->hdr.track;
+		}
+
+		if(idx >= SECTORS_PER_TRACK) {
+			if(!dev->quiet) {
+				dev_message(dev, AFL_ERROR, "Track %d: invalid sector number %d", sec->hdr.track, idx);
+			}
+		} else if(!(found & (1 << idx))) {
+			if(mfm_checksum(sec->rawptr + MFM_DATA_OFFSET, 512) != ntohl(sec->hdr.data_sum)) {
+				if(!dev->quiet) {
+					dev_message(dev, AFL_ERROR, "Track %d, sector %d data checksum error", sec->hdr.track, idx);
+				}
+				if(vote && dev->votes) {
+					vote_add(dev->votes, sec->hdr.track, idx, sec->rawptr + MFM_HDR_DSUM_OFFSET,
+							weak ? weak + (sec->rawptr - mfm) + MFM_HDR_DSUM_OFFSET : 0);
+				}
+			} else {
+				if(resbuf) {
+					decode_mfm(resbuf + idx * 512, sec->rawptr + MFM_DATA_OFFSET, 512);
+				}
+				found |= 1 << idx;
+			}
+		}
+		free(sec);
+	}
+
+	return found;
+}
+
+unsigned int recover_track(struct afl_device *dev, int trk, unsigned char *resbuf, unsigned int valid)
+{
+	int i, ncopies, disputed, narrow;
+	unsigned int found = 0;
+	uint32_t sum;
+	unsigned char mfm[VOTE_SIZE], weak[VOTE_SIZE], *data = mfm + MFM_DATA_OFFSET - MFM_HDR_DSUM_OFFSET;
+	struct correction corr;
+
+	assert(VOTE_SIZE == MFM_SECTOR_SIZE - MFM_HDR_DSUM_OFFSET);
+
+	for(i=0; i<SECTORS_PER_TRACK; i++) {
+		if(valid & (1 << i)) continue;
+
+		if(!(ncopies = vote_majority(dev->votes, trk, i, mfm, weak, &disputed, &narrow))) {
+			continue;
+		}
+
+		decode_mfm((unsigned char*)&sum, mfm, 4);
+		if(ncopies >= VOTE_MIN_COPIES && mfm_checksum(data, 512) == ntohl(sum)) {
+			dev_message(dev, AFL_INFO, "Track %d, sector %d recovered by a majority of %d reads: "
+					"%d bits disputed, %d of them by a single vote", trk, i, ncopies, disputed, narrow);
+
+		} else if(correct_sector(mfm, weak, &corr)) {
+			dev_message(dev, AFL_INFO, "Track %d, sector %d corrected by flipping %d bit%s: the only match "
+					"among %d candidate%s, %d%% chance of a false match", trk, i, corr.nbits,
+					corr.nbits > 1 ? "s" : "", corr.ntried, corr.ntried > 1 ? "s" : "", corr.risk_pct);
+
+		} else {
+			if(corr.nmatched > 1) {
+				dev_message(dev, AFL_INFO, "Track %d, sector %d: %d different corrections match the checksum, "
+						"none taken", trk, i, corr.nmatched);
+			} else if(ncopies >= VOTE_MIN_COPIES) {
+				dev_message(dev, AFL_INFO, "Track %d, sector %d: the majority of %d reads fails the checksum too",
+						trk, i, ncopies);
+			}
+			continue;
+		}
+
+		decode_mfm(resbuf + i * 512, data, 512);
+		found |= 1 << i;
+	}
+	return found;
+}
+
+/* checks whether the start of a read has every sector of the track already */
+static int have_all_sectors(struct afl_device *dev, unsigned char *buf, int size)
+{
+	unsigned int found;
+	int quiet = dev->quiet;
+
+	if((size = uncompress(dev, dev->scratch, 0, buf, size)) < SECTORS_PER_TRACK * (int)MFM_SECTOR_SIZE) {
+		return 0;
+	}
+
+	/* the whole read is decoded again once it's in, so this doesn't vote */
+	dev->quiet = 1;
+	found = decode_track(dev, 0, dev->scratch, 0, size, 0, 0);
+	dev->quiet = quiet;
+
+	return found == (1u << SECTORS_PER_TRACK) - 1;
+}
+
+void afl_link_stats(struct afl_device *dev, struct afl_link_stats *st)
+{
+	*st = dev->lstats;
+}
+
+/* Sends the read command, and receives the compressed track data to buf, up to
+ * and including the end of data marker. If the firmware sends a trailer, it's
+ * checked against the data received. Returns the size of the data, -1 on
+ * comm. error, or -2 if the data didn't come through intact.
+ */
+static int receive_track(struct afl_device *dev, unsigned char *buf, struct cmd_queue *q)
+{
+	unsigned char *ptr, *end = 0, flags = 0, endmark = 0, abort = READ_ABORT;
+	char cmd[2];
+	int i, sz, rdbytes, total_read = 0, need, next_check = 0;
+	unsigned int count, sum;
+	long deadline, left;
+
+	if(dev->use_trailer) {
+		flags |= RDFLAG_TRAILER;
+	}
+	if(FLUX_READ) {
+		flags |= RDFLAG_FLUX;
+	} else if(dev->use_ternary) {
+		flags |= RDFLAG_TERNARY;
+		endmark = TERNARY_END;
+	}
+	if(dev->use_abort) {
+		flags |= RDFLAG_ABORTABLE;
+		next_check = ABORT_CHECK_STEP;
+	}
 
-	while(total_read < TRACK_SIZE) {
-		if(!ser_wait(dev_fd, TIMEOUT_MSEC)) {
-			fprintf(stderr, "timeout while reading track\n");
+	/* nothing may follow the flags: any byte coming in during the read aborts it */
+	cmd[0] = '<';
+	cmd[1] = flags;
+	cmdq_add(q, cmd, 2, "start reading the track");
+	if(cmdq_submit(dev, q) == -1) {
+		dev->cyl = dev->head = -1;
+		return -1;
+	}
+
+	ptr = buf;
+	need = (FLUX_READ ? FLUX_MAX_SIZE : TRACK_SIZE) + 1;
+	assert(need <= REPLY_MAX_SIZE + 1);
+	deadline = get_msec() + read_timeout(dev);
+
+	/* the track data never contains the end marker byte, so the first one
+	 * marks the end of it, and then there's just the trailer left to read
+	 */
+	while(total_read < need) {
+		if((left = deadline - get_msec()) < 1) left = 1;
+		if(!ser_wait(dev->fd, left)) {
+			dev_message(dev, AFL_ERROR, "timeout while reading track");
+			dev->rd_status = READ_TIMEOUT;
+			drain(dev);
 			return -1;
 		}
-		sz = TRACK_SIZE - total_read;
-		if((rdbytes = ser_read(dev_fd, ptr, sz)) <= 0) {
-			fprintf(stderr, "failed to read track\n");
+		sz = need - total_read;
+		if((rdbytes = ser_read(dev->fd, ptr, sz)) <= 0) {
+			dev_message(dev, AFL_ERROR, "failed to read track");
 			return -1;
 		}
 
+		if(!end && (end = memchr(ptr, endmark, rdbytes))) {
+			need = end - buf + 1 + (dev->use_trailer ? dev->trailer_size : 0);
+		}
 		ptr += rdbytes;
 		total_read += rdbytes;
 
-		if(!buf[total_read - 1]) {
-			break;	/* end of data */
+		/* stop the read as soon as we have every sector. If the abort
+		 * crosses the end of the read, the firmware ignores it.
+		 */
+		if(!end && next_check && total_read >= next_check) {
+			if(have_all_sectors(dev, buf, total_read)) {
+				ser_write(dev->fd, &abort, 1);
+				next_check = 0;
+			} else {
+				next_check = total_read + ABORT_CHECK_STEP;
+			}
 		}
 	}
+	if(!end) {
+		/* too long, the rest of it would be taken for the next reply */
+		drain(dev);
+		dev->lstats.errors++;
+		dev_message(dev, AFL_INFO, "link: no end of the track data in %d bytes, reading again", total_read);
+		return -2;
+	}
 
-	total_read = uncompress(resbuf, buf, total_read);
+	total_read = end - buf + 1;
+	dev->lstats.reads++;
+	dev->lstats.bytes += total_read;
 
-	/* move uncompressed data back to the temporary buffer */
-	memcpy(buf, resbuf, total_read);
+	if(!dev->use_trailer) {
+		return total_read;
+	}
 
-	if(align_track(buf, total_read) == -1) {
-		return -1;
+	sum = 0;
+	for(i=0; i<total_read - 1; i++) {
+		sum += buf[i];
+	}
+	count = (end[1] << 8) | end[2];
+	dev->lstats.overruns += (end[5] << 8) | end[6];
+
+	if(end[5] || end[6]) {
+		dev->lstats.errors++;
+		dev_message(dev, AFL_INFO, "link: %d bytes lost to UART overruns, reading again",
+				(end[5] << 8) | end[6]);
+		return -2;
+	}
+	if(count != total_read - 1 || ((end[3] << 8) | end[4]) != (sum & 0xffff)) {
+		dev->lstats.errors++;
+		dev_message(dev, AFL_INFO, "link: got %d of %u bytes%s, reading again", total_read - 1,
+				count, count == total_read - 1 ? " with a bad checksum" : "");
+		return -2;
 	}
 
-	if(!(slist = find_sectors(buf, total_read))) {
-		return -1;
+	if(dev->trailer_size == TRAILER_STATUS_SIZE) {
+		if(end[7] == RDSTATUS_NO_FLUX) {
+			dev->rd_status = READ_NO_FLUX;
+		} else if(end[7] == RDSTATUS_NO_INDEX) {
+			dev->rd_status = READ_NO_INDEX;
+		} else if(end[7] == RDSTATUS_ABORTED) {
+			dev->lstats.early++;
+		}
 	}
+	return total_read;
+}
 
-	ptr = resbuf;
-	for(i=0; i<SECTORS_PER_TRACK; i++) {
-		struct sector_node *sec = slist;
-		while(sec) {
-			if(sec->hdr.sector == i) {
-				uint32_t sum;
+int last_read_status(struct afl_device *dev)
+{
+	return dev->rd_status;
+}
 
-				decode_mfm(ptr, sec->rawptr + MFM_DATA_OFFSET, 512);
+/* in msec, see NOMINAL_REV_USEC */
+long track_msec(struct afl_device *dev)
+{
+	return (long)TRACK_SIZE * (dev->rev_usec / 100) / REV_SIZE / 10;
+}
 
-				sum = checksum(ptr, 512);
-				if(sum != ntohl(sec->hdr.data_sum)) {
-					fprintf(stderr, "Track %d, sector %d data checksum error\n", sec->hdr.track, sec->hdr.sector);
-					return -1;
-				}
+static long read_timeout(struct afl_device *dev)
+{
+	return track_msec(dev) + dev->read_slack;
+}
 
-				ptr += 512;
-				break;
+/* after a timeout, anything the device might still send would be taken for
+ * the response to the next command, so wait until it goes quiet
+ */
+static void drain(struct afl_device *dev)
+{
+	char buf[256];
+
+	while(ser_wait(dev->fd, DRAIN_MSEC) && ser_read(dev->fd, buf, sizeof buf) > 0);
+}
+
+static long get_msec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, 0);
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+int last_track_raw(struct afl_device *dev, unsigned char **mfm, int *dos)
+{
+	int i, bits, start, pos;
+	unsigned char *rawtrk = dev->rawtrk, *rawrev = dev->rawrev;
+
+	if(!dev->rawtrk_size) return -1;
+
+	/* one revolution, rotated to start at the first sync marker if any */
+	bits = track_period(dev, rawtrk, dev->rawtrk_size);
+	if((start = find_sync(rawtrk, dev->rawtrk_size)) == -1) {
+		start = 0;
+	}
+	start %= bits;
+
+	memset(rawrev, 0, sizeof dev->rawrev);
+	for(i=0; i<bits; i++) {
+		pos = (start + i) % bits;
+		if(rawtrk[pos >> 3] & (0x80 >> (pos & 7))) {
+			rawrev[i >> 3] |= 0x80 >> (i & 7);
+		}
+	}
+
+	*mfm = rawrev;
+	*dos = dev->rawtrk_dos;
+	return bits;
+}
+
+/* Finds the length of one revolution in bits, by looking for the point where
+ * the start of the data comes around again. The read starts at an arbitrary
+ * point of the track, and runs a bit longer than a revolution. If the start
+ * can't be found again (weak bits, or an odd track length), the nominal
+ * revolution length is used.
+ */
+static int track_period(struct afl_device *dev, unsigned char *buf, int size)
+{
+	int i, j;
+	unsigned char tmp[REV_MATCH_SIZE];
+
+	for(i=REV_MIN; i<REV_MAX && i < size - REV_MATCH_SIZE - 1; i++) {
+		for(j=0; j<8; j++) {
+			copy_bits(tmp, buf + i, REV_MATCH_SIZE, j);
+			if(memcmp(tmp, buf, REV_MATCH_SIZE) == 0) {
+				return i * 8 + j;
 			}
-			sec = sec->next;
 		}
+	}
+	return (size < REV_SIZE ? size : REV_SIZE) * 8;
+}
 
-		if(!sec) {
-			fprintf(stderr, "\nread_track: failed to find sector %d\n", i);
-			return -1;
+int write_track(struct afl_device *dev, const unsigned char *mfm, int size, int from_index)
+{
+	int res;
+	unsigned char hdr[3];
+
+	if(command(dev, '>') <= 0) {
+		dev_message(dev, AFL_ERROR, "write_track: device not in write mode");
+		return -1;
+	}
+	if((res = read_byte(dev)) != 'Y') {
+		if(res == 'N') {
+			dev_message(dev, AFL_ERROR, "write_track: disk is write protected");
 		}
+		return -1;
+	}
+
+	hdr[0] = size >> 8;
+	hdr[1] = size & 0xff;
+	hdr[2] = from_index ? 1 : 0;
+	ser_write(dev->fd, hdr, 3);
+
+	if((res = read_byte(dev)) != '!') {
+		dev_message(dev, AFL_ERROR, "write_track: unexpected response: %d", res);
+		return -1;
+	}
+
+	/* the device paces us with hardware flow control while it writes */
+	ser_block(dev->fd);
+	res = ser_write(dev->fd, mfm, size);
+	ser_nonblock(dev->fd);
+	if(res != size) {
+		dev_message(dev, AFL_ERROR, "write_track: failed to send track data");
+		return -1;
 	}
 
+	if((res = read_byte(dev)) != '1') {
+		if(res == 'X') {
+			dev_message(dev, AFL_ERROR, "write_track: buffer underflow, we didn't send data fast enough");
+		}
+		return -1;
+	}
 	return 0;
 }
 
-static int uncompress(unsigned char *dest, unsigned char *src, int size)
+int encode_track(const struct geometry *g, unsigned char *dest, const unsigned char *data, int trk)
 {
-	int i, j;
+	int i;
+	unsigned char *ptr = dest;
+	struct sector_header hdr;
+
+	memset(dest, 0, g->mfm_size);
+
+	for(i=0; i<g->nsec; i++) {
+		memset(&hdr, 0, sizeof hdr);
+		hdr.fmt = 0xff;
+		hdr.track = trk;
+		hdr.sector = i;
+		hdr.sec_to_gap = g->nsec - i;
+		hdr.hdr_sum = htonl(checksum(&hdr.fmt, 20));
+		hdr.data_sum = htonl(checksum((void*)data, 512));
+
+		/* the sync words have a deliberately missing clock bit, so they are
+		 * put in place after adding the clock bits. Leave their data bits in
+		 * there meanwhile, for the clock bit following them to come out right.
+		 */
+		ptr[4] = ptr[6] = 0x44;
+		ptr[5] = ptr[7] = 0x01;
+		encode_mfm(ptr + MFM_HDR_FMT_OFFSET, &hdr.fmt, 4);
+		encode_mfm(ptr + MFM_HDR_OSINFO_OFFSET, hdr.osinfo, 16);
+		encode_mfm(ptr + MFM_HDR_HSUM_OFFSET, (unsigned char*)&hdr.hdr_sum, 4);
+		encode_mfm(ptr + MFM_HDR_DSUM_OFFSET, (unsigned char*)&hdr.data_sum, 4);
+		encode_mfm(ptr + MFM_DATA_OFFSET, data, 512);
+
+		data += 512;
+		ptr += MFM_SECTOR_SIZE;
+	}
+
+	add_clock_bits(dest, g->mfm_size, 0);
+
+	ptr = dest;
+	for(i=0; i<g->nsec; i++) {
+		memcpy(ptr + 4, magic + 4, 4);
+		ptr += MFM_SECTOR_SIZE;
+	}
+	return g->mfm_size;
+}
+
+/* The decoding loop is instantiated for each capture length, so that the
+ * bound in the inner loop is a constant.
+ */
+static int uncompress(struct afl_device *dev, unsigned char *dest, unsigned char *weak,
+		unsigned char *src, int size)
+{
+	if(FLUX_READ) {
+		return pll_decode(dest, weak, TRACK_SIZE, src, size);
+	}
+	if(dev->geom->density == GEOM_HD) {
+		if(dev->use_ternary) {
+			return uncompress_len(dest, src, size, HD_RAW_SIZE, 1);
+		}
+		return uncompress_len(dest, src, size, HD_RAW_SIZE, 0);
+	}
+	if(dev->use_ternary) {
+		return uncompress_len(dest, src, size, DD_RAW_SIZE, 1);
+	}
+	return uncompress_len(dest, src, size, DD_RAW_SIZE, 0);
+}
+
+static FORCE_INLINE int uncompress_len(unsigned char *dest, unsigned char *src, int size,
+		const int maxlen, const int ternary)
+{
+	int i, j, sym;
 	int outbits = 0;
 	unsigned int val = 0;
 	unsigned char *dptr = dest;
 
 	for(i=0; i<size; i++) {
-		for(j=0; j<4; j++) {
-			int shift = (~j & 3) * 2;
-			switch((*src >> shift) & 3) {
+		if(ternary && *src >= TERNARY_CODES) {
+			break;
+		}
+		for(j=0; j<(ternary ? 5 : 4); j++) {
+			if(ternary) {
+				sym = ternary_sym[*src][j];
+			} else {
+				sym = (*src >> ((~j & 3) * 2)) & 3;
+			}
+			switch(sym) {
 			case 1:
 				val = (val << 2) | 1;
 				outbits += 2;
@@ -306,7 +1095,7 @@ static int uncompress(unsigned char *dest, unsigned char *src, int size)
 				*dptr++ = (val >> (outbits - 8)) & 0xff;
 				outbits -= 8;
 
-				if(dptr - dest >= TRACK_SIZE) {
+				if(dptr - dest >= maxlen) {
 					goto done;
 				}
 			}
@@ -318,6 +1107,20 @@ done:
 	return dptr - dest;
 }
 
+/* the firmware packs the digits most significant first */
+static void init_ternary(void)
+{
+	int i, j, val;
+
+	for(i=0; i<TERNARY_CODES; i++) {
+		val = i;
+		for(j=4; j>=0; j--) {
+			ternary_sym[i][j] = val % 3 + 1;
+			val /= 3;
+		}
+	}
+}
+
 /* reads at most size + 1 bytes from src and writes size bytes to dest, left-shifted accordingly */
 static void copy_bits(unsigned char *dest, unsigned char *src, int size, int shift)
 {
@@ -332,17 +1135,16 @@ static void copy_bits(unsigned char *dest, unsigned char *src, int size, int shi
 	}
 }
 
-static const unsigned char magic[] = { 0xaa, 0xaa, 0xaa, 0xaa, 0x44, 0x89, 0x44, 0x89 };
-
 static int check_magic(unsigned char *buf)
 {
 	return memcmp(buf + 1, magic + 1, sizeof magic - 1) == 0 &&
 		(buf[0] & 0x7f) == (magic[0] & 0x7f);
 }
 
-static int align_track(unsigned char *buf, int size)
+/* returns the bit offset of the first sector start marker in buf, or -1 */
+static int find_sync(unsigned char *buf, int size)
 {
-	int i, j, offset, shift = -1;
+	int i, j;
 	unsigned char *ptr = buf;
 	unsigned char tmp[sizeof magic];
 
@@ -350,37 +1152,55 @@ static int align_track(unsigned char *buf, int size)
 		for(j=0; j<8; j++) {
 			copy_bits(tmp, ptr, sizeof magic, j);
 			if(check_magic(tmp)) {
-				shift = j;
-				goto end_search;
+				return i * 8 + j;
 			}
 		}
 		++ptr;
 	}
-end_search:
+	return -1;
+}
 
-	if(shift == -1) {
-		fprintf(stderr, "failed to locate sector start marker\n");
+/* shifts the data to start at the first sector start marker, and returns the
+ * remaining size
+ */
+static int align_track(struct afl_device *dev, unsigned char *buf, unsigned char *weak, int size)
+{
+	int pos, offset, shift;
+
+	if((pos = find_sync(buf, size)) == -1) {
+		if(!dev->quiet) {
+			dev_message(dev, AFL_ERROR, "failed to locate sector start marker");
+		}
 		return -1;
 	}
 
-	offset = ptr - buf;
+	offset = pos >> 3;
+	shift = pos & 7;
 	/*printf("align_track: offset %d bytes and %d bits\n", offset, shift);*/
-	copy_bits(buf, ptr, size - offset - (shift ? 1 : 0), shift);
+	size -= offset + (shift ? 1 : 0);
+	copy_bits(buf, buf + offset, size, shift);
+	if(weak) {
+		copy_bits(weak, weak + offset, size, shift);
+	}
 
-	return 0;
+	return size;
 }
 
-struct sector_node *find_sectors(unsigned char *buf, int size)
+static struct sector_node *find_sectors(struct afl_device *dev, unsigned char *buf, int size)
 {
 	unsigned char *ptr = buf;
 	struct sector_node *node, *head = 0, *tail = 0;
-	int nfound = 0;
+	int last = size - (int)(512 + sizeof node->hdr) * 2;
 	uint32_t sum;
 
-	while(ptr - buf < size && nfound < SECTORS_PER_TRACK) {
+	/* keep going past SECTORS_PER_TRACK; the read overlaps the start of the
+	 * track, so a second copy of a sector may turn out to be the good one.
+	 * Sectors cut short by the end of the buffer are ignored.
+	 */
+	while(ptr - buf <= last) {
 		if(check_magic(ptr)) {
 			if(!(node = malloc(sizeof *node))) {
-				fprintf(stderr, "failed to allocate memory for sector list\n");
+				dev_message(dev, AFL_ERROR, "failed to allocate memory for sector list");
 				goto err;
 			}
 			decode_mfm((unsigned char*)&node->hdr.fmt, ptr + MFM_HDR_FMT_OFFSET, 4);
@@ -393,9 +1213,13 @@ struct sector_node *find_sectors(unsigned char *buf, int size)
 			/* verify header checksum */
 			sum = checksum(&node->hdr.fmt, 20);
 			if(sum != ntohl(node->hdr.hdr_sum)) {
-				fprintf(stderr, "Track %d, sector %d header checksum error\n", node->hdr.track, node->hdr.sector);
-				fprintf(stderr, "  calculated: %lu, on disk: %lu\n", (unsigned long)sum, (unsigned long)ntohl(node->hdr.hdr_sum));
-				goto err;
+				if(!dev->quiet) {
+					dev_message(dev, AFL_ERROR, "Track %d, sector %d header checksum error", node->hdr.track, node->hdr.sector);
+					dev_message(dev, AFL_ERROR, "  calculated: %lu, on disk: %lu", (unsigned long)sum, (unsigned long)ntohl(node->hdr.hdr_sum));
+				}
+				free(node);
+				++ptr;
+				continue;
 			}
 
 			if(head) {
@@ -405,17 +1229,11 @@ struct sector_node *find_sectors(unsigned char *buf, int size)
 				head = tail = node;
 			}
 			ptr += (512 + sizeof node->hdr) * 2;
-			++nfound;
 		} else {
 			++ptr;
 		}
 	}
 
-	if(nfound < SECTORS_PER_TRACK) {
-		fprintf(stderr, "error while reading track: found only %d sectors\n", nfound);
-		goto err;
-	}
-
 	return head;
 err:
 	while(head) {
@@ -482,6 +1300,50 @@ static void decode_mfm(unsigned char *dest, unsigned char *src, int blksz)
 	}
 }
 
+/* the amiga checksum folds the odd and even bits together, so it can be
+ * computed directly on the MFM encoded block, without decoding it first
+ */
+static uint32_t mfm_checksum(unsigned char *src, int blksz)
+{
+	int i;
+	uint32_t sum = 0;
+
+	for(i=0; i<blksz * 2; i+=4) {
+		sum ^= ((uint32_t)src[i] << 24) | ((uint32_t)src[i + 1] << 16) |
+			((uint32_t)src[i + 2] << 8) | (uint32_t)src[i + 3];
+	}
+	return sum & 0x55555555;
+}
+
+/* splits a block into its odd bits followed by its even bits, leaving the
+ * clock bits zero, to be filled in by add_clock_bits
+ */
+static void encode_mfm(unsigned char *dest, const unsigned char *src, int blksz)
+{
+	int i;
+
+	for(i=0; i<blksz; i++) {
+		dest[i] = (src[i] >> 1) & 0x55;
+		dest[i + blksz] = src[i] & 0x55;
+	}
+}
+
+/* a clock bit is 1 only between two zero data bits */
+static void add_clock_bits(unsigned char *buf, int size, int prevbit)
+{
+	int i, j, bit;
+
+	for(i=0; i<size; i++) {
+		for(j=6; j>=0; j-=2) {
+			bit = (buf[i] >> j) & 1;
+			if(!bit && !prevbit) {
+				buf[i] |= 2 << j;
+			}
+			prevbit = bit;
+		}
+	}
+}
+
 static uint32_t checksum(void *buf, int size)
 {
 	int i;
@@ -18,21 +18,147 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef DEV_H_
 #define DEV_H_
 
-int init_device(const char *devname);
-void shutdown_device(void);
+#include <signal.h>
+#include "amigafloppy.h"
+#include "geom.h"
+#include "vote.h"
+
+/* the state of a device handle, shared by the device layer (dev.c) and the
+ * reader (amigafloppy.c)
+ */
+struct afl_device {
+	int fd;
+	const struct geometry *geom;
+	int fw_major, fw_minor;
+	int use_trailer, use_ternary, use_abort, use_flux, trailer_size;
+	int flux;		/* capture pulse timings, if use_flux, and decode them with a PLL */
+	long rev_usec;
+	int read_slack;	/* msec a read may take beyond the transfer itself */
+	int rd_status;
+	int hdr_track;	/* track number in the first sector header of the last read, -1 if none */
+	long *flux_hist;	/* if set, flux reads add their pulse intervals to it (calib.c) */
+	int cyl;		/* cylinder the head is on, -1 if unknown */
+	int head;		/* selected head, -1 if unknown */
+	int quiet;		/* no sector errors while checking partial reads */
+	struct afl_link_stats lstats;
+
+	struct afl_callbacks cb;
+	void *cls;
+
+	/* raw MFM of the last track read as it came in, kept for last_track_raw,
+	 * a buffer for one revolution of it, and one for partial reads
+	 */
+	unsigned char rawtrk[GEOM_MAX_RAW_SIZE], rawrev[GEOM_MAX_RAW_SIZE];
+	unsigned char scratch[GEOM_MAX_RAW_SIZE];
+	int rawtrk_size, rawtrk_dos;
+
+	/* afl_read_disk state */
+	volatile sig_atomic_t aborted;
+	int stopped, dev_failures;
+	unsigned char noflux[GEOM_MAX_CYL * 2];
+	struct vote_store *votes;	/* copies of the sectors which failed, for recover_track */
+	unsigned char trkbuf[GEOM_MAX_SECTORS * 512];
+};
+
+#define FW_AT_LEAST(a, b)	(dev->fw_major > (a) || (dev->fw_major == (a) && dev->fw_minor >= (b)))
+
+/* a revolution at 300 rpm */
+#define NOMINAL_REV_USEC	200000
+
+int init_device(struct afl_device *dev, const char *devname);
+void shutdown_device(struct afl_device *dev);
+
+/* formats a message and hands it to the message callback */
+void dev_message(struct afl_device *dev, int level, const char *fmt, ...);
 
 /* returns non-zero for success, zero for failure, and -1 on comm. error */
-int wait_response(void);
+int wait_response(struct afl_device *dev);
+
+/* times a revolution, and updates rev_usec (firmware 1.7 and later) */
+int measure_rotation(struct afl_device *dev);
+/* how long the transfer of a whole track takes, in msec */
+long track_msec(struct afl_device *dev);
+
+/* head step interval and settle time (firmware 2.0) */
+int set_step_timing(struct afl_device *dev, int step_ms, int settle_ms);
+/* pulse interval thresholds of the current capture mode, in firmware timer
+ * ticks (firmware 2.0). Zero for either restores the defaults.
+ */
+int set_thresholds(struct afl_device *dev, int short_max, int long_min);
+
+/* defaults of the firmware, in msec and 16MHz ticks */
+#define STEP_MS_DEFAULT		10
+#define SETTLE_MS_DEFAULT	100
+#define STEP_MS_MIN			2
+#define DD_SHORT_MAX		80
+#define DD_LONG_MIN			111
+#define HD_SHORT_MAX		40
+#define HD_LONG_MIN			55
+
+int select_head(struct afl_device *dev, int s);
+int move_head(struct afl_device *dev, int track);
+/* moves the head to a cylinder, unless it's already there. With reseek, it
+ * steps away and back again, to have the head settle anew.
+ */
+int seek_cylinder(struct afl_device *dev, int cyl, int reseek);
+
+/* reads the current track and decodes its sectors directly to their
+ * positions in buf (sector N at offset N * 512), in whatever order they are
+ * encountered on the disk. Only sectors which pass the data checksum are
+ * written to buf.
+ * Returns a bitmask of the sectors read successfully, or -1 on comm. error.
+ */
+int read_track(struct afl_device *dev, unsigned char *buf);
+/* the same, after moving to the track if needed. The seek, head select and
+ * read commands are sent at once, without waiting for the reply of each.
+ */
+int read_track_at(struct afl_device *dev, int trk, unsigned char *buf);
+
+/* why the last read_track failed, or didn't find anything */
+enum {
+	READ_OK,
+	READ_TIMEOUT,	/* the device didn't send the track in time */
+	READ_LINK,		/* the data kept getting corrupted on the way */
+	READ_NO_FLUX,	/* no flux transitions: an unformatted track, or no disk */
+	READ_NO_INDEX,	/* no index pulses: no disk, or the drive isn't spinning */
+	READ_SEEK		/* the device failed to move to the track */
+};
+
+int last_read_status(struct afl_device *dev);
+
+/* Recovers the sectors of a track missing from valid, from the bad copies
+ * collected in dev->votes by the reads so far: by the majority of their
+ * copies, if there are at least VOTE_MIN_COPIES and it passes the checksum,
+ * or else by correcting a bit or two of the majority (see correct.h).
+ * Recovered sectors are decoded to resbuf like with read_track. Returns their
+ * mask.
+ */
+#define VOTE_MIN_COPIES	3
+
+unsigned int recover_track(struct afl_device *dev, int trk, unsigned char *resbuf, unsigned int valid);
 
-int get_fw_version(int *major, int *minor);
+/* One revolution of the raw MFM of the last track read with read_track,
+ * starting at the first sync word if there is one, for tracks which can't be
+ * decoded as AmigaDOS. Sets dos to whether any valid AmigaDOS sector header
+ * was found on the track. Returns the length of the revolution in bits, or -1
+ * if there's no data.
+ */
+int last_track_raw(struct afl_device *dev, unsigned char **mfm, int *dos);
 
-int begin_read(void);
-int begin_write(void);
-int end_access(void);
+/* size of an MFM encoded track in the selected geometry: 1088 bytes per
+ * sector, plus a short gap
+ */
+#define MFM_TRACK_SIZE	(geom->mfm_size)
 
-int select_head(int s);
-int move_head(int track);
+/* MFM encodes the sectors of a track (nsec * 512 bytes of data), with their
+ * headers and checksums, to a buffer of mfm_size bytes. It's a pure function,
+ * safe to call from any thread. Returns the number of bytes.
+ */
+int encode_track(const struct geometry *g, unsigned char *dest, const unsigned char *data, int trk);
 
-int read_track(unsigned char *buf);
+/* writes an MFM encoded track to the current track, optionally starting at the
+ * index pulse. The device must be in write mode (afl_begin_write).
+ */
+int write_track(struct afl_device *dev, const unsigned char *mfm, int size, int from_index);
 
 #endif	/* DEV_H_ */
@@ -0,0 +1,133 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "encpool.h"
+#include "adf.h"
+#include "dev.h"
+
+#define MAX_THREADS		8
+
+static void *worker(void *arg);
+
+static const unsigned char *srcimg;
+static unsigned char *mfmbuf;
+static unsigned char ready[ADF_MAX_TRACKS];
+static int next_trk, quit;
+
+static pthread_t threads[MAX_THREADS];
+static int num_threads;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+int encpool_start(const unsigned char *img, int nthreads)
+{
+	int i;
+
+	if(mfmbuf) return -1;
+
+	if(nthreads <= 0) {
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if(nthreads < 1) nthreads = 1;
+	if(nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+
+	if(!(mfmbuf = malloc(ADF_NUM_TRACKS * MFM_TRACK_SIZE))) {
+		fprintf(stderr, "failed to allocate MFM track buffers\n");
+		return -1;
+	}
+	srcimg = img;
+	memset(ready, 0, sizeof ready);
+	next_trk = 0;
+	quit = 0;
+
+	num_threads = 0;
+	for(i=0; i<nthreads; i++) {
+		if(pthread_create(threads + i, 0, worker, 0) != 0) {
+			break;
+		}
+		num_threads++;
+	}
+	if(!num_threads) {
+		fprintf(stderr, "failed to start MFM encoder threads\n");
+		free(mfmbuf);
+		mfmbuf = 0;
+		return -1;
+	}
+	return 0;
+}
+
+void encpool_stop(void)
+{
+	int i;
+
+	if(!mfmbuf) return;
+
+	pthread_mutex_lock(&mutex);
+	quit = 1;
+	pthread_mutex_unlock(&mutex);
+
+	for(i=0; i<num_threads; i++) {
+		pthread_join(threads[i], 0);
+	}
+	num_threads = 0;
+
+	free(mfmbuf);
+	mfmbuf = 0;
+}
+
+const unsigned char *encpool_track(int trk)
+{
+	if(!mfmbuf || trk < 0 || trk >= ADF_NUM_TRACKS) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&mutex);
+	while(!ready[trk]) {
+		pthread_cond_wait(&cond, &mutex);
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return mfmbuf + trk * MFM_TRACK_SIZE;
+}
+
+static void *worker(void *arg)
+{
+	int trk;
+
+	for(;;) {
+		pthread_mutex_lock(&mutex);
+		if(quit || next_trk >= ADF_NUM_TRACKS) {
+			pthread_mutex_unlock(&mutex);
+			break;
+		}
+		trk = next_trk++;
+		pthread_mutex_unlock(&mutex);
+
+		encode_track(geom, mfmbuf + trk * MFM_TRACK_SIZE, srcimg + trk * ADF_TRACK_SIZE, trk);
+
+		pthread_mutex_lock(&mutex);
+		ready[trk] = 1;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&mutex);
+	}
+	return 0;
+}
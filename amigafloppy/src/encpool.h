@@ -0,0 +1,34 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef ENCPOOL_H_
+#define ENCPOOL_H_
+
+/* Encodes all tracks of an image to MFM on a pool of worker threads, in track
+ * order, ahead of the writer. The track buffers are ready to be sent to the
+ * device as they are.
+ * nthreads <= 0 picks one thread per online CPU.
+ */
+int encpool_start(const unsigned char *img, int nthreads);
+void encpool_stop(void);
+
+/* returns the MFM encoded track (MFM_TRACK_SIZE bytes), waiting for it to be
+ * encoded if necessary
+ */
+const unsigned char *encpool_track(int trk);
+
+#endif	/* ENCPOOL_H_ */
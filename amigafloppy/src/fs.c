@@ -0,0 +1,152 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include "fs.h"
+#include "adf.h"
+
+#define NUM_BLOCKS		FS_NUM_BLOCKS
+#define BLK(img, n)		((img) + (n) * ADF_SECTOR_SIZE)
+
+/* root block fields */
+#define T_HEADER		2
+#define ST_ROOT			1
+#define ROOT_TYPE		0
+#define ROOT_BM_FLAG	(ADF_SECTOR_SIZE - 200)
+#define ROOT_BM_PAGES	(ADF_SECTOR_SIZE - 196)
+#define ROOT_SEC_TYPE	(ADF_SECTOR_SIZE - 4)
+
+static unsigned long get32(const unsigned char *p);
+static int block_sum_ok(const unsigned char *blk);
+
+unsigned long fs_dostype(const unsigned char *img)
+{
+	unsigned long type = get32(img);
+
+	if((type & 0xffffff00) != 0x444f5300 || (type & 0xff) > 7) {
+		return 0;
+	}
+	return type;
+}
+
+int fs_bitmap_blocks(const unsigned char *img, int *blocks)
+{
+	int i, n = 0;
+	const unsigned char *root = BLK(img, FS_ROOT_BLOCK);
+
+	if(!fs_dostype(img)) {
+		return -1;
+	}
+	if(get32(root + ROOT_TYPE) != T_HEADER || get32(root + ROOT_SEC_TYPE) != ST_ROOT ||
+			!block_sum_ok(root)) {
+		return -1;
+	}
+	/* the bitmap is only trustworthy if the disk was cleanly validated */
+	if(get32(root + ROOT_BM_FLAG) != 0xffffffff) {
+		return -1;
+	}
+
+	for(i=0; i<FS_MAX_BMPAGES; i++) {
+		unsigned long blk = get32(root + ROOT_BM_PAGES + i * 4);
+		if(!blk) break;
+		if(blk >= NUM_BLOCKS) {
+			return -1;
+		}
+		blocks[n++] = blk;
+	}
+	return n ? n : -1;
+}
+
+int fs_used_tracks(const unsigned char *img, const int *bmblocks, int nbm, unsigned char *used)
+{
+	int i, j, blk, nused = 0;
+	int bits_per_page = (ADF_SECTOR_SIZE - 4) * 8;
+
+	/* extra cylinders are outside the filesystem, and may hold anything */
+	memset(used, 0, ADF_NUM_TRACKS);
+	for(j=GEOM_FS_CYL * 2; j<ADF_NUM_TRACKS; j++) {
+		used[j] = 1;
+	}
+
+	for(i=0; i<nbm; i++) {
+		if(!block_sum_ok(BLK(img, bmblocks[i]))) {
+			return -1;
+		}
+	}
+
+	/* blocks 0 and 1 are the bootblock, and are not included in the bitmap */
+	for(blk=2; blk<NUM_BLOCKS; blk++) {
+		int bit = blk - 2;
+		const unsigned char *page;
+		unsigned long bits;
+
+		if((i = bit / bits_per_page) >= nbm) {
+			return -1;
+		}
+		bit %= bits_per_page;
+		page = BLK(img, bmblocks[i]);
+		bits = get32(page + 4 + (bit >> 5) * 4);
+
+		/* a set bit means the block is free */
+		if(!(bits & (1UL << (bit & 31)))) {
+			used[blk / ADF_TRACK_SECTORS] = 1;
+		}
+	}
+
+	used[0] = 1;
+	used[FS_ROOT_BLOCK / ADF_TRACK_SECTORS] = 1;
+	for(i=0; i<nbm; i++) {
+		used[bmblocks[i] / ADF_TRACK_SECTORS] = 1;
+	}
+
+	for(j=0; j<ADF_NUM_TRACKS; j++) {
+		nused += used[j];
+	}
+	return nused;
+}
+
+void fs_format_track(unsigned char *trackbuf, unsigned long dostype)
+{
+	int i;
+
+	for(i=0; i<ADF_TRACK_SIZE; i+=4) {
+		trackbuf[i] = dostype >> 24;
+		trackbuf[i + 1] = dostype >> 16;
+		trackbuf[i + 2] = dostype >> 8;
+		trackbuf[i + 3] = dostype;
+	}
+}
+
+static unsigned long get32(const unsigned char *p)
+{
+	return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+		((unsigned long)p[2] << 8) | (unsigned long)p[3];
+}
+
+/* root, bitmap and most other filesystem blocks have a checksum longword,
+ * chosen so that the sum of all longwords in the block is 0
+ */
+static int block_sum_ok(const unsigned char *blk)
+{
+	int i;
+	unsigned long sum = 0;
+
+	for(i=0; i<ADF_SECTOR_SIZE; i+=4) {
+		sum += get32(blk + i);
+	}
+	return (sum & 0xffffffff) == 0;
+}
@@ -0,0 +1,52 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef FS_H_
+#define FS_H_
+
+#include "adf.h"
+
+/* the filesystem covers the first GEOM_FS_CYL cylinders, even on disks with
+ * extra cylinders, and the root block is in its middle (880 on DD, 1760 on HD)
+ */
+#define FS_NUM_BLOCKS	(GEOM_FS_CYL * 2 * ADF_TRACK_SECTORS)
+#define FS_ROOT_BLOCK	(FS_NUM_BLOCKS / 2)
+#define FS_MAX_BMPAGES	25
+
+/* Returns the dos type longword from the bootblock ("DOS\0" - "DOS\7"), or 0
+ * if the disk does not have an OFS/FFS bootblock.
+ */
+unsigned long fs_dostype(const unsigned char *img);
+
+/* Validates the root block and returns the number of bitmap blocks, writing
+ * their block numbers to blocks, or -1 if the root block or bitmap are not
+ * usable (not a DOS disk, invalid bitmap flag, etc).
+ */
+int fs_bitmap_blocks(const unsigned char *img, int *blocks);
+
+/* Uses the bitmap to mark which tracks contain allocated blocks: used[trk] is
+ * set to 1 for tracks with at least one allocated block, 0 otherwise. The
+ * bootblock, root block and bitmap tracks, and any tracks past the end of the
+ * filesystem, are always marked as used.
+ * Returns the number of used tracks, or -1 if the bitmap blocks are corrupt.
+ */
+int fs_used_tracks(const unsigned char *img, const int *bmblocks, int nbm, unsigned char *used);
+
+/* fills a track with the pattern written by the AmigaDOS Format command */
+void fs_format_track(unsigned char *trackbuf, unsigned long dostype);
+
+#endif	/* FS_H_ */
@@ -0,0 +1,624 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/* amigafloppy-fuse: mounts the disk in the drive as a single disk.adf file.
+ * Tracks are read from the disk the first time they are touched, and kept in
+ * a cache of decoded tracks, least recently used out first. Sequential reads
+ * also read ahead to the end of the next cylinder, in the background. With
+ * -w, writes go to the cached tracks, and each dirty track is written back
+ * when it's evicted, on fsync or close, when the drive goes idle, and at
+ * unmount, or right away with --sync.
+ * The disk must not be swapped while it's mounted: nothing would notice.
+ */
+#define FUSE_USE_VERSION	26
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fuse.h>
+#include "amigafloppy.h"
+#include "dev.h"
+#include "opt.h"
+
+#define IMAGE_PATH		"/disk.adf"
+#define DEV_DEFAULT		"/dev/ttyUSB0"
+#define CACHE_DEFAULT	40		/* tracks */
+#define IDLE_DEFAULT	10		/* seconds before the motor goes off */
+#define RETRIES_DEFAULT	5
+#define WRITE_RETRIES	3
+
+#define TRACK_SIZE		(fgeom->nsec * 512)
+#define NUM_TRACKS		(fgeom->ncyl * 2)
+#define IMAGE_SIZE		((off_t)TRACK_SIZE * NUM_TRACKS)
+#define FULL_MASK		((1u << fgeom->nsec) - 1)
+
+enum { MOTOR_OFF, MOTOR_READ, MOTOR_WRITE };
+
+struct track {
+	int trk;			/* -1 if the slot is free */
+	unsigned int valid;	/* sectors read successfully */
+	int failed;			/* retried already, and still missing sectors */
+	int dirty;
+	unsigned long used;	/* for the LRU order */
+	unsigned char *data;
+};
+
+static int fs_getattr(const char *path, struct stat *st);
+static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t fill, off_t offs,
+		struct fuse_file_info *fi);
+static int fs_open(const char *path, struct fuse_file_info *fi);
+static int fs_read(const char *path, char *buf, size_t size, off_t offs, struct fuse_file_info *fi);
+static int fs_write(const char *path, const char *buf, size_t size, off_t offs,
+		struct fuse_file_info *fi);
+static int fs_truncate(const char *path, off_t size);
+static int fs_flush(const char *path, struct fuse_file_info *fi);
+static int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+static void *fs_init(struct fuse_conn_info *conn);
+static void fs_destroy(void *cls);
+
+static struct track *get_track(int trk, int load);
+static struct track *find_track(int trk);
+static struct track *evict(void);
+static int load_track(struct track *t);
+static int flush_track(struct track *t);
+static int flush_all(void);
+static int spin_up(int mode);
+static void *background(void *arg);
+static long get_msec(void);
+static void print_usage(const char *argv0);
+
+static struct fuse_operations fsops = {
+	.getattr = fs_getattr,
+	.readdir = fs_readdir,
+	.open = fs_open,
+	.read = fs_read,
+	.write = fs_write,
+	.truncate = fs_truncate,
+	.flush = fs_flush,
+	.fsync = fs_fsync,
+	.init = fs_init,
+	.destroy = fs_destroy
+};
+
+static struct afl_device *dev;
+static const struct geometry *fgeom;
+static int writable, write_through;
+static int retries = RETRIES_DEFAULT, idle_sec = IDLE_DEFAULT;
+
+static struct track *cache;
+static int cache_size = CACHE_DEFAULT;
+static unsigned long lru_tick;
+
+/* the cache and the device are only ever used with the lock held: requests
+ * come in on several threads, and the read-ahead runs on its own
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_t bgthread;
+static int bg_running, quit;
+static int motor;
+static long last_used;
+static int last_trk = -1;
+static int ra_next = -1, ra_last = -1;	/* tracks left to read ahead */
+
+int main(int argc, char **argv)
+{
+	int i, fargc = 1, res;
+	char *endp, **fargv, *devfile = 0, *geomname = "dd";
+	const struct afl_profile *prof;
+
+	if(!(fargv = malloc((argc + 1) * sizeof *fargv))) {
+		fprintf(stderr, "failed to allocate argument list\n");
+		return 1;
+	}
+	fargv[0] = argv[0];
+
+	/* our options, and the rest is for fuse: the mount point and its options */
+	for(i=1; i<argc; i++) {
+		if(strcmp(argv[i], "-d") == 0 && argv[i + 1]) {
+			devfile = argv[++i];
+		} else if(strcmp(argv[i], "-w") == 0) {
+			writable = 1;
+		} else if(strcmp(argv[i], "--sync") == 0) {
+			write_through = 1;
+		} else if(strcmp(argv[i], "-r") == 0 && argv[i + 1]) {
+			retries = strtol(argv[++i], &endp, 10);
+			if(endp == argv[i] || retries < 0) {
+				fprintf(stderr, "-r must be followed by the number of retries\n");
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--cache") == 0 && argv[i + 1]) {
+			cache_size = strtol(argv[++i], &endp, 10);
+			if(endp == argv[i] || cache_size < 2) {
+				fprintf(stderr, "--cache must be followed by the number of tracks to cache (2 or more)\n");
+				return 1;
+			}
+		} else if(strcmp(argv[i], "-t") == 0 && argv[i + 1]) {
+			idle_sec = strtol(argv[++i], &endp, 10);
+			if(endp == argv[i] || idle_sec < 0) {
+				fprintf(stderr, "-t must be followed by the idle timeout in seconds\n");
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--geometry") == 0 && argv[i + 1]) {
+			geomname = argv[++i];
+		} else if(strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+			print_usage(argv[0]);
+			return 0;
+		} else {
+			fargv[fargc++] = argv[i];
+		}
+	}
+	fargv[fargc] = 0;
+
+	if(!(fgeom = geom_find(geomname))) {
+		fprintf(stderr, "--geometry must be followed by one of: ");
+		geom_list(stderr);
+		return 1;
+	}
+	if(writable && fgeom->density != GEOM_DD) {
+		fprintf(stderr, "writing %s disks is not supported\n", fgeom->name);
+		return 1;
+	}
+	if(cache_size > NUM_TRACKS) {
+		cache_size = NUM_TRACKS;
+	}
+
+	load_config();
+	if(!devfile) {
+		devfile = opt.devfile ? opt.devfile : DEV_DEFAULT;
+	}
+
+	if(!(cache = calloc(cache_size, sizeof *cache))) {
+		fprintf(stderr, "failed to allocate the track cache\n");
+		return 1;
+	}
+	for(i=0; i<cache_size; i++) {
+		cache[i].trk = -1;
+		if(!(cache[i].data = malloc(TRACK_SIZE))) {
+			fprintf(stderr, "failed to allocate the track cache\n");
+			return 1;
+		}
+	}
+
+	/* the device is opened up front, to fail before mounting anything */
+	if(!(dev = afl_open(devfile, fgeom->name))) {
+		return 1;
+	}
+	if((prof = drive_profile(devfile, fgeom->density)) && afl_set_profile(dev, prof) == -1) {
+		afl_close(dev);
+		return 1;
+	}
+	dev->quiet = 1;
+	if(spin_up(MOTOR_READ) == -1) {
+		afl_close(dev);
+		return 1;
+	}
+
+	res = fuse_main(fargc, fargv, &fsops, 0);
+
+	if(dev) {
+		/* fuse_main failed before init, or destroy didn't run */
+		afl_end_access(dev);
+		afl_close(dev);
+	}
+	free(fargv);
+	return res;
+}
+
+static int fs_getattr(const char *path, struct stat *st)
+{
+	memset(st, 0, sizeof *st);
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_mtime = st->st_ctime = st->st_atime = time(0);
+
+	if(strcmp(path, "/") == 0) {
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+		return 0;
+	}
+	if(strcmp(path, IMAGE_PATH) == 0) {
+		st->st_mode = S_IFREG | (writable ? 0644 : 0444);
+		st->st_nlink = 1;
+		st->st_size = IMAGE_SIZE;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t fill, off_t offs,
+		struct fuse_file_info *fi)
+{
+	if(strcmp(path, "/") != 0) {
+		return -ENOENT;
+	}
+	fill(buf, ".", 0, 0);
+	fill(buf, "..", 0, 0);
+	fill(buf, IMAGE_PATH + 1, 0, 0);
+	return 0;
+}
+
+static int fs_open(const char *path, struct fuse_file_info *fi)
+{
+	if(strcmp(path, IMAGE_PATH) != 0) {
+		return -ENOENT;
+	}
+	if((fi->flags & O_ACCMODE) != O_RDONLY && !writable) {
+		return -EROFS;
+	}
+	return 0;
+}
+
+static int fs_read(const char *path, char *buf, size_t size, off_t offs, struct fuse_file_info *fi)
+{
+	int trk, first, last, start, len, res = 0;
+	unsigned int need;
+	struct track *t;
+
+	if(offs >= IMAGE_SIZE) return 0;
+	if(offs + size > IMAGE_SIZE) {
+		size = IMAGE_SIZE - offs;
+	}
+	first = offs / TRACK_SIZE;
+	last = (offs + size - 1) / TRACK_SIZE;
+
+	pthread_mutex_lock(&lock);
+	for(trk=first; trk<=last; trk++) {
+		start = trk == first ? offs % TRACK_SIZE : 0;
+		len = (trk == last ? (offs + size - 1) % TRACK_SIZE + 1 : TRACK_SIZE) - start;
+
+		/* only the sectors in the range have to be good */
+		need = ((1u << ((start + len - 1) / 512 + 1)) - 1) & ~((1u << start / 512) - 1);
+
+		if(!(t = get_track(trk, 1)) || (t->valid & need) != need) {
+			res = -EIO;
+			break;
+		}
+		memcpy(buf + res, t->data + start, len);
+		res += len;
+	}
+
+	/* reading on from where the last read left off: have the rest of this
+	 * cylinder and the next one ready by the time they are asked for
+	 */
+	if(res > 0 && (first == last_trk || first == last_trk + 1)) {
+		ra_next = last + 1;
+		ra_last = (last >> 1) * 2 + 3;
+		if(ra_last >= NUM_TRACKS) ra_last = NUM_TRACKS - 1;
+		pthread_cond_signal(&cond);
+	}
+	last_trk = last;
+	pthread_mutex_unlock(&lock);
+	return res;
+}
+
+static int fs_write(const char *path, const char *buf, size_t size, off_t offs,
+		struct fuse_file_info *fi)
+{
+	int trk, first, last, start, len, res = 0;
+	struct track *t;
+
+	if(!writable) return -EROFS;
+	if(offs >= IMAGE_SIZE) return -ENOSPC;
+	if(offs + size > IMAGE_SIZE) {
+		size = IMAGE_SIZE - offs;
+	}
+	first = offs / TRACK_SIZE;
+	last = (offs + size - 1) / TRACK_SIZE;
+
+	pthread_mutex_lock(&lock);
+	for(trk=first; trk<=last; trk++) {
+		start = trk == first ? offs % TRACK_SIZE : 0;
+		len = (trk == last ? (offs + size - 1) % TRACK_SIZE + 1 : TRACK_SIZE) - start;
+
+		/* a track which is only partly overwritten has to be read first, in full */
+		if(!(t = get_track(trk, len < TRACK_SIZE)) || (len < TRACK_SIZE && t->valid != FULL_MASK)) {
+			res = -EIO;
+			break;
+		}
+		memcpy(t->data + start, buf + res, len);
+		t->valid = FULL_MASK;
+		t->failed = 0;
+		t->dirty = 1;
+
+		if(write_through && flush_track(t) == -1) {
+			res = -EIO;
+			break;
+		}
+		res += len;
+	}
+	pthread_mutex_unlock(&lock);
+	return res;
+}
+
+/* the image has a fixed size, but truncating to it is harmless */
+static int fs_truncate(const char *path, off_t size)
+{
+	if(strcmp(path, IMAGE_PATH) != 0) {
+		return -ENOENT;
+	}
+	if(!writable) return -EROFS;
+	return size == IMAGE_SIZE ? 0 : -EPERM;
+}
+
+static int fs_flush(const char *path, struct fuse_file_info *fi)
+{
+	int res;
+
+	pthread_mutex_lock(&lock);
+	res = flush_all();
+	pthread_mutex_unlock(&lock);
+	return res == -1 ? -EIO : 0;
+}
+
+static int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	return fs_flush(path, fi);
+}
+
+/* runs after fuse_main has gone to the background, so the thread survives */
+static void *fs_init(struct fuse_conn_info *conn)
+{
+	if(pthread_create(&bgthread, 0, background, 0) == 0) {
+		bg_running = 1;
+	} else {
+		fprintf(stderr, "failed to start the read-ahead thread, reading on demand only\n");
+	}
+	return 0;
+}
+
+static void fs_destroy(void *cls)
+{
+	pthread_mutex_lock(&lock);
+	quit = 1;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	if(bg_running) {
+		pthread_join(bgthread, 0);
+	}
+
+	if(flush_all() == -1) {
+		fprintf(stderr, "some tracks could not be written back to the disk\n");
+	}
+	afl_end_access(dev);
+	afl_close(dev);
+	dev = 0;
+}
+
+/* the cache slot of a track, read from the disk if load is set and it
+ * hasn't been yet. Returns 0 if a dirty track couldn't be evicted for it.
+ */
+static struct track *get_track(int trk, int load)
+{
+	struct track *t;
+
+	if(!(t = find_track(trk))) {
+		if(!(t = evict())) {
+			return 0;
+		}
+		t->trk = trk;
+		t->valid = 0;
+		t->failed = t->dirty = 0;
+	}
+	t->used = ++lru_tick;
+
+	if(load && t->valid != FULL_MASK && !t->failed) {
+		load_track(t);
+	}
+	last_used = get_msec();
+	return t;
+}
+
+static struct track *find_track(int trk)
+{
+	int i;
+
+	for(i=0; i<cache_size; i++) {
+		if(cache[i].trk == trk) {
+			return cache + i;
+		}
+	}
+	return 0;
+}
+
+/* a free slot, or the least recently used clean one, or else the least
+ * recently used dirty one, after writing it back
+ */
+static struct track *evict(void)
+{
+	int i;
+	struct track *clean = 0, *dirty = 0;
+
+	for(i=0; i<cache_size; i++) {
+		struct track *t = cache + i;
+
+		if(t->trk == -1) return t;
+
+		if(t->dirty) {
+			if(!dirty || t->used < dirty->used) dirty = t;
+		} else {
+			if(!clean || t->used < clean->used) clean = t;
+		}
+	}
+	if(clean) return clean;
+
+	if(flush_track(dirty) == -1) {
+		return 0;
+	}
+	return dirty;
+}
+
+/* Reads a track, and retries it while sectors are missing, re-seeking and
+ * with flux capture like the repair passes of afl_read_disk. A track which
+ * still has bad sectors after that isn't retried again until it's evicted.
+ */
+static int load_track(struct track *t)
+{
+	int i, res;
+
+	if(spin_up(MOTOR_READ) == -1) {
+		return -1;
+	}
+
+	for(i=0; i<=retries && t->valid != FULL_MASK; i++) {
+		if(i > 0) {
+			dev->flux = 1;
+			seek_cylinder(dev, t->trk >> 1, 1);
+		}
+		if((res = read_track_at(dev, t->trk, t->data)) != -1) {
+			t->valid |= res;
+		} else if(last_read_status(dev) == READ_TIMEOUT || last_read_status(dev) == READ_NO_INDEX) {
+			break;
+		}
+	}
+	dev->flux = 0;
+
+	if(t->valid != FULL_MASK) {
+		fprintf(stderr, "track %d (C:%02d H:%d): bad sectors, mask %x\n", t->trk, t->trk >> 1,
+				t->trk & 1, ~t->valid & FULL_MASK);
+		t->failed = 1;
+		return -1;
+	}
+	return 0;
+}
+
+static int flush_track(struct track *t)
+{
+	int tries;
+	unsigned char mfm[GEOM_MAX_MFM_SIZE];
+
+	if(!t->dirty) return 0;
+
+	if(spin_up(MOTOR_WRITE) == -1 || seek_cylinder(dev, t->trk >> 1, 0) == -1 ||
+			select_head(dev, t->trk & 1) == -1) {
+		return -1;
+	}
+	encode_track(fgeom, mfm, t->data, t->trk);
+
+	for(tries=0; tries<=WRITE_RETRIES; tries++) {
+		if(write_track(dev, mfm, fgeom->mfm_size, 1) != -1 && afl_verify_track(dev, t->data)) {
+			t->dirty = 0;
+			last_used = get_msec();
+			return 0;
+		}
+	}
+	fprintf(stderr, "failed to write track %d (C:%02d H:%d)\n", t->trk, t->trk >> 1, t->trk & 1);
+	return -1;
+}
+
+static int flush_all(void)
+{
+	int i, res = 0;
+
+	for(i=0; i<cache_size; i++) {
+		if(cache[i].trk >= 0 && flush_track(cache + i) == -1) {
+			res = -1;
+		}
+	}
+	return res;
+}
+
+/* The motor is left running between requests until the drive goes idle.
+ * Reads work in either mode, writes need the write mode.
+ */
+static int spin_up(int mode)
+{
+	if(motor == mode || (mode == MOTOR_READ && motor != MOTOR_OFF)) {
+		return 0;
+	}
+	if((mode == MOTOR_READ ? afl_begin_read(dev) : afl_begin_write(dev)) == -1) {
+		afl_end_access(dev);
+		motor = MOTOR_OFF;
+		return -1;
+	}
+	motor = mode;
+	return 0;
+}
+
+/* reads ahead, and once the drive has been idle for idle_sec, writes the
+ * dirty tracks back and turns the motor off
+ */
+static void *background(void *arg)
+{
+	struct timespec ts;
+	struct track *t;
+	long now;
+
+	pthread_mutex_lock(&lock);
+	while(!quit) {
+		if(ra_next >= 0 && ra_next <= ra_last) {
+			if(!(t = find_track(ra_next)) || (t->valid != FULL_MASK && !t->failed)) {
+				get_track(ra_next, 1);
+			}
+			ra_next++;
+
+			/* let waiting requests in between the tracks */
+			pthread_mutex_unlock(&lock);
+			usleep(1000);
+			pthread_mutex_lock(&lock);
+			continue;
+		}
+		ra_next = -1;
+
+		now = get_msec();
+		if(motor != MOTOR_OFF && now - last_used >= idle_sec * 1000L) {
+			flush_all();
+			afl_end_access(dev);
+			motor = MOTOR_OFF;
+		}
+
+		now += 1000;
+		ts.tv_sec = now / 1000;
+		ts.tv_nsec = (now % 1000) * 1000000;
+		pthread_cond_timedwait(&cond, &lock, &ts);
+	}
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+static long get_msec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, 0);
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void print_usage(const char *argv0)
+{
+	printf("Usage: %s [options] <mount point> [fuse options]\n", argv0);
+	printf("Mounts the disk in the drive as <mount point>" IMAGE_PATH ", reading tracks as\n");
+	printf("they are needed. Unmount with fusermount -u <mount point>.\n");
+	printf("Options:\n");
+	printf(" -d <device>  the device to use (default: from the config file, or " DEV_DEFAULT ")\n");
+	printf(" -w           allow writing to the disk, through the track cache\n");
+	printf(" --sync       write each track back to the disk right away (with -w)\n");
+	printf(" -r <retries> retries per bad track (default: %d)\n", RETRIES_DEFAULT);
+	printf(" --cache <n>  tracks to keep in the cache (default: %d)\n", CACHE_DEFAULT);
+	printf(" -t <secs>    write back and turn the motor off after this long idle\n");
+	printf("              (default: %d)\n", IDLE_DEFAULT);
+	printf(" --geometry <geom>  disk geometry: dd (default) or hd, and 81-83 cylinders\n");
+	printf(" -h           print help and exit\n");
+	printf("Add -f to stay in the foreground.\n");
+}
@@ -0,0 +1,64 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <string.h>
+#include "geom.h"
+
+#define DD(name, ncyl)	{name, ncyl, 11, GEOM_DD, DD_REV_SIZE, DD_RAW_SIZE, DD_MFM_SIZE}
+#define HD(name, ncyl)	{name, ncyl, 22, GEOM_HD, HD_REV_SIZE, HD_RAW_SIZE, HD_MFM_SIZE}
+
+static const struct geometry geometries[] = {
+	DD("dd", 80), DD("dd81", 81), DD("dd82", 82), DD("dd83", 83),
+	HD("hd", 80), HD("hd81", 81), HD("hd82", 82), HD("hd83", 83)
+};
+#define NUM_GEOMETRIES	(sizeof geometries / sizeof *geometries)
+
+const struct geometry *geom = geometries;
+
+int geom_select(const char *name)
+{
+	const struct geometry *g;
+
+	if(!(g = geom_find(name))) {
+		return -1;
+	}
+	geom = g;
+	return 0;
+}
+
+const struct geometry *geom_find(const char *name)
+{
+	int i;
+
+	for(i=0; i<NUM_GEOMETRIES; i++) {
+		if(strcmp(geometries[i].name, name) == 0) {
+			return geometries + i;
+		}
+	}
+	return 0;
+}
+
+void geom_list(FILE *fp)
+{
+	int i;
+
+	for(i=0; i<NUM_GEOMETRIES; i++) {
+		fprintf(fp, "%s%s", i ? ", " : "", geometries[i].name);
+	}
+	fputc('\n', fp);
+}
@@ -0,0 +1,73 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef GEOM_H_
+#define GEOM_H_
+
+#include <stdio.h>
+
+/* capture modes of the firmware (protocol 1.4), by bit cell length */
+enum {
+	GEOM_DD,	/* 2us bit cells */
+	GEOM_HD		/* 1us bit cells, twice the data in one revolution */
+};
+
+/* Disk geometry descriptor. The descriptors are fixed at compile time, and
+ * one is selected at startup (geom). Everything sized per track or per disk
+ * derives from it, and static buffers are sized by the GEOM_MAX_* limits.
+ */
+struct geometry {
+	const char *name;
+	int ncyl;		/* cylinders, with two tracks each */
+	int nsec;		/* sectors per track */
+	int density;	/* GEOM_DD or GEOM_HD */
+	int rev_size;	/* nominal bytes of raw MFM in one revolution */
+	int raw_size;	/* bytes of raw MFM captured per track read */
+	int mfm_size;	/* bytes of MFM written per track */
+};
+
+/* Paula reads 0x1900 words after the sync, plus a sector's worth to catch the
+ * track gap; HD tracks hold twice as much in one revolution. The raw sizes
+ * must match the capture lengths of the firmware.
+ */
+#define DD_REV_SIZE		(0x1900 * 2)
+#define DD_RAW_SIZE		(0x1900 * 2 + 0x440)
+#define DD_MFM_SIZE		(11 * 1088 + 32)
+#define HD_REV_SIZE		(0x3200 * 2)
+#define HD_RAW_SIZE		(0x3200 * 2 + 0x880)
+#define HD_MFM_SIZE		(22 * 1088 + 64)
+
+#define GEOM_MAX_CYL		83
+#define GEOM_MAX_SECTORS	22
+#define GEOM_MAX_RAW_SIZE	HD_RAW_SIZE
+#define GEOM_MAX_MFM_SIZE	HD_MFM_SIZE
+
+/* the filesystem always covers the first 80 cylinders, the rest are extra */
+#define GEOM_FS_CYL			80
+
+extern const struct geometry *geom;
+
+/* selects a geometry by name: dd or hd, optionally followed by the number of
+ * cylinders (81-83), e.g. dd82
+ */
+int geom_select(const char *name);
+/* looks up a geometry by name, without selecting it. Returns 0 if not found. */
+const struct geometry *geom_find(const char *name);
+/* prints the names of the available geometries */
+void geom_list(FILE *fp);
+
+#endif	/* GEOM_H_ */
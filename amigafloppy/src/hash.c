@@ -0,0 +1,282 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include <zlib.h>
+#include "hash.h"
+
+#define ROL(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+static void md5_block(struct md5_state *s, const unsigned char *blk);
+static void sha1_block(struct sha1_state *s, const unsigned char *blk);
+
+static const uint32_t md5_k[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const int md5_r[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+void md5_init(struct md5_state *s)
+{
+	s->h[0] = 0x67452301;
+	s->h[1] = 0xefcdab89;
+	s->h[2] = 0x98badcfe;
+	s->h[3] = 0x10325476;
+	s->len = 0;
+}
+
+void md5_update(struct md5_state *s, const void *data, unsigned long len)
+{
+	const unsigned char *ptr = data;
+	int used = s->len & 63;
+
+	s->len += len;
+
+	if(used) {
+		int n = 64 - used;
+		if(n > len) n = len;
+		memcpy(s->buf + used, ptr, n);
+		ptr += n;
+		len -= n;
+		if(used + n < 64) return;
+		md5_block(s, s->buf);
+	}
+	while(len >= 64) {
+		md5_block(s, ptr);
+		ptr += 64;
+		len -= 64;
+	}
+	memcpy(s->buf, ptr, len);
+}
+
+void md5_final(struct md5_state *s, unsigned char *digest)
+{
+	int i;
+	unsigned char pad[72];
+	uint64_t bits = s->len * 8;
+	int padlen = 64 - ((s->len + 8) & 63);
+
+	memset(pad, 0, sizeof pad);
+	pad[0] = 0x80;
+	for(i=0; i<8; i++) {
+		pad[padlen + i] = bits >> (i * 8);
+	}
+	md5_update(s, pad, padlen + 8);
+
+	for(i=0; i<16; i++) {
+		digest[i] = s->h[i >> 2] >> ((i & 3) * 8);
+	}
+}
+
+static void md5_block(struct md5_state *s, const unsigned char *blk)
+{
+	int i, g;
+	uint32_t w[16], a, b, c, d, f, tmp;
+
+	for(i=0; i<16; i++) {
+		w[i] = (uint32_t)blk[i * 4] | ((uint32_t)blk[i * 4 + 1] << 8) |
+			((uint32_t)blk[i * 4 + 2] << 16) | ((uint32_t)blk[i * 4 + 3] << 24);
+	}
+
+	a = s->h[0];
+	b = s->h[1];
+	c = s->h[2];
+	d = s->h[3];
+
+	for(i=0; i<64; i++) {
+		if(i < 16) {
+			f = (b & c) | (~b & d);
+			g = i;
+		} else if(i < 32) {
+			f = (d & b) | (~d & c);
+			g = (5 * i + 1) & 15;
+		} else if(i < 48) {
+			f = b ^ c ^ d;
+			g = (3 * i + 5) & 15;
+		} else {
+			f = c ^ (b | ~d);
+			g = (7 * i) & 15;
+		}
+		tmp = d;
+		d = c;
+		c = b;
+		b = b + ROL(a + f + md5_k[i] + w[g], md5_r[i]);
+		a = tmp;
+	}
+
+	s->h[0] += a;
+	s->h[1] += b;
+	s->h[2] += c;
+	s->h[3] += d;
+}
+
+void sha1_init(struct sha1_state *s)
+{
+	s->h[0] = 0x67452301;
+	s->h[1] = 0xefcdab89;
+	s->h[2] = 0x98badcfe;
+	s->h[3] = 0x10325476;
+	s->h[4] = 0xc3d2e1f0;
+	s->len = 0;
+}
+
+void sha1_update(struct sha1_state *s, const void *data, unsigned long len)
+{
+	const unsigned char *ptr = data;
+	int used = s->len & 63;
+
+	s->len += len;
+
+	if(used) {
+		int n = 64 - used;
+		if(n > len) n = len;
+		memcpy(s->buf + used, ptr, n);
+		ptr += n;
+		len -= n;
+		if(used + n < 64) return;
+		sha1_block(s, s->buf);
+	}
+	while(len >= 64) {
+		sha1_block(s, ptr);
+		ptr += 64;
+		len -= 64;
+	}
+	memcpy(s->buf, ptr, len);
+}
+
+void sha1_final(struct sha1_state *s, unsigned char *digest)
+{
+	int i;
+	unsigned char pad[72];
+	uint64_t bits = s->len * 8;
+	int padlen = 64 - ((s->len + 8) & 63);
+
+	memset(pad, 0, sizeof pad);
+	pad[0] = 0x80;
+	for(i=0; i<8; i++) {
+		pad[padlen + i] = bits >> ((7 - i) * 8);
+	}
+	sha1_update(s, pad, padlen + 8);
+
+	for(i=0; i<20; i++) {
+		digest[i] = s->h[i >> 2] >> ((3 - (i & 3)) * 8);
+	}
+}
+
+static void sha1_block(struct sha1_state *s, const unsigned char *blk)
+{
+	int i;
+	uint32_t w[80], a, b, c, d, e, f, k, tmp;
+
+	for(i=0; i<16; i++) {
+		w[i] = ((uint32_t)blk[i * 4] << 24) | ((uint32_t)blk[i * 4 + 1] << 16) |
+			((uint32_t)blk[i * 4 + 2] << 8) | (uint32_t)blk[i * 4 + 3];
+	}
+	for(i=16; i<80; i++) {
+		tmp = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+		w[i] = ROL(tmp, 1);
+	}
+
+	a = s->h[0];
+	b = s->h[1];
+	c = s->h[2];
+	d = s->h[3];
+	e = s->h[4];
+
+	for(i=0; i<80; i++) {
+		if(i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if(i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if(i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+		tmp = ROL(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = ROL(b, 30);
+		b = a;
+		a = tmp;
+	}
+
+	s->h[0] += a;
+	s->h[1] += b;
+	s->h[2] += c;
+	s->h[3] += d;
+	s->h[4] += e;
+}
+
+void hash_init(struct hash_ctx *ctx)
+{
+	ctx->crc = crc32(0, 0, 0);
+	md5_init(&ctx->md5);
+	sha1_init(&ctx->sha1);
+}
+
+void hash_update(struct hash_ctx *ctx, const void *data, unsigned long len)
+{
+	ctx->crc = crc32(ctx->crc, data, len);
+	md5_update(&ctx->md5, data, len);
+	sha1_update(&ctx->sha1, data, len);
+}
+
+void hash_final(struct hash_ctx *ctx, struct hash_result *res)
+{
+	res->crc = ctx->crc;
+	md5_final(&ctx->md5, res->md5);
+	sha1_final(&ctx->sha1, res->sha1);
+}
+
+void hash_print(FILE *fp, const struct hash_result *res)
+{
+	char buf[41];
+
+	fprintf(fp, "crc32 %08lx", (unsigned long)res->crc);
+	fprintf(fp, " md5 %s", hash_hexstr(buf, res->md5, 16));
+	fprintf(fp, " sha1 %s", hash_hexstr(buf, res->sha1, 20));
+}
+
+char *hash_hexstr(char *buf, const unsigned char *digest, int len)
+{
+	int i;
+	static const char hexdig[] = "0123456789abcdef";
+
+	for(i=0; i<len; i++) {
+		buf[i * 2] = hexdig[digest[i] >> 4];
+		buf[i * 2 + 1] = hexdig[digest[i] & 0xf];
+	}
+	buf[len * 2] = 0;
+	return buf;
+}
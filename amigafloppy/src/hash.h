@@ -0,0 +1,66 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef HASH_H_
+#define HASH_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct md5_state {
+	uint32_t h[4];
+	uint64_t len;
+	unsigned char buf[64];
+};
+
+struct sha1_state {
+	uint32_t h[5];
+	uint64_t len;
+	unsigned char buf[64];
+};
+
+/* CRC32, MD5 and SHA-1 computed together, for catalogue matching */
+struct hash_ctx {
+	uint32_t crc;
+	struct md5_state md5;
+	struct sha1_state sha1;
+};
+
+struct hash_result {
+	uint32_t crc;
+	unsigned char md5[16];
+	unsigned char sha1[20];
+};
+
+void md5_init(struct md5_state *s);
+void md5_update(struct md5_state *s, const void *data, unsigned long len);
+void md5_final(struct md5_state *s, unsigned char *digest);
+
+void sha1_init(struct sha1_state *s);
+void sha1_update(struct sha1_state *s, const void *data, unsigned long len);
+void sha1_final(struct sha1_state *s, unsigned char *digest);
+
+void hash_init(struct hash_ctx *ctx);
+void hash_update(struct hash_ctx *ctx, const void *data, unsigned long len);
+void hash_final(struct hash_ctx *ctx, struct hash_result *res);
+
+/* prints "crc32 <hex> md5 <hex> sha1 <hex>" */
+void hash_print(FILE *fp, const struct hash_result *res);
+/* writes a digest as a hex string to buf, which must be 2 * len + 1 bytes */
+char *hash_hexstr(char *buf, const unsigned char *digest, int len);
+
+#endif	/* HASH_H_ */
@@ -17,87 +17,671 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <stdio.h>
 #include <stdlib.h>
-#include "dev.h"
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "amigafloppy.h"
 #include "opt.h"
 #include "adf.h"
+#include "sched.h"
+#include "fs.h"
+#include "store.h"
+#include "serial.h"
 
-#define TRACK_SIZE		(0x1900 * 2 + 0x440)
-#define NUM_TRACKS		80
+static int read_image(void);
+static int write_image(void);
+static int compare_disk(void);
+static int open_image(unsigned int *valid);
+static int have_raw_tracks(void);
+static int select_sparse(unsigned int *valid);
+static int read_some_tracks(unsigned int *valid, const unsigned char *sel);
+static void print_track_ranges(const unsigned char *sel, int val);
+static int save_hashes(void);
+static int store_disk(void);
+static int ingest_images(void);
+static int extract_image(void);
+static int calibrate(void);
+static unsigned char *store_trackbuf(int trk);
+static void print_store_stats(long msec);
+static void print_device_info(void);
+static void print_link_stats(void);
+static long get_msec(void);
+static unsigned char *cmp_trackbuf(int trk);
+static int cmp_track_read(int trk, unsigned char *buf, unsigned int newmask);
+static void sighandler(int s);
 
-static void print_progress(int cyl, int head);
+static unsigned char *cmp_ref;
+static int cmp_ndiff;
+static int to_stdout;
+static volatile sig_atomic_t interrupted;
+static unsigned char *store_img;
+static struct afl_device *dev;
 
 int main(int argc, char **argv)
 {
-	int i, j, num_tries, res, status = 1;
-	unsigned char buf[TRACK_SIZE];
+	int status, imgfd;
 
 	if(init_options(argc, argv) == -1) {
 		return 1;
 	}
 
-	if(init_device(opt.devfile) == -1) {
+	/* when streaming the image to stdout, keep a separate descriptor for it,
+	 * and send everything we'd print to stdout to stderr instead
+	 */
+	if(opt.fname && strcmp(opt.fname, "-") == 0 && (!opt.store || opt.extract)) {
+		if((imgfd = dup(1)) == -1 || dup2(2, 1) == -1) {
+			perror("failed to redirect stdout");
+			return 1;
+		}
+		adf_stream_fd(imgfd);
+		to_stdout = 1;
+	}
+
+	/* working with existing images in the track store doesn't need the drive */
+	if(opt.ingest) {
+		return ingest_images();
+	}
+	if(opt.extract) {
+		return extract_image();
+	}
+
+	if(opt.record && ser_record(opt.record) == -1) {
+		return 1;
+	}
+	if(opt.replay && ser_replay(opt.replay, opt.replay_fast ? SER_REPLAY_FAST : 0) == -1) {
 		return 1;
 	}
 
-	if(adf_open(opt.fname) == -1) {
-		shutdown_device();
+	if(!(dev = afl_open(opt.devfile, geom->name))) {
 		return 1;
 	}
+	sched_init(dev);
 
-	begin_read();
-	for(i=0; i<NUM_TRACKS; i++) {
-		move_head(i);
-		for(j=0; j<2; j++) {
-			select_head(j);
+	if(opt.profile && !opt.calibrate && afl_set_profile(dev, opt.profile) == -1) {
+		afl_close(dev);
+		return 1;
+	}
 
-			num_tries = opt.retries;
-			while((res = read_track(buf)) == -1 && num_tries-- > 0);
-			if(res == -1) {
-				fprintf(stderr, "failed to read track %d side %d\n", i, j);
-				goto done;
-			}
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
 
-			if(adf_write_track(buf) == -1) {
-				fprintf(stderr, "failed to write track %d side %d to ADF image\n", i, j);
-				goto done;
-			}
-			if(opt.verbose) {
-				print_progress(i, j);
+	if(opt.calibrate) {
+		status = calibrate();
+	} else if(opt.compare) {
+		status = compare_disk();
+	} else if(opt.store) {
+		status = store_disk();
+	} else if(opt.write_disk) {
+		status = write_image();
+	} else {
+		status = read_image();
+	}
+
+	print_link_stats();
+	afl_close(dev);
+	return status;
+}
+
+static int read_image(void)
+{
+	int i, nbad, status = 1;
+	static unsigned int valid[ADF_MAX_TRACKS];
+
+	if(opt.complevel >= 0) {
+		adf_compression(opt.complevel);
+	}
+	adf_hashing(opt.hash);
+	if(open_image(valid) == -1) {
+		return 1;
+	}
+
+	if(afl_begin_read(dev) == -1) {
+		goto done;
+	}
+	print_device_info();
+	if(opt.sparse && select_sparse(valid) == -1) {
+		printf("Can't use the filesystem bitmap, falling back to reading the whole disk\n");
+	}
+
+	/* tracks which are already complete won't be read again */
+	for(i=0; i<ADF_NUM_TRACKS; i++) {
+		if(valid[i] == FULL_TRACK_MASK) {
+			adf_track_done(i);
+		}
+	}
+
+	if(read_disk(valid, 0) == -1) {
+		/* keep whatever we managed to read, unless it's nothing at all, so
+		 * that the rest can be re-read later with --resume or --repair
+		 */
+		nbad = count_bad_sectors(valid);
+		if(to_stdout || nbad >= ADF_NUM_TRACKS * ADF_TRACK_SECTORS) {
+			goto done;
+		}
+		if(opt.keep_bad && !interrupted && !have_raw_tracks()) {
+			/* the bad sectors were never written, so they're left zeroed */
+			if(adf_commit() != -1 && adf_save_secmap(opt.fname, valid) != -1) {
+				fprintf(stderr, "image saved with %d bad sectors zeroed, listed in %s.secmap\n",
+						nbad, opt.fname);
+				fprintf(stderr, "run again with --repair to re-read only those\n");
 			}
+			goto done;
+		}
+		if(adf_save_secmap(opt.fname, valid) != -1 && adf_suspend() != -1) {
+			fprintf(stderr, "partial image kept in %s.part, %d sectors missing\n", opt.fname, nbad);
+			fprintf(stderr, "run again with --resume to re-read only the missing sectors\n");
 		}
+		goto done;
 	}
-	putchar('\n');
+
+	if(adf_commit() == -1) {
+		goto done;
+	}
+	adf_remove_secmap(opt.fname);
 	status = 0;
 
+	if(opt.hash) {
+		save_hashes();
+	}
+
 done:
-	end_access();
-	adf_close();
-	shutdown_device();
-	if(status != 0) {
-		remove(opt.fname);
+	afl_end_access(dev);
+	adf_close();	/* discards a new partial image if we didn't commit or suspend */
+	return status;
+}
+
+static int write_image(void)
+{
+	int res;
+	unsigned char *img;
+
+	if(!(img = adf_map(opt.fname))) {
+		return 1;
+	}
+	if(afl_begin_write(dev) == -1) {
+		adf_unmap(img);
+		return 1;
+	}
+	print_device_info();
+
+	res = write_disk(img);
+
+	afl_end_access(dev);
+	adf_unmap(img);
+	return res == -1 ? 1 : 0;
+}
+
+/* reads the disk and checks every sector against the reference image as soon
+ * as it's decoded. Returns 0 if they match, 2 if they differ, and 1 if the
+ * disk couldn't be read completely.
+ */
+static int compare_disk(void)
+{
+	int res, nbad;
+	static unsigned int valid[ADF_MAX_TRACKS];
+	struct read_hooks hooks = {cmp_trackbuf, cmp_track_read};
+
+	if(!(cmp_ref = adf_map(opt.compare))) {
+		return 1;
+	}
+	cmp_ndiff = 0;
+
+	if(afl_begin_read(dev) == -1) {
+		afl_end_access(dev);
+		adf_unmap(cmp_ref);
+		return 1;
+	}
+	print_device_info();
+	res = read_disk(valid, &hooks);
+	afl_end_access(dev);
+	adf_unmap(cmp_ref);
+
+	if(cmp_ndiff) {
+		printf("disk differs from %s%s: %d sectors differ\n", opt.compare,
+				res == -1 ? " (stopped early)" : "", cmp_ndiff);
+		return 2;
+	}
+	if(res == -1) {
+		nbad = count_bad_sectors(valid);
+		printf("disk matches %s, except for %d unreadable sectors\n", opt.compare, nbad);
+		return 1;
+	}
+	if(opt.verbose) {
+		printf("disk matches %s\n", opt.compare);
+	}
+	return 0;
+}
+
+static unsigned char *cmp_trackbuf(int trk)
+{
+	static unsigned char buf[ADF_MAX_TRACK_SIZE];
+	return buf;
+}
+
+static int cmp_track_read(int trk, unsigned char *buf, unsigned int newmask)
+{
+	int i, offs;
+	unsigned char *ref = cmp_ref + trk * ADF_TRACK_SIZE;
+
+	for(i=0; i<ADF_TRACK_SECTORS; i++) {
+		if(!(newmask & (1 << i))) continue;
+
+		offs = i * ADF_SECTOR_SIZE;
+		if(memcmp(buf + offs, ref + offs, ADF_SECTOR_SIZE) != 0) {
+			fprintf(stderr, "\ntrack %d (C:%02d H:%d), sector %d differs\n", trk, trk >> 1, trk & 1, i);
+			cmp_ndiff++;
+			if(opt.fail_fast) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int open_image(unsigned int *valid)
+{
+	int mode = ADF_NEW;
+	char *partname;
+
+	if(to_stdout) {
+		return adf_open(opt.fname, ADF_NEW);
+	}
+
+	if(!(partname = malloc(strlen(opt.fname) + 6))) {
+		fprintf(stderr, "failed to allocate filename buffer\n");
+		return -1;
+	}
+	sprintf(partname, "%s.part", opt.fname);
+
+	if(access(partname, F_OK) == 0) {
+		if(!opt.resume && !opt.repair) {
+			fprintf(stderr, "found partial image %s: use --resume to continue reading it, "
+					"or remove it to start over\n", partname);
+			goto err;
+		}
+		mode = ADF_RESUME;
+	} else if(opt.repair) {
+		mode = ADF_REPAIR;
+	} else if(opt.resume) {
+		fprintf(stderr, "nothing to resume, %s not found\n", partname);
+		goto err;
 	}
+
+	if(mode != ADF_NEW && adf_load_secmap(opt.fname, valid) == -1) {
+		fprintf(stderr, "can't %s %s without a valid sector map (%s.secmap)\n",
+				mode == ADF_RESUME ? "resume" : "repair", opt.fname, opt.fname);
+		goto err;
+	}
+
+	if(adf_open(opt.fname, mode) == -1) {
+		goto err;
+	}
+
+	if(mode != ADF_NEW && opt.verbose) {
+		printf("%s %s: %d sectors left to read\n", mode == ADF_RESUME ? "Resuming" : "Repairing",
+				opt.fname, count_bad_sectors(valid));
+	}
+	free(partname);
+	return 0;
+
+err:
+	free(partname);
+	return -1;
+}
+
+/* an image with raw tracks is committed as an extended ADF, which can't be
+ * repaired, so it's kept as a .part to resume instead
+ */
+static int have_raw_tracks(void)
+{
+	int i;
+
+	for(i=0; i<ADF_NUM_TRACKS; i++) {
+		if(adf_is_raw(i)) return 1;
+	}
+	return 0;
+}
+
+/* reads the disk into the track store, under the name given instead of an image */
+static int store_disk(void)
+{
+	int res, status = 1;
+	long start;
+	static unsigned int valid[ADF_MAX_TRACKS];
+	struct read_hooks hooks = {store_trackbuf, 0};
+
+	if(store_open(opt.store) == -1) {
+		return 1;
+	}
+	if(!(store_img = calloc(1, ADF_SIZE))) {
+		fprintf(stderr, "failed to allocate image buffer\n");
+		store_close();
+		return 1;
+	}
+	start = get_msec();
+
+	if((res = afl_begin_read(dev)) != -1) {
+		print_device_info();
+		res = read_disk(valid, &hooks);
+	}
+	afl_end_access(dev);
+
+	if(res != -1 && store_put(opt.fname, store_img) != -1) {
+		if(opt.verbose) {
+			print_store_stats(get_msec() - start);
+		}
+		status = 0;
+	}
+
+	free(store_img);
+	store_close();
 	return status;
 }
 
-static void print_progress(int cyl, int head)
+/* measures the drive on the disk in it, and saves the results as its profile */
+static int calibrate(void)
 {
-	int i, p, count;
+	int res;
+	struct afl_profile prof;
 
-	p = ((cyl << 1) | head) * 100 / ((NUM_TRACKS - 1) * 2);
-	count = p / 2;
+	if(afl_begin_read(dev) == -1) {
+		afl_end_access(dev);
+		return 1;
+	}
+	print_device_info();
+	if(opt.verbose) {
+		printf("Calibrating %s, this takes a minute or two\n", opt.devfile);
+	}
+
+	res = afl_calibrate(dev, &prof);
+	afl_end_access(dev);
+
+	if(res == -1 || save_profile(opt.devfile, &prof) == -1) {
+		return 1;
+	}
+	return 0;
+}
 
-	printf("Reading (C:%02d H:%d) [", cyl, head);
+static unsigned char *store_trackbuf(int trk)
+{
+	return store_img + trk * ADF_TRACK_SIZE;
+}
+
+/* adds existing images to the track store, each named after its file, without
+ * the directory and extension
+ */
+static int ingest_images(void)
+{
+	int i, nfailed = 0;
+	long start;
+	char *name, *suffix;
+	const char *base;
+	unsigned char *img;
+
+	if(store_open(opt.store) == -1) {
+		return 1;
+	}
+	start = get_msec();
 
-	for(i=0; i<50; i++) {
-		if(i < count || count == 50) {
-			putchar('=');
-		} else if(i == count) {
-			putchar('>');
+	for(i=0; i<opt.nfiles; i++) {
+		if((base = strrchr(opt.files[i], '/'))) {
+			base++;
 		} else {
-			putchar(' ');
+			base = opt.files[i];
+		}
+		if(!(name = malloc(strlen(base) + 1))) {
+			fprintf(stderr, "failed to allocate filename buffer\n");
+			nfailed++;
+			continue;
+		}
+		strcpy(name, base);
+		while((suffix = strrchr(name, '.')) && suffix > name &&
+				(strcasecmp(suffix, ".adf") == 0 || strcasecmp(suffix, ".adz") == 0 ||
+				 strcasecmp(suffix, ".gz") == 0)) {
+			*suffix = 0;
+		}
+
+		if(!(img = adf_map(opt.files[i])) || store_put(name, img) == -1) {
+			nfailed++;
+		}
+		adf_unmap(img);
+		free(name);
+	}
+
+	if(opt.verbose) {
+		print_store_stats(get_msec() - start);
+	}
+	if(nfailed) {
+		fprintf(stderr, "failed to ingest %d of %d images\n", nfailed, opt.nfiles);
+	}
+	store_close();
+	return nfailed ? 1 : 0;
+}
+
+/* reconstitutes a stored disk, writing the image like a read from the drive
+ * would, so compression, hashing and streaming to stdout work the same way
+ */
+static int extract_image(void)
+{
+	int i, status = 1;
+	unsigned char *img;
+
+	if(store_open(opt.store) == -1) {
+		return 1;
+	}
+	if(!(img = malloc(ADF_SIZE))) {
+		fprintf(stderr, "failed to allocate image buffer\n");
+		store_close();
+		return 1;
+	}
+	if(store_get(opt.extract, img) == -1) {
+		goto done;
+	}
+
+	if(opt.complevel >= 0) {
+		adf_compression(opt.complevel);
+	}
+	adf_hashing(opt.hash);
+	if(adf_open(opt.fname, ADF_NEW) == -1) {
+		goto done;
+	}
+	for(i=0; i<ADF_NUM_TRACKS; i++) {
+		adf_write_track(i, img + i * ADF_TRACK_SIZE);
+	}
+	if(adf_commit() != -1) {
+		status = 0;
+		if(opt.hash) {
+			save_hashes();
 		}
 	}
+	adf_close();
+
+done:
+	free(img);
+	store_close();
+	return status;
+}
 
-	printf("] %d%%  \r", p);
-	fflush(stdout);
+static void print_store_stats(long msec)
+{
+	struct store_stats st;
+
+	store_get_stats(&st);
+
+	printf("%d disks stored: %d tracks, %d new", st.ndisks, st.ntracks, st.nnew);
+	if(st.nnew) {
+		printf(", dedup ratio %.2f:1", (float)st.ntracks / st.nnew);
+	}
+	printf(", %.1f disks/s\n", st.ndisks * 1000.0f / (msec > 0 ? msec : 1));
+}
+
+static void print_device_info(void)
+{
+	int major, minor;
+	long usec;
+
+	if(!opt.verbose) return;
+
+	afl_fw_version(dev, &major, &minor);
+	printf("Firmware version: %d.%d\n", major, minor);
+	if(major > 1 || minor >= 7) {
+		usec = afl_rev_usec(dev);
+		printf("Drive speed: %.1f rpm\n", 60000000.0f / usec);
+	}
+}
+
+/* link errors are worth mentioning even when not verbose: they point to a
+ * USB or cabling problem rather than to the disk
+ */
+static void print_link_stats(void)
+{
+	struct afl_link_stats st;
+
+	afl_link_stats(dev, &st);
+
+	if(!st.reads || (!opt.verbose && !st.errors)) return;
+
+	printf("%ld track transfers (%ld ended early), %ld bytes: %ld link errors, %ld retried, %ld bytes lost to overruns\n",
+			st.reads, st.early, st.bytes, st.errors, st.retries, st.overruns);
+}
+
+static long get_msec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, 0);
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* writes the image and per-track hashes to <image>.hash, and prints the image
+ * hashes. When streaming to stdout there's no sidecar, everything is printed.
+ */
+static int save_hashes(void)
+{
+	FILE *fp;
+	char *fname;
+
+	if(to_stdout) {
+		return adf_print_hashes(stdout, 1);
+	}
+
+	if(!(fname = malloc(strlen(opt.fname) + 6))) {
+		fprintf(stderr, "failed to allocate filename buffer\n");
+		return -1;
+	}
+	sprintf(fname, "%s.hash", opt.fname);
+
+	if(!(fp = fopen(fname, "w"))) {
+		fprintf(stderr, "failed to open %s for writing: %s\n", fname, strerror(errno));
+		free(fname);
+		return -1;
+	}
+	fprintf(fp, "# amigafloppy hashes of %s\n", opt.fname);
+	adf_print_hashes(fp, 1);
+	if(fclose(fp) == EOF) {
+		fprintf(stderr, "failed to write %s: %s\n", fname, strerror(errno));
+		free(fname);
+		return -1;
+	}
+	free(fname);
+
+	if(opt.verbose) {
+		adf_print_hashes(stdout, 0);
+	}
+	return 0;
+}
+
+/* Reads the bootblock, root block and bitmap first, and uses the bitmap to skip
+ * the tracks which don't contain any allocated blocks, filling them with the
+ * format pattern and marking them as valid. Returns the number of skipped
+ * tracks, or -1 if it's not a DOS disk or the bitmap can't be trusted.
+ */
+static int select_sparse(unsigned int *valid)
+{
+	int i, nbm, nused, bmblocks[FS_MAX_BMPAGES];
+	unsigned long dostype;
+	unsigned char *img, sel[ADF_MAX_TRACKS];
+
+	memset(sel, 0, sizeof sel);
+	sel[0] = sel[FS_ROOT_BLOCK / ADF_TRACK_SECTORS] = 1;
+	if(read_some_tracks(valid, sel) == -1) {
+		return -1;
+	}
+
+	img = adf_track(0);
+	if(!(dostype = fs_dostype(img)) || (nbm = fs_bitmap_blocks(img, bmblocks)) == -1) {
+		return -1;
+	}
+
+	memset(sel, 0, sizeof sel);
+	for(i=0; i<nbm; i++) {
+		sel[bmblocks[i] / ADF_TRACK_SECTORS] = 1;
+	}
+	if(read_some_tracks(valid, sel) == -1) {
+		return -1;
+	}
+
+	if((nused = fs_used_tracks(img, bmblocks, nbm, sel)) == -1) {
+		return -1;
+	}
+
+	for(i=0; i<ADF_NUM_TRACKS; i++) {
+		if(!sel[i]) {
+			fs_format_track(adf_track(i), dostype);
+			valid[i] = FULL_TRACK_MASK;
+		}
+	}
+
+	if(opt.verbose) {
+		printf("Sparse read: %d of %d tracks allocated\n", nused, ADF_NUM_TRACKS);
+		if(nused < ADF_NUM_TRACKS) {
+			printf("Skipped empty tracks:");
+			print_track_ranges(sel, 0);
+			putchar('\n');
+		}
+	}
+	return ADF_NUM_TRACKS - nused;
+}
+
+/* read_disk only reads tracks which are not fully valid, so hide the rest */
+static int read_some_tracks(unsigned int *valid, const unsigned char *sel)
+{
+	int i, res;
+	static unsigned int tmp[ADF_MAX_TRACKS];
+
+	for(i=0; i<ADF_NUM_TRACKS; i++) {
+		tmp[i] = sel[i] ? valid[i] : FULL_TRACK_MASK;
+	}
+	res = read_disk(tmp, 0);
+	for(i=0; i<ADF_NUM_TRACKS; i++) {
+		if(sel[i]) valid[i] = tmp[i];
+	}
+	return res;
+}
+
+static void print_track_ranges(const unsigned char *sel, int val)
+{
+	int i, start = -1;
+
+	for(i=0; i<=ADF_NUM_TRACKS; i++) {
+		if(i < ADF_NUM_TRACKS && sel[i] == val) {
+			if(start < 0) start = i;
+		} else if(start >= 0) {
+			if(i - 1 > start) {
+				printf(" %d-%d", start, i - 1);
+			} else {
+				printf(" %d", start);
+			}
+			start = -1;
+		}
+	}
+}
+
+static void sighandler(int s)
+{
+	interrupted = 1;
+	abort_read();
 }
@@ -19,13 +19,18 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <alloca.h>
 #include <unistd.h>
 #include <pwd.h>
 #include "opt.h"
+#include "geom.h"
 
 static void print_usage(const char *argv0);
-static int load_config(void);
+static int home_config(char *buf);
+static struct drive_profile *find_profile(const char *devfile, int density);
+static int profile_option(struct drive_profile *dp, const char *key, char *valstr);
+static int section_device(char *line, char **devfile, int *density);
 static char *skip_wspace(char *s);
 static char *cleanstr(char *s);
 static int strbool(char *s);
@@ -40,6 +45,22 @@ static int strbool(char *s);
 
 #define RETRIES_DEFAULT	5
 
+/* [drive <device> <dd|hd>] sections of the config file, written by
+ * --calibrate. Sections without a density are DD profiles.
+ */
+#define MAX_PROFILES	16
+
+struct drive_profile {
+	char *devfile;
+	struct afl_profile prof;
+};
+
+static struct drive_profile profiles[MAX_PROFILES];
+static int nprofiles;
+static struct afl_profile step_prof;	/* see drive_profile */
+static const char *density_name[] = {"dd", "hd"};
+static char *cfgfile;	/* the config file loaded, if any */
+static int retries_given;
 
 int init_options(int argc, char **argv)
 {
@@ -50,12 +71,101 @@ int init_options(int argc, char **argv)
 	opt.devfile = DEV_DEFAULT;
 	opt.verbose = 1;
 	opt.retries = RETRIES_DEFAULT;
+	opt.complevel = -1;
+
+	/* positional arguments: the image, or with --ingest any number of them */
+	if(!(opt.files = malloc(argc * sizeof *opt.files))) {
+		fprintf(stderr, "failed to allocate argument list\n");
+		return -1;
+	}
+	opt.nfiles = 0;
 
 	load_config();
 
 	for(i=1; i<argc; i++) {
-		if(argv[i][0] == '-') {
-			if(argv[i][2] == 0) {
+		if(argv[i][0] == '-' && argv[i][1]) {
+			if(argv[i][1] == '-') {
+				if(strcmp(argv[i], "--resume") == 0) {
+					opt.resume = 1;
+
+				} else if(strcmp(argv[i], "--repair") == 0) {
+					opt.repair = 1;
+
+				} else if(strcmp(argv[i], "--keep-bad") == 0) {
+					opt.keep_bad = 1;
+
+				} else if(strcmp(argv[i], "--compare") == 0) {
+					if(!argv[++i]) {
+						fprintf(stderr, "--compare must be followed by a reference ADF image\n");
+						return -1;
+					}
+					opt.compare = argv[i];
+
+				} else if(strcmp(argv[i], "--fail-fast") == 0) {
+					opt.fail_fast = 1;
+
+				} else if(strcmp(argv[i], "--sparse") == 0) {
+					opt.sparse = 1;
+
+				} else if(strcmp(argv[i], "--delta") == 0) {
+					opt.delta = 1;
+
+				} else if(strcmp(argv[i], "--hash") == 0) {
+					opt.hash = 1;
+
+				} else if(strcmp(argv[i], "--store") == 0) {
+					if(!argv[++i]) {
+						fprintf(stderr, "--store must be followed by the store directory\n");
+						return -1;
+					}
+					opt.store = argv[i];
+
+				} else if(strcmp(argv[i], "--ingest") == 0) {
+					opt.ingest = 1;
+
+				} else if(strcmp(argv[i], "--extract") == 0) {
+					if(!argv[++i]) {
+						fprintf(stderr, "--extract must be followed by the name of a stored disk\n");
+						return -1;
+					}
+					opt.extract = argv[i];
+
+				} else if(strcmp(argv[i], "--record") == 0) {
+					if(!argv[++i]) {
+						fprintf(stderr, "--record must be followed by the recording filename\n");
+						return -1;
+					}
+					opt.record = argv[i];
+
+				} else if(strcmp(argv[i], "--replay") == 0 || strcmp(argv[i], "--replay-fast") == 0) {
+					opt.replay_fast = argv[i][8] == '-';
+					if(!argv[++i]) {
+						fprintf(stderr, "%s must be followed by the recording filename\n", argv[i - 1]);
+						return -1;
+					}
+					opt.replay = argv[i];
+
+				} else if(strcmp(argv[i], "--calibrate") == 0) {
+					opt.calibrate = 1;
+
+				} else if(strcmp(argv[i], "--geometry") == 0) {
+					if(!argv[++i] || geom_select(argv[i]) == -1) {
+						fprintf(stderr, "--geometry must be followed by one of: ");
+						geom_list(stderr);
+						return -1;
+					}
+
+				} else if(strcmp(argv[i], "--help") == 0) {
+					print_usage(argv[0]);
+					exit(0);
+
+				} else {
+					fprintf(stderr, "invalid option: %s\n\n", argv[i]);
+					print_usage(argv[0]);
+					return -1;
+				}
+
+			} else if(argv[i][2] == 0) {
 				switch(argv[i][1]) {
 				case 'w':
 					opt.write_disk = 1;
@@ -81,12 +191,21 @@ int init_options(int argc, char **argv)
 						fprintf(stderr, "-r must be followed by the number of retries\n");
 						return -1;
 					}
+					retries_given = 1;
 					break;
 
 				case 's':
 					opt.verbose = 0;
 					break;
 
+				case 'z':
+					opt.complevel = strtol(argv[++i], &endp, 10);
+					if(endp == argv[i] || opt.complevel < 0 || opt.complevel > 9) {
+						fprintf(stderr, "-z must be followed by a compression level (0-9)\n");
+						return -1;
+					}
+					break;
+
 				case 'h':
 					print_usage(argv[0]);
 					exit(0);
@@ -103,19 +222,72 @@ int init_options(int argc, char **argv)
 			}
 
 		} else {
-			if(opt.fname) {
-				fprintf(stderr, "unexpected argument: %s\n\n", argv[i]);
-				print_usage(argv[0]);
-				return -1;
-			}
-			opt.fname = argv[i];
+			opt.files[opt.nfiles++] = argv[i];
 		}
 	}
 
-	if(!opt.fname) {
+	if(opt.nfiles > 1 && !opt.ingest) {
+		fprintf(stderr, "unexpected argument: %s\n\n", opt.files[1]);
+		print_usage(argv[0]);
+		return -1;
+	}
+	opt.fname = opt.nfiles ? opt.files[0] : 0;
+
+	if((opt.profile = drive_profile(opt.devfile, geom->density))) {
+		if(opt.profile->retries > 0 && !retries_given) {
+			opt.retries = opt.profile->retries;
+		}
+	}
+
+	if(opt.calibrate) {
+		if(opt.fname || opt.compare || opt.store || opt.write_disk || opt.resume || opt.repair) {
+			fprintf(stderr, "--calibrate only takes the device, and a known-good disk in the drive\n");
+			return -1;
+		}
+		return 0;
+	}
+
+	if((opt.ingest || opt.extract) && !opt.store) {
+		fprintf(stderr, "--ingest and --extract need a track store (--store)\n");
+		return -1;
+	}
+	if(opt.ingest && opt.extract) {
+		fprintf(stderr, "--ingest and --extract can't be used together\n");
+		return -1;
+	}
+
+	if(!opt.fname && !opt.compare) {
 		fprintf(stderr, "you need to specify the ADF image filename\n");
 		return -1;
 	}
+	if(opt.write_disk && geom->density != GEOM_DD) {
+		fprintf(stderr, "writing %s disks is not supported\n", geom->name);
+		return -1;
+	}
+	if(opt.delta && !opt.write_disk) {
+		fprintf(stderr, "--delta only makes sense when writing (-w)\n");
+		return -1;
+	}
+	if(opt.store && (opt.write_disk || opt.resume || opt.repair || opt.compare)) {
+		fprintf(stderr, "--store can only be used when reading a disk, or with --ingest/--extract\n");
+		return -1;
+	}
+	if(opt.fname && strcmp(opt.fname, "-") == 0 && (opt.write_disk || opt.resume || opt.repair)) {
+		fprintf(stderr, "the image can only be streamed to stdout when reading from scratch\n");
+		return -1;
+	}
+	if(opt.keep_bad && (opt.write_disk || opt.compare || opt.store || strcmp(opt.fname, "-") == 0)) {
+		fprintf(stderr, "--keep-bad only applies when reading the disk to an image file\n");
+		return -1;
+	}
+	if(opt.record && opt.replay) {
+		fprintf(stderr, "--record and --replay can't be used together\n");
+		return -1;
+	}
+	if(opt.fname && opt.compare) {
+		fprintf(stderr, "--compare does not produce an image, unexpected argument: %s\n", opt.fname);
+		return -1;
+	}
 	return 0;
 }
 
@@ -123,43 +295,96 @@ int init_options(int argc, char **argv)
 static void print_usage(const char *argv0)
 {
 	printf("Usage: %s [options] <amiga disk image>\n", argv0);
+	printf("       %s [options] --compare <reference image>\n", argv0);
+	printf("       %s [options] --store <dir> <disk name>\n", argv0);
+	printf("       %s [options] --store <dir> --ingest <amiga disk image>...\n", argv0);
+	printf("       %s [options] --store <dir> --extract <disk name> <amiga disk image>\n", argv0);
 	printf("Options:\n");
 	printf(" -w           write ADF image to disk (default: read from disk)\n");
 	printf(" -v           verify after writing (default: no verification)\n");
 	printf(" -d <device>  specify which device to use (default: " DEV_DEFAULT ")\n");
 	printf(" -s           run silent, print only errors\n");
-	printf(" -r <retries> how many retries to attempt while reading (default: %d)\n", RETRIES_DEFAULT);
+	printf(" -r <retries> retries per bad track, spread over the repair passes (default: %d)\n", RETRIES_DEFAULT);
+	printf(" -z <level>   gzip compress the image while reading (level 0-9). Images\n");
+	printf("              named *.adz or *.gz are always compressed (default level: 6)\n");
+	printf(" --resume     continue an interrupted read from <image>.part\n");
+	printf(" --repair     re-read only the sectors of an existing image which are\n");
+	printf("              marked bad or missing in its <image>.secmap\n");
+	printf(" --keep-bad   if sectors are still bad after all retries, save the image\n");
+	printf("              anyway with them zeroed, and list them in <image>.secmap\n");
+	printf("              for a later --repair (default: keep <image>.part)\n");
+	printf(" --compare <adf>  compare the disk against a reference image, sector by\n");
+	printf("              sector. Exits with 0 if it matches, 2 if it differs\n");
+	printf(" --fail-fast  stop comparing at the first difference\n");
+	printf(" --sparse     read only the tracks with blocks allocated in the filesystem\n");
+	printf("              bitmap, and fill the rest with the format pattern. Falls\n");
+	printf("              back to a full read if the disk is not a valid DOS disk\n");
+	printf(" --delta      when writing, read each track first, and write only the\n");
+	printf("              tracks which differ from the image\n");
+	printf(" --hash       compute the CRC32, MD5 and SHA-1 of the image and of each\n");
+	printf("              track while reading, and save them to <image>.hash\n");
+	printf(" --store <dir>  archive mode: store each distinct track once in <dir>,\n");
+	printf("              named by its SHA-1, and each disk as a list of track hashes.\n");
+	printf("              Reads the disk into the store under the given name\n");
+	printf(" --ingest     add existing images to the store, named after their files\n");
+	printf(" --extract <name>  reconstitute a stored disk as an image\n");
+	printf(" --record <file>  record everything sent to and from the device to a file\n");
+	printf(" --replay <file>  play back a recording instead of using the device, at\n");
+	printf("              the original timing (--replay-fast: as fast as possible)\n");
+	printf(" --calibrate  measure the best timing for the drive on a known-good disk,\n");
+	printf("              and save it as its profile in the config file, where it's\n");
+	printf("              picked up every time the drive is used\n");
+	printf(" --geometry <geom>  disk geometry: dd (default) or hd, 80 cylinders, or\n");
+	printf("              81-83 with extra cylinders (dd81, hd83 etc)\n");
 	printf(" -h           print help and exit\n");
+	printf("Use - as the image name to stream the image to stdout, e.g. to pipe it\n");
+	printf("into other tools. All messages then go to stderr.\n");
 }
 
 
-static int load_config(void)
+const struct afl_profile *drive_profile(const char *devfile, int density)
+{
+	struct drive_profile *dp;
+
+	if((dp = find_profile(devfile, density))) {
+		return &dp->prof;
+	}
+	if(!(dp = find_profile(devfile, !density))) {
+		return 0;
+	}
+	/* the mechanics of the drive are the same in either mode */
+	memset(&step_prof, 0, sizeof step_prof);
+	step_prof.density = density;
+	step_prof.step_ms = dp->prof.step_ms;
+	step_prof.settle_ms = dp->prof.settle_ms;
+	step_prof.rev_usec = dp->prof.rev_usec;
+	return &step_prof;
+}
+
+int load_config(void)
 {
 	FILE *fp;
-	int val;
-	char buf[512], *line, *endp, *valstr;
+	int val, density;
+	char buf[512], *line, *endp, *valstr, *devfile;
 	char *fname;
+	struct drive_profile *dp = 0;
 
 	if((fp = fopen("amigafloppy.conf", "r"))) {
 		fname = alloca(20);
 		strcpy(fname, "amigafloppy.conf");
 	} else {
-		char *env;
-		struct passwd *pw;
-
-		if((pw = getpwuid(getuid()))) {
-			sprintf(buf, "%s/.amigafloppy.conf", pw->pw_dir);
-		} else if((env = getenv("HOME"))) {
-			sprintf(buf, "%s/.amigafloppy.conf", env);
-		} else {
-			return -1;
-		}
-		if(!(fp = fopen(buf, "r"))) {
+		if(home_config(buf) == -1 || !(fp = fopen(buf, "r"))) {
 			return -1;
 		}
 		fname = alloca(strlen(buf) + 1);
 		strcpy(fname, buf);
 	}
+	if(!(cfgfile = malloc(strlen(fname) + 1))) {
+		fprintf(stderr, "failed to allocate config filename buffer\n");
+		fclose(fp);
+		return -1;
+	}
+	strcpy(cfgfile, fname);
 
 	while(fgets(buf, sizeof buf, fp)) {
 		line = skip_wspace(buf);
@@ -167,6 +392,30 @@ static int load_config(void)
 			*endp = 0;
 		}
 		if(!*line) continue;
+
+		/* everything after a [drive <device> <density>] line is the profile of
+		 * that device in that capture mode
+		 */
+		if(*line == '[') {
+			dp = 0;
+			if(section_device(line, &devfile, &density) == -1) {
+				fprintf(stderr, "config file: %s: invalid section: %s\n", fname, line);
+			} else if(!(dp = find_profile(devfile, density))) {
+				if(nprofiles >= MAX_PROFILES) {
+					fprintf(stderr, "config file: %s: too many drive profiles, ignoring %s\n", fname, devfile);
+					continue;
+				}
+				dp = profiles + nprofiles++;
+				if(!(dp->devfile = malloc(strlen(devfile) + 1))) {
+					fprintf(stderr, "failed to allocate device filename buffer (%s)\n", devfile);
+					abort();
+				}
+				strcpy(dp->devfile, devfile);
+				dp->prof.density = density;
+			}
+			continue;
+		}
+
 		if(!(endp = strchr(line, '=')) || !*(valstr = cleanstr(endp + 1))) {
 			fprintf(stderr, "config file: %s: invalid line: %s\n", fname, line);
 			continue;
@@ -174,7 +423,12 @@ static int load_config(void)
 		*endp = 0;
 		line = cleanstr(line);
 
-		if(strcasecmp(line, "verify") == 0) {
+		if(dp) {
+			if(profile_option(dp, line, valstr) == -1) {
+				fprintf(stderr, "config file: %s: invalid drive profile option: %s = %s\n", fname, line, valstr);
+			}
+
+		} else if(strcasecmp(line, "verify") == 0) {
 			if((val = strbool(valstr)) == -1) {
 				fprintf(stderr, "config file: %s: verify must be followed by a boolean value (found: %s)\n", fname, valstr);
 				continue;
@@ -197,6 +451,174 @@ static int load_config(void)
 	return 0;
 }
 
+static int home_config(char *buf)
+{
+	char *env;
+	struct passwd *pw;
+
+	if((pw = getpwuid(getuid()))) {
+		sprintf(buf, "%s/.amigafloppy.conf", pw->pw_dir);
+	} else if((env = getenv("HOME"))) {
+		sprintf(buf, "%s/.amigafloppy.conf", env);
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+static struct drive_profile *find_profile(const char *devfile, int density)
+{
+	int i;
+
+	for(i=0; i<nprofiles; i++) {
+		if(strcmp(profiles[i].devfile, devfile) == 0 && profiles[i].prof.density == density) {
+			return profiles + i;
+		}
+	}
+	return 0;
+}
+
+static int profile_option(struct drive_profile *dp, const char *key, char *valstr)
+{
+	int val;
+	char *endp;
+	struct afl_profile *p = &dp->prof;
+
+	if(strcasecmp(key, "rpm") == 0) {
+		double rpm = strtod(valstr, &endp);
+		if(endp == valstr || rpm <= 0) return -1;
+		p->rev_usec = (long)(60000000.0 / rpm + 0.5);
+		return 0;
+	}
+
+	val = strtol(valstr, &endp, 10);
+	if(endp == valstr || *endp || val < 0) {
+		return -1;
+	}
+	if(strcasecmp(key, "step_ms") == 0) {
+		p->step_ms = val;
+	} else if(strcasecmp(key, "settle_ms") == 0) {
+		p->settle_ms = val;
+	} else if(strcasecmp(key, "short_max") == 0) {
+		p->short_max = val;
+	} else if(strcasecmp(key, "long_min") == 0) {
+		p->long_min = val;
+	} else if(strcasecmp(key, "read_slack_ms") == 0) {
+		p->read_slack_ms = val;
+	} else if(strcasecmp(key, "retries") == 0) {
+		p->retries = val;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+/* parses a [drive <device> <density>] line, in place */
+static int section_device(char *line, char **devfile, int *density)
+{
+	int i;
+	char *endp;
+
+	line = cleanstr(line);
+	endp = line + strlen(line) - 1;
+	if(*endp != ']') {
+		return -1;
+	}
+	*endp = 0;
+	line = cleanstr(line + 1);
+	if(strncasecmp(line, "drive", 5) != 0 || !isspace(line[5])) {
+		return -1;
+	}
+	*devfile = cleanstr(line + 5);
+
+	/* the density is the last word, if there's more than one */
+	*density = AFL_DD;
+	endp = *devfile + strlen(*devfile);
+	while(endp > *devfile && !isspace(endp[-1])) endp--;
+	if(endp > *devfile) {
+		for(i=0; i<2; i++) {
+			if(strcasecmp(endp, density_name[i]) == 0) {
+				*density = i;
+				endp[-1] = 0;
+				*devfile = cleanstr(*devfile);
+				break;
+			}
+		}
+	}
+	return **devfile ? 0 : -1;
+}
+
+/* Copies the config file over, without the section of the device for the
+ * density of the profile, and adds the new one at the end. Writes to ~/.amigafloppy.conf if there was no
+ * config file.
+ */
+int save_profile(const char *devfile, const struct afl_profile *prof)
+{
+	FILE *in, *out;
+	char buf[512], *fname, *tmpname, *line, *dev;
+	int skip = 0, blank = 1, density;
+
+	if(cfgfile) {
+		fname = cfgfile;
+	} else {
+		if(home_config(buf) == -1) {
+			fprintf(stderr, "can't find the home directory to save the drive profile in\n");
+			return -1;
+		}
+		fname = alloca(strlen(buf) + 1);
+		strcpy(fname, buf);
+	}
+	tmpname = alloca(strlen(fname) + 5);
+	sprintf(tmpname, "%s.tmp", fname);
+
+	if(!(out = fopen(tmpname, "w"))) {
+		fprintf(stderr, "failed to save the drive profile: %s: %s\n", tmpname, strerror(errno));
+		return -1;
+	}
+
+	if((in = fopen(fname, "r"))) {
+		while(fgets(buf, sizeof buf, in)) {
+			line = skip_wspace(buf);
+			if(*line == '[') {
+				char tmp[512];
+				strcpy(tmp, line);
+				skip = section_device(tmp, &dev, &density) != -1 && strcmp(dev, devfile) == 0 &&
+					density == prof->density;
+			}
+			if(!skip) {
+				fputs(buf, out);
+				blank = !*line;
+			}
+		}
+		fclose(in);
+	}
+
+	fprintf(out, "%s[drive %s %s]\n", blank ? "" : "\n", devfile, density_name[prof->density]);
+	if(prof->rev_usec > 0) {
+		fprintf(out, "rpm = %.2f\n", 60000000.0 / prof->rev_usec);
+	}
+	if(prof->step_ms > 0) {
+		fprintf(out, "step_ms = %d\nsettle_ms = %d\n", prof->step_ms, prof->settle_ms);
+	}
+	if(prof->short_max > 0) {
+		fprintf(out, "short_max = %d\nlong_min = %d\n", prof->short_max, prof->long_min);
+	}
+	if(prof->read_slack_ms > 0) {
+		fprintf(out, "read_slack_ms = %d\n", prof->read_slack_ms);
+	}
+	if(prof->retries > 0) {
+		fprintf(out, "retries = %d\n", prof->retries);
+	}
+
+	if(fclose(out) == EOF || rename(tmpname, fname) == -1) {
+		fprintf(stderr, "failed to save the drive profile to %s: %s\n", fname, strerror(errno));
+		remove(tmpname);
+		return -1;
+	}
+	printf("Saved the %s profile of %s to %s\n", density_name[prof->density], devfile, fname);
+	return 0;
+}
+
 static char *skip_wspace(char *s)
 {
 	while(*s && isspace(*s)) s++;
@@ -18,6 +18,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef OPT_H_
 #define OPT_H_
 
+#include "amigafloppy.h"
+
 struct options {
 	char *fname;
 	char *devfile;
@@ -25,8 +27,40 @@ struct options {
 	int write_disk;
 	int verbose;
 	int retries;
+	int resume, repair;
+	int keep_bad;
+	char *compare;
+	int fail_fast;
+	int sparse;
+	int delta;
+	int complevel;
+	int hash;
+	char *store;
+	int ingest;
+	char *extract;
+	char *record, *replay;
+	int replay_fast;
+	int calibrate;
+	const struct afl_profile *profile;	/* of the device, from the config file */
+	char **files;
+	int nfiles;
 } opt;
 
 int init_options(int argc, char **argv);
 
+/* reads the config file, which init_options does first thing, for programs
+ * without its command line. Returns -1 if there is none.
+ */
+int load_config(void);
+/* the profile of a device for a capture mode (GEOM_DD or GEOM_HD) from the
+ * config file, or 0. Without one for that mode, but one for the other, it's
+ * just the step timing of that, valid until the next call.
+ */
+const struct afl_profile *drive_profile(const char *devfile, int density);
+
+/* saves the profile of a device to the config file, in place of any it had
+ * for the same capture mode
+ */
+int save_profile(const char *devfile, const struct afl_profile *prof);
+
 #endif	/* OPT_H_ */
@@ -0,0 +1,109 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include "pll.h"
+
+/* the PLL works in quarter cells, with PLL_FRAC bits of fraction */
+#define PLL_FRAC		8
+#define CELL			(4 << PLL_FRAC)
+/* how far the cell length may drift from nominal */
+#define CELL_MIN		(CELL * 90 / 100)
+#define CELL_MAX		(CELL * 110 / 100)
+/* percentages of the phase error at each pulse which go into correcting the
+ * cell length, and the phase
+ */
+#define PERIOD_ADJ		5
+#define PHASE_ADJ		60
+/* MFM never has more than 3 zeros in a row: after a longer gap, the phase
+ * error says nothing about the cell length, so let it relax towards nominal
+ */
+#define MAX_ZEROS		3
+/* pulses this far off the middle of their cell, in percent of the half cell
+ * to its edge, might as well have belonged with the next cell over
+ */
+#define MARGINAL_PCT	40
+
+#define PUT_BIT(b)	\
+	do { \
+		val = (val << 1) | (b); \
+		if(++outbits == 8) { \
+			*dptr++ = val; \
+			outbits = 0; \
+			if(dptr - dest >= maxlen) goto done; \
+		} \
+	} while(0)
+
+#define MARK_WEAK(pos)	\
+	do { \
+		if((pos) >= 0 && (pos) < maxlen * 8) { \
+			weak[(pos) >> 3] |= 0x80 >> ((pos) & 7); \
+		} \
+	} while(0)
+
+int pll_decode(unsigned char *dest, unsigned char *weak, int maxlen, const unsigned char *src, int size)
+{
+	int i, j, nib, zeros, pos, outbits = 0;
+	int clock = CELL, phase = 0;
+	unsigned int val = 0;
+	unsigned char *dptr = dest;
+
+	if(weak) {
+		memset(weak, 0, maxlen);
+	}
+
+	for(i=0; i<size; i++) {
+		for(j=0; j<2; j++) {
+			if(!(nib = j ? src[i] & 0xf : src[i] >> 4)) {
+				goto done;
+			}
+			/* a pulse in the first half of the cell belongs with the next one */
+			phase += (nib + FLUX_BIAS) << PLL_FRAC;
+			if(phase < clock / 2) continue;
+
+			/* one cell per clock, the last one with the pulse in it */
+			zeros = 0;
+			phase -= clock;
+			while(phase >= clock / 2) {
+				PUT_BIT(0);
+				phase -= clock;
+				zeros++;
+			}
+			PUT_BIT(1);
+
+			if(weak && (phase > clock * MARGINAL_PCT / 200 || -phase > clock * MARGINAL_PCT / 200)) {
+				pos = (dptr - dest) * 8 + outbits - 1;
+				MARK_WEAK(pos);
+				MARK_WEAK(phase > 0 ? pos + 1 : pos - 1);
+			}
+
+			/* what's left is how far off the middle of the cell the pulse was */
+			if(zeros <= MAX_ZEROS) {
+				clock += phase * PERIOD_ADJ / 100;
+			} else {
+				clock += (CELL - clock) * PERIOD_ADJ / 100;
+			}
+			if(clock < CELL_MIN) clock = CELL_MIN;
+			if(clock > CELL_MAX) clock = CELL_MAX;
+
+			phase = phase * (100 - PHASE_ADJ) / 100;
+		}
+	}
+
+done:
+	return dptr - dest;
+}
@@ -0,0 +1,36 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PLL_H_
+#define PLL_H_
+
+/* Flux reads (firmware 1.9) send each pulse interval in quarters of a bit
+ * cell, minus FLUX_BIAS, as 4-bit values packed two to a byte, high nibble
+ * first. A zero nibble ends the data.
+ */
+#define FLUX_BIAS	3
+
+/* Reconstructs the MFM bit cells from the intervals of a flux read with a
+ * software PLL, which follows the speed the track was written at, instead of
+ * classifying each interval against fixed thresholds. Writes the MFM bits to
+ * dest, up to maxlen bytes, and returns the number of bytes written.
+ * If weak is given, it gets a bitmap parallel to dest, marking the cells of
+ * the pulses which came close to the next cell over, along with that cell.
+ */
+int pll_decode(unsigned char *dest, unsigned char *weak, int maxlen, const unsigned char *src, int size);
+
+#endif	/* PLL_H_ */
@@ -0,0 +1,243 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include "sched.h"
+#include "dev.h"
+#include "opt.h"
+#include "encpool.h"
+
+static unsigned char *cli_trackbuf(void *cls, int trk);
+static int cli_track(void *cls, int trk, const unsigned char *data, unsigned int valid,
+		unsigned int newmask);
+static int cli_raw_track(void *cls, int trk, const unsigned char *mfm, int bits);
+static void cli_progress(void *cls, int pass, int trk);
+static void cli_message(void *cls, int level, const char *msg);
+static void end_progress(void);
+static int count_bad(unsigned int mask);
+static void print_progress(const char *label, int trk);
+
+static struct afl_device *dev;
+static volatile sig_atomic_t aborted;
+static struct read_hooks *hooks;
+static int progress_shown;	/* a progress bar is on the current line */
+
+static struct afl_callbacks callbacks = {
+	cli_trackbuf, 0, cli_track, cli_raw_track, cli_progress, cli_message
+};
+
+void sched_init(struct afl_device *d)
+{
+	dev = d;
+	afl_set_callbacks(dev, &callbacks, 0);
+}
+
+int read_disk(unsigned int *valid, struct read_hooks *rdhooks)
+{
+	hooks = rdhooks;
+	return afl_read_disk(dev, valid, opt.retries);
+}
+
+int write_disk(const unsigned char *img)
+{
+	int i, tries, nwritten = 0, nskipped = 0, nfailed = 0;
+	const unsigned char *data, *mfm;
+
+	/* have the whole image MFM encoded in the background, so that the loop
+	 * below only ever has to push ready-made track buffers to the device
+	 */
+	if(encpool_start(img, 0) == -1) {
+		return -1;
+	}
+
+	for(i=0; i<ADF_NUM_TRACKS && !aborted; i++) {
+		data = img + i * ADF_TRACK_SIZE;
+
+		if(seek_cylinder(dev, i >> 1, 0) == -1 || select_head(dev, i & 1) == -1) {
+			encpool_stop();
+			return -1;
+		}
+
+		if(opt.delta && afl_verify_track(dev, data)) {
+			nskipped++;
+		} else {
+			mfm = encpool_track(i);
+
+			for(tries=0; ; tries++) {
+				if(write_track(dev, mfm, MFM_TRACK_SIZE, 1) != -1 &&
+						(!opt.verify || afl_verify_track(dev, data))) {
+					nwritten++;
+					break;
+				}
+				if(tries >= opt.retries) {
+					dev_message(dev, AFL_ERROR, "failed to write track %d (C:%02d H:%d)", i, i >> 1, i & 1);
+					nfailed++;
+					break;
+				}
+			}
+		}
+
+		if(opt.verbose) {
+			print_progress("Writing", i);
+		}
+	}
+	encpool_stop();
+
+	if(opt.verbose) {
+		end_progress();
+		if(opt.delta) {
+			printf("%d tracks written, %d already up to date\n", nwritten, nskipped);
+		}
+	}
+
+	if(aborted) {
+		fprintf(stderr, "interrupted\n");
+		return -1;
+	}
+	return nfailed ? -1 : 0;
+}
+
+void abort_read(void)
+{
+	aborted = 1;
+	if(dev) {
+		afl_abort(dev);
+	}
+}
+
+/* the image is the default destination, with the tracks marked final in it as
+ * soon as they are complete
+ */
+static unsigned char *cli_trackbuf(void *cls, int trk)
+{
+	return hooks && hooks->trackbuf ? hooks->trackbuf(trk) : adf_track(trk);
+}
+
+static int cli_track(void *cls, int trk, const unsigned char *data, unsigned int valid,
+		unsigned int newmask)
+{
+	if(hooks) {
+		return hooks->track_read ? hooks->track_read(trk, (unsigned char*)data, newmask) : 0;
+	}
+	if(valid == FULL_TRACK_MASK) {
+		adf_track_done(trk);
+	}
+	return 0;
+}
+
+/* non-AmigaDOS tracks are kept as raw MFM in the image (as an extended ADF), but
+ * there's nowhere to put them with hooks
+ */
+static int cli_raw_track(void *cls, int trk, const unsigned char *mfm, int bits)
+{
+	if(hooks || adf_raw_track(trk, mfm, bits) == -1) {
+		return -1;
+	}
+	adf_track_done(trk);
+
+	if(opt.verbose) {
+		end_progress();
+		printf("track %d (C:%02d H:%d) is not AmigaDOS, keeping it as raw MFM (%d bits)\n",
+				trk, trk >> 1, trk & 1, bits);
+	}
+	return 0;
+}
+
+static void cli_progress(void *cls, int pass, int trk)
+{
+	/* afl_read_disk starts out not aborted, even if interrupted before it started */
+	if(aborted) {
+		afl_abort(dev);
+	}
+	if(!opt.verbose) return;
+
+	if(trk < 0) {
+		end_progress();
+	} else {
+		print_progress(pass ? "Retrying" : "Reading", trk);
+	}
+}
+
+/* errors go to stderr, and the rest to stdout when verbose. Either way, the
+ * progress bar line is finished first.
+ */
+static void cli_message(void *cls, int level, const char *msg)
+{
+	if(level != AFL_ERROR && !opt.verbose) return;
+
+	end_progress();
+	if(level == AFL_ERROR) {
+		fprintf(stderr, "%s\n", msg);
+	} else {
+		printf("%s\n", msg);
+	}
+}
+
+static void end_progress(void)
+{
+	if(progress_shown) {
+		putchar('\n');
+		fflush(stdout);
+		progress_shown = 0;
+	}
+}
+
+int count_bad_sectors(unsigned int *valid)
+{
+	int i, count = 0;
+
+	for(i=0; i<ADF_NUM_TRACKS; i++) {
+		count += count_bad(valid[i]);
+	}
+	return count;
+}
+
+static int count_bad(unsigned int mask)
+{
+	int i, count = 0;
+
+	for(i=0; i<ADF_TRACK_SECTORS; i++) {
+		if(!(mask & (1 << i))) count++;
+	}
+	return count;
+}
+
+static void print_progress(const char *label, int trk)
+{
+	int i, p, count;
+
+	p = trk * 100 / (ADF_NUM_TRACKS - 1);
+	count = p / 2;
+
+	printf("%s (C:%02d H:%d) [", label, trk >> 1, trk & 1);
+
+	for(i=0; i<50; i++) {
+		if(i < count || count == 50) {
+			putchar('=');
+		} else if(i == count) {
+			putchar('>');
+		} else {
+			putchar(' ');
+		}
+	}
+
+	printf("] %d%%  \r", p);
+	fflush(stdout);
+	progress_shown = 1;
+}
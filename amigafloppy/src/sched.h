@@ -0,0 +1,63 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SCHED_H_
+#define SCHED_H_
+
+#include "adf.h"
+#include "amigafloppy.h"
+
+#define FULL_TRACK_MASK		((1 << ADF_TRACK_SECTORS) - 1)
+
+/* optional hooks, to read the disk to something other than the ADF image */
+struct read_hooks {
+	/* buffer to decode a track into (default: the track's place in the image) */
+	unsigned char *(*trackbuf)(int trk);
+	/* called after each read of a track, with a mask of the newly valid
+	 * sectors in buf. Returning -1 stops the whole read.
+	 */
+	int (*track_read)(int trk, unsigned char *buf, unsigned int newmask);
+};
+
+/* sets up the callbacks of the device, for read_disk and the messages */
+void sched_init(struct afl_device *dev);
+
+/* Reads the whole disk into the ADF image with afl_read_disk, and opt.retries.
+ * Tracks are marked final in the image as they are completed, and tracks which
+ * aren't AmigaDOS are kept raw.
+ *
+ * valid holds a bitmask of good sectors for each of the ADF_NUM_TRACKS tracks,
+ * and is updated as sectors are read. Tracks which are already fully valid on
+ * entry are not read at all. hooks may be null.
+ *
+ * Returns 0 if every sector was read successfully, -1 otherwise.
+ */
+int read_disk(unsigned int *valid, struct read_hooks *hooks);
+
+int count_bad_sectors(unsigned int *valid);
+
+/* Writes the image to the disk, which must be in write mode (afl_begin_write). With
+ * opt.verify, each track is read back and rewritten if it doesn't match, up to
+ * opt.retries times. With opt.delta, each track is read first, and only
+ * written if its contents differ from the image.
+ */
+int write_disk(const unsigned char *img);
+
+/* makes read_disk/write_disk stop after the current track (safe to call from a signal handler) */
+void abort_read(void);
+
+#endif	/* SCHED_H_ */
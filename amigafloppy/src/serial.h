@@ -22,6 +22,22 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define SER_8N2		1
 #define SER_HWFLOW	2
 
+/* Session recording: after ser_record, the next ser_open opens the device as
+ * usual, and logs every byte read from or written to it, with timestamps.
+ * After ser_replay, the next ser_open opens a recording instead of a device,
+ * and plays back the device side of it: the data comes in the same chunks,
+ * and each only once everything written before it in the recording has been
+ * written again. With SER_REPLAY_FAST it's as fast as possible, otherwise
+ * at the original timing.
+ *
+ * Either applies to the next ser_open only, and there can only be one session
+ * of each at a time: they fail while the last one is still open.
+ */
+#define SER_REPLAY_FAST	1
+
+int ser_record(const char *fname);
+int ser_replay(const char *fname, unsigned int mode);
+
 int ser_open(const char *port, int baud, unsigned int mode);
 void ser_close(int fd);
 
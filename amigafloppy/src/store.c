@@ -0,0 +1,395 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "store.h"
+#include "adf.h"
+#include "hash.h"
+
+static int make_dir(const char *path);
+static int sync_dir(const char *path);
+static char *store_path(const char *sub, const char *name);
+static char *object_path(const unsigned char *sha1);
+static int put_object(const unsigned char *data, const unsigned char *sha1);
+static int get_object(const unsigned char *sha1, unsigned char *data);
+static int parse_hash(const char *str, unsigned char *sha1);
+static int valid_name(const char *name);
+
+static char *root;
+static char *pathbuf;
+static int pathbuf_size;
+static struct store_stats stats;
+
+int store_open(const char *dir)
+{
+	if(root) return -1;
+
+	if(!(root = malloc(strlen(dir) + 1))) {
+		fprintf(stderr, "failed to allocate store path\n");
+		return -1;
+	}
+	strcpy(root, dir);
+
+	pathbuf_size = strlen(dir) + 128;
+	if(!(pathbuf = malloc(pathbuf_size))) {
+		fprintf(stderr, "failed to allocate store path\n");
+		goto err;
+	}
+
+	if(make_dir(root) == -1 || make_dir(store_path("objects", 0)) == -1 ||
+			make_dir(store_path("disks", 0)) == -1) {
+		goto err;
+	}
+
+	memset(&stats, 0, sizeof stats);
+	return 0;
+
+err:
+	store_close();
+	return -1;
+}
+
+void store_close(void)
+{
+	free(root);
+	free(pathbuf);
+	root = pathbuf = 0;
+}
+
+int store_put(const char *name, const unsigned char *img)
+{
+	int i, res, nnew = 0;
+	FILE *fp;
+	char hexbuf[41], *tmpname, *fname;
+	unsigned char sha1[ADF_MAX_TRACKS][20], imgsha1[20];
+	struct sha1_state sha;
+
+	if(!root) return -1;
+	if(!valid_name(name)) {
+		fprintf(stderr, "invalid disk name for the store: %s\n", name);
+		return -1;
+	}
+
+	sha1_init(&sha);
+	sha1_update(&sha, img, ADF_SIZE);
+	sha1_final(&sha, imgsha1);
+
+	for(i=0; i<ADF_NUM_TRACKS; i++) {
+		const unsigned char *trk = img + i * ADF_TRACK_SIZE;
+
+		sha1_init(&sha);
+		sha1_update(&sha, trk, ADF_TRACK_SIZE);
+		sha1_final(&sha, sha1[i]);
+
+		if((res = put_object(trk, sha1[i])) == -1) {
+			return -1;
+		}
+		nnew += res;
+	}
+
+	/* write the manifest under a temporary name, and rename it into place, so
+	 * that a manifest always refers to objects which are already stored
+	 */
+	if(!(fname = store_path("disks", name)) || !(tmpname = malloc(strlen(fname) + 6))) {
+		fprintf(stderr, "failed to allocate filename buffer\n");
+		return -1;
+	}
+	sprintf(tmpname, "%s.part", fname);
+
+	if(!(fp = fopen(tmpname, "w"))) {
+		fprintf(stderr, "failed to open %s for writing: %s\n", tmpname, strerror(errno));
+		free(tmpname);
+		return -1;
+	}
+	fprintf(fp, "# amigafloppy manifest: track, sha1 of the track data\n");
+	fprintf(fp, "geometry %s\n", geom->name);
+	fprintf(fp, "image %s\n", hash_hexstr(hexbuf, imgsha1, 20));
+	for(i=0; i<ADF_NUM_TRACKS; i++) {
+		fprintf(fp, "%03d %s\n", i, hash_hexstr(hexbuf, sha1[i], 20));
+	}
+	if(fclose(fp) == EOF || rename(tmpname, fname) == -1) {
+		fprintf(stderr, "failed to write manifest %s: %s\n", tmpname, strerror(errno));
+		remove(tmpname);
+		free(tmpname);
+		return -1;
+	}
+	free(tmpname);
+
+	stats.ndisks++;
+	stats.ntracks += ADF_NUM_TRACKS;
+	stats.nnew += nnew;
+	return 0;
+}
+
+int store_get(const char *name, unsigned char *img)
+{
+	FILE *fp;
+	char buf[128], hexstr[64], *fname;	/* fname is only valid until the first get_object */
+	int trk, nread = 0;
+	unsigned char sha1[20], imgsha1[20], have[ADF_MAX_TRACKS];
+	struct sha1_state sha;
+
+	if(!root) return -1;
+	if(!valid_name(name)) {
+		fprintf(stderr, "invalid disk name for the store: %s\n", name);
+		return -1;
+	}
+
+	if(!(fname = store_path("disks", name)) || !(fp = fopen(fname, "r"))) {
+		fprintf(stderr, "failed to open the manifest of disk %s: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	memset(have, 0, sizeof have);
+	memset(imgsha1, 0, sizeof imgsha1);
+
+	while(fgets(buf, sizeof buf, fp)) {
+		if(buf[0] == '#') continue;
+
+		/* manifests without a geometry line are standard DD disks */
+		if(sscanf(buf, "geometry %63s", hexstr) == 1) {
+			if(strcmp(hexstr, geom->name) != 0) {
+				fprintf(stderr, "disk %s is %s, use --geometry %s to extract it\n", name, hexstr, hexstr);
+				fclose(fp);
+				return -1;
+			}
+			continue;
+		}
+		if(sscanf(buf, "image %63s", hexstr) == 1) {
+			if(parse_hash(hexstr, imgsha1) == -1) goto inval;
+			continue;
+		}
+		if(sscanf(buf, "%d %63s", &trk, hexstr) != 2 || trk < 0 || trk >= ADF_NUM_TRACKS ||
+				have[trk] || parse_hash(hexstr, sha1) == -1) {
+			goto inval;
+		}
+		if(get_object(sha1, img + trk * ADF_TRACK_SIZE) == -1) {
+			fclose(fp);
+			return -1;
+		}
+		have[trk] = 1;
+		nread++;
+	}
+	fclose(fp);
+
+	if(nread != ADF_NUM_TRACKS) {
+		fprintf(stderr, "disk %s: incomplete manifest\n", name);
+		return -1;
+	}
+
+	sha1_init(&sha);
+	sha1_update(&sha, img, ADF_SIZE);
+	sha1_final(&sha, sha1);
+	if(memcmp(sha1, imgsha1, 20) != 0) {
+		fprintf(stderr, "disk %s: image hash mismatch\n", name);
+		return -1;
+	}
+	return 0;
+
+inval:
+	fprintf(stderr, "disk %s: invalid manifest line: %s", name, buf);
+	fclose(fp);
+	return -1;
+}
+
+void store_get_stats(struct store_stats *st)
+{
+	*st = stats;
+}
+
+/* returns 1 if the directory was created, 0 if it was already there */
+static int make_dir(const char *path)
+{
+	if(mkdir(path, 0777) == -1) {
+		if(errno == EEXIST) return 0;
+		fprintf(stderr, "failed to create directory %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 1;
+}
+
+/* flushes the entries of a directory, for the files just renamed into it */
+static int sync_dir(const char *path)
+{
+	int fd, res;
+
+	if((fd = open(path, O_RDONLY)) == -1) {
+		fprintf(stderr, "failed to open directory %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if((res = fsync(fd)) == -1) {
+		fprintf(stderr, "failed to sync directory %s: %s\n", path, strerror(errno));
+	}
+	close(fd);
+	return res;
+}
+
+/* returns <root>/<sub>/<name> in a shared buffer, valid until the next call */
+static char *store_path(const char *sub, const char *name)
+{
+	int len = strlen(root) + strlen(sub) + (name ? strlen(name) : 0) + 8;
+
+	if(len > pathbuf_size) {
+		char *tmp;
+		if(!(tmp = realloc(pathbuf, len))) {
+			return 0;
+		}
+		pathbuf = tmp;
+		pathbuf_size = len;
+	}
+
+	if(name) {
+		sprintf(pathbuf, "%s/%s/%s", root, sub, name);
+	} else {
+		sprintf(pathbuf, "%s/%s", root, sub);
+	}
+	return pathbuf;
+}
+
+/* objects are spread over 256 subdirectories by the first byte of their hash */
+static char *object_path(const unsigned char *sha1)
+{
+	char hexstr[41], sub[16];
+
+	hash_hexstr(hexstr, sha1, 20);
+	sprintf(sub, "objects/%c%c", hexstr[0], hexstr[1]);
+	return store_path(sub, hexstr + 2);
+}
+
+/* returns 1 if the object was added, 0 if it was already there */
+static int put_object(const unsigned char *data, const unsigned char *sha1)
+{
+	int fd, len, newdir;
+	char *path, *tmpname, *slash;
+	struct stat st;
+
+	/* an object of any other size can't be a track, so it's replaced */
+	path = object_path(sha1);
+	if(stat(path, &st) == 0 && st.st_size == ADF_TRACK_SIZE) {
+		return 0;
+	}
+
+	len = strlen(path);
+	if(!(tmpname = malloc(len + 16))) {
+		fprintf(stderr, "failed to allocate filename buffer\n");
+		return -1;
+	}
+	strcpy(tmpname, path);
+
+	slash = strrchr(tmpname, '/');
+	*slash = 0;
+	if((newdir = make_dir(tmpname)) == -1) {
+		goto err;
+	}
+	*slash = '/';
+
+	/* write to a temporary first, and flush it before renaming it into
+	 * place, so that a crash never leaves a truncated object behind, which
+	 * would be taken as valid next time
+	 */
+	sprintf(tmpname + len, ".%d", (int)getpid());
+	if((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0444)) == -1) {
+		fprintf(stderr, "failed to create %s: %s\n", tmpname, strerror(errno));
+		goto err;
+	}
+	if(write(fd, data, ADF_TRACK_SIZE) != ADF_TRACK_SIZE || fsync(fd) == -1) {
+		fprintf(stderr, "failed to write %s: %s\n", tmpname, strerror(errno));
+		close(fd);
+		remove(tmpname);
+		goto err;
+	}
+	if(close(fd) == -1) {
+		fprintf(stderr, "failed to write %s: %s\n", tmpname, strerror(errno));
+		remove(tmpname);
+		goto err;
+	}
+
+	if(rename(tmpname, path) == -1) {
+		fprintf(stderr, "failed to rename %s to %s: %s\n", tmpname, path, strerror(errno));
+		remove(tmpname);
+		goto err;
+	}
+
+	/* the manifest refers to the object, so its name must be on disk too */
+	*slash = 0;
+	if(sync_dir(tmpname) == -1 || (newdir && sync_dir(store_path("objects", 0)) == -1)) {
+		goto err;
+	}
+	free(tmpname);
+	return 1;
+
+err:
+	free(tmpname);
+	return -1;
+}
+
+static int get_object(const unsigned char *sha1, unsigned char *data)
+{
+	int fd, res;
+	char *path;
+	unsigned char check[20];
+	struct sha1_state sha;
+
+	path = object_path(sha1);
+	if((fd = open(path, O_RDONLY)) == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	res = read(fd, data, ADF_TRACK_SIZE);
+	close(fd);
+
+	if(res != ADF_TRACK_SIZE) {
+		fprintf(stderr, "failed to read track object %s\n", path);
+		return -1;
+	}
+
+	sha1_init(&sha);
+	sha1_update(&sha, data, ADF_TRACK_SIZE);
+	sha1_final(&sha, check);
+	if(memcmp(check, sha1, 20) != 0) {
+		fprintf(stderr, "track object %s is corrupted\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+static int parse_hash(const char *str, unsigned char *sha1)
+{
+	int i;
+	unsigned int byte;
+
+	if(strlen(str) != 40) return -1;
+
+	for(i=0; i<20; i++) {
+		if(sscanf(str + i * 2, "%2x", &byte) != 1) {
+			return -1;
+		}
+		sha1[i] = byte;
+	}
+	return 0;
+}
+
+static int valid_name(const char *name)
+{
+	return *name && *name != '.' && !strchr(name, '/');
+}
@@ -0,0 +1,45 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef STORE_H_
+#define STORE_H_
+
+/* Content-addressed track store, for deduplicating large disk archives. Every
+ * distinct track is stored once, in a file named after the SHA-1 of its
+ * contents (<dir>/objects/xx/xxxx...), and every disk is a manifest
+ * (<dir>/disks/<name>) listing the hashes of its ADF_NUM_TRACKS tracks.
+ */
+
+struct store_stats {
+	int ndisks;		/* manifests written since store_open */
+	int ntracks;	/* tracks referenced by them */
+	int nnew;		/* tracks which weren't already in the store */
+};
+
+int store_open(const char *dir);
+void store_close(void);
+
+/* stores a whole ADF image as the disk <name>, replacing any previous manifest
+ * with the same name
+ */
+int store_put(const char *name, const unsigned char *img);
+/* reconstitutes the ADF image of disk <name>, verifying every track hash */
+int store_get(const char *name, unsigned char *img);
+
+void store_get_stats(struct store_stats *st);
+
+#endif	/* STORE_H_ */
@@ -16,6 +16,8 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
@@ -23,17 +25,90 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <sys/ioctl.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <termios.h>
 #include "serial.h"
 
+/* a recording starts with REC_MAGIC, followed by a record per read or write:
+ * the direction (REC_READ or REC_WRITE), the microseconds since the previous
+ * record and the length as 32-bit big endian, and the data
+ */
+#define REC_MAGIC		"AFLSER1\n"
+#define REC_MAGIC_LEN	8
+#define REC_READ		'<'
+#define REC_WRITE		'>'
+#define REC_HDR_SIZE	9
+
 static int baud_id(int baud);
+static void rec_log(int dir, const void *buf, int count);
+static int open_replay(void);
+static int replay_ready(void);
+static long replay_wait_usec(void);
+static void replay_written(const void *buf, int count);
+static int next_record(void);
+static long long get_usec(void);
+static uint32_t get32(const unsigned char *p);
+static void put32(unsigned char *p, uint32_t v);
+
+/* recording state, of the one device opened after ser_record */
+static char *rec_fname;
+static FILE *rec_fp;
+static int rec_fd = -1;
+static long long rec_last;
+
+/* replay state: the whole recording, the current record and how much of it
+ * is used up, and when its data becomes available
+ */
+static char *rp_fname;
+static unsigned int rp_mode;
+static int rp_fd = -1;
+static unsigned char *rp_data;
+static long rp_size, rp_pos, rp_used;
+static int rp_dir, rp_len;
+static long long rp_time, rp_skew;
+static int rp_diverged;
+
+int ser_record(const char *fname)
+{
+	if(rec_fp) {
+		fprintf(stderr, "ser_record: a session is already being recorded\n");
+		return -1;
+	}
+	free(rec_fname);
+	if(!(rec_fname = strdup(fname))) {
+		return -1;
+	}
+	return 0;
+}
+
+int ser_replay(const char *fname, unsigned int mode)
+{
+	if(rp_data) {
+		fprintf(stderr, "ser_replay: a recording is already being played back\n");
+		return -1;
+	}
+	free(rp_fname);
+	if(!(rp_fname = strdup(fname))) {
+		return -1;
+	}
+	rp_mode = mode;
+	return 0;
+}
 
 int ser_open(const char *port, int baud, unsigned int mode)
 {
 	int fd;
 	struct termios term;
 
+	/* a recording to play back stands in for this device only */
+	if(rp_fname) {
+		fd = open_replay();
+		free(rp_fname);
+		rp_fname = 0;
+		return fd;
+	}
+
 	if((baud = baud_id(baud)) == -1) {
 		fprintf(stderr, "ser_open: invalid baud number: %d\n", baud);
 		return -1;
@@ -88,21 +163,49 @@ int ser_open(const char *port, int baud, unsigned int mode)
 	}
 #endif
 
+	/* and only this device is recorded */
+	if(rec_fname) {
+		if(!(rec_fp = fopen(rec_fname, "wb"))) {
+			fprintf(stderr, "ser_open: failed to create recording: %s: %s\n", rec_fname, strerror(errno));
+			close(fd);
+			fd = -1;
+		} else {
+			fwrite(REC_MAGIC, 1, REC_MAGIC_LEN, rec_fp);
+			rec_fd = fd;
+			rec_last = get_usec();
+		}
+		free(rec_fname);
+		rec_fname = 0;
+	}
 	return fd;
 }
 
 void ser_close(int fd)
 {
+	if(fd == rp_fd) {
+		free(rp_data);
+		rp_data = 0;
+		rp_fd = -1;
+	}
+	if(fd == rec_fd) {
+		if(fclose(rec_fp) == -1) {
+			fprintf(stderr, "ser_close: failed to write the recording: %s\n", strerror(errno));
+		}
+		rec_fp = 0;
+		rec_fd = -1;
+	}
 	close(fd);
 }
 
 int ser_block(int fd)
 {
+	if(fd == rp_fd) return 0;
 	return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
 }
 
 int ser_nonblock(int fd)
 {
+	if(fd == rp_fd) return 0;
 	return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 }
 
@@ -111,6 +214,10 @@ int ser_pending(int fd)
 	static struct timeval tv_zero;
 	fd_set rd;
 
+	if(fd == rp_fd) {
+		return replay_ready();
+	}
+
 	FD_ZERO(&rd);
 	FD_SET(fd, &rd);
 
@@ -122,6 +229,23 @@ int ser_wait(int fd, long msec)
 {
 	struct timeval tv, tv0;
 	fd_set rd;
+	long usec;
+
+	if(fd == rp_fd) {
+		/* nothing more to come before the host writes something, or at all,
+		 * is a timeout, which is immediate when replaying fast
+		 */
+		if((usec = replay_wait_usec()) < 0 || (msec >= 0 && usec > msec * 1000)) {
+			if(!(rp_mode & SER_REPLAY_FAST) && msec > 0) {
+				usleep(msec * 1000);
+			}
+			return 0;
+		}
+		if(usec > 0) {
+			usleep(usec);
+		}
+		return 1;
+	}
 
 	FD_ZERO(&rd);
 	FD_SET(fd, &rd);
@@ -148,21 +272,55 @@ int ser_wait(int fd, long msec)
 
 int ser_write(int fd, const void *buf, int count)
 {
-	return write(fd, buf, count);
+	int res;
+
+	if(fd == rp_fd) {
+		replay_written(buf, count);
+		return count;
+	}
+	if((res = write(fd, buf, count)) > 0 && fd == rec_fd) {
+		rec_log(REC_WRITE, buf, res);
+	}
+	return res;
 }
 
 int ser_read(int fd, void *buf, int count)
 {
-	return read(fd, buf, count);
+	int res;
+
+	if(fd == rp_fd) {
+		if(!replay_ready()) {
+			errno = EAGAIN;
+			return -1;
+		}
+		/* never past the end of the recorded chunk */
+		if(count > rp_len - rp_used) {
+			count = rp_len - rp_used;
+		}
+		memcpy(buf, rp_data + rp_pos + REC_HDR_SIZE + rp_used, count);
+		rp_used += count;
+		return count;
+	}
+	if((res = read(fd, buf, count)) > 0 && fd == rec_fd) {
+		rec_log(REC_READ, buf, res);
+	}
+	return res;
 }
 
 void ser_printf(int fd, const char *fmt, ...)
 {
 	va_list ap;
+	char buf[512];
+	int len;
 
 	va_start(ap, fmt);
-	vdprintf(fd, fmt, ap);
+	len = vsnprintf(buf, sizeof buf, fmt, ap);
 	va_end(ap);
+
+	if(len >= (int)sizeof buf) {
+		len = sizeof buf - 1;
+	}
+	ser_write(fd, buf, len);
 }
 
 char *ser_getline(int fd, char *buf, int bsz)
@@ -172,7 +330,7 @@ char *ser_getline(int fd, char *buf, int bsz)
 	int i, rd, size, offs;
 
 	size = sizeof linebuf - widx;
-	while(size && (rd = read(fd, linebuf + widx, size)) > 0) {
+	while(size && (rd = ser_read(fd, linebuf + widx, size)) > 0) {
 		widx += rd;
 		size -= rd;
 	}
@@ -194,6 +352,154 @@ char *ser_getline(int fd, char *buf, int bsz)
 	return 0;
 }
 
+static void rec_log(int dir, const void *buf, int count)
+{
+	unsigned char hdr[REC_HDR_SIZE];
+	long long now = get_usec();
+
+	hdr[0] = dir;
+	put32(hdr + 1, now - rec_last);
+	put32(hdr + 5, count);
+	rec_last = now;
+
+	fwrite(hdr, 1, sizeof hdr, rec_fp);
+	fwrite(buf, 1, count, rec_fp);
+}
+
+static int open_replay(void)
+{
+	int fd;
+	struct stat st;
+
+	if((fd = open(rp_fname, O_RDONLY)) == -1) {
+		fprintf(stderr, "ser_open: failed to open recording: %s: %s\n", rp_fname, strerror(errno));
+		return -1;
+	}
+	fstat(fd, &st);
+
+	if(!(rp_data = malloc(st.st_size + 1)) || read(fd, rp_data, st.st_size) != st.st_size ||
+			st.st_size < REC_MAGIC_LEN || memcmp(rp_data, REC_MAGIC, REC_MAGIC_LEN) != 0) {
+		fprintf(stderr, "ser_open: %s is not a serial session recording\n", rp_fname);
+		free(rp_data);
+		rp_data = 0;
+		close(fd);
+		return -1;
+	}
+	rp_size = st.st_size;
+	rp_pos = -1;
+	rp_time = 0;
+	rp_skew = get_usec();
+	rp_diverged = 0;
+	rp_fd = fd;
+
+	next_record();
+	return fd;
+}
+
+/* whether the current record is data which has come in by now */
+static int replay_ready(void)
+{
+	return replay_wait_usec() == 0;
+}
+
+/* how long until the current record comes in, or -1 if it's not data from the
+ * device, or there's nothing left
+ */
+static long replay_wait_usec(void)
+{
+	long long now;
+
+	next_record();
+	if(rp_dir != REC_READ) {
+		return -1;
+	}
+	if(rp_mode & SER_REPLAY_FAST) {
+		return 0;
+	}
+	now = get_usec();
+	return now >= rp_time + rp_skew ? 0 : rp_time + rp_skew - now;
+}
+
+/* matches what the host writes against the recording, moving past the reads
+ * it didn't take in the meantime, and synchronizes the timing to it
+ */
+static void replay_written(const void *buf, int count)
+{
+	int sz;
+	const unsigned char *ptr = buf;
+
+	while(count > 0) {
+		while(rp_dir == REC_READ) {
+			next_record();
+		}
+		if(rp_dir != REC_WRITE) {
+			break;
+		}
+
+		sz = rp_len - rp_used < count ? rp_len - rp_used : count;
+		if(!rp_diverged && memcmp(ptr, rp_data + rp_pos + REC_HDR_SIZE + rp_used, sz) != 0) {
+			fprintf(stderr, "replay: the host diverges from the recording at offset %ld\n",
+					rp_pos + REC_HDR_SIZE + rp_used);
+			rp_diverged = 1;
+		}
+		rp_used += sz;
+		ptr += sz;
+		count -= sz;
+
+		if(rp_used >= rp_len) {
+			rp_skew = get_usec() - rp_time;
+			next_record();
+		}
+	}
+}
+
+/* moves on to the next record, if the current one is used up */
+static int next_record(void)
+{
+	unsigned char *hdr;
+
+	if(rp_pos >= 0 && rp_used < rp_len) {
+		return 0;
+	}
+	rp_pos = rp_pos < 0 ? REC_MAGIC_LEN : rp_pos + REC_HDR_SIZE + rp_len;
+	rp_used = 0;
+
+	if(rp_pos + REC_HDR_SIZE > rp_size) {
+		rp_dir = rp_len = 0;
+		return -1;
+	}
+	hdr = rp_data + rp_pos;
+	rp_dir = hdr[0];
+	rp_time += get32(hdr + 1);
+	rp_len = get32(hdr + 5);
+
+	if(rp_pos + REC_HDR_SIZE + rp_len > rp_size) {
+		rp_dir = rp_len = 0;
+		return -1;
+	}
+	return 0;
+}
+
+static long long get_usec(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
 static int baud_id(int baud)
 {
 	switch(baud) {
@@ -0,0 +1,156 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "vote.h"
+
+/* bounds the memory a disk full of bad sectors can take */
+#define MAX_SECTORS		256
+
+struct vote_sector {
+	int trk, sec, ncopies;
+	unsigned char copy[VOTE_MAX_COPIES][VOTE_SIZE];
+	unsigned char weak[VOTE_MAX_COPIES][VOTE_SIZE];
+	struct vote_sector *next;
+};
+
+struct vote_store {
+	struct vote_sector *list;
+	int nsectors;
+};
+
+static struct vote_sector *find_sector(struct vote_store *vs, int trk, int sec);
+
+struct vote_store *vote_create(void)
+{
+	return calloc(1, sizeof(struct vote_store));
+}
+
+void vote_free(struct vote_store *vs)
+{
+	struct vote_sector *vsec;
+
+	if(!vs) return;
+
+	while(vs->list) {
+		vsec = vs->list;
+		vs->list = vs->list->next;
+		free(vsec);
+	}
+	free(vs);
+}
+
+int vote_add(struct vote_store *vs, int trk, int sec, const unsigned char *mfm,
+		const unsigned char *weak)
+{
+	struct vote_sector *vsec;
+
+	if(!(vsec = find_sector(vs, trk, sec))) {
+		if(vs->nsectors >= MAX_SECTORS || !(vsec = malloc(sizeof *vsec))) {
+			return -1;
+		}
+		vsec->trk = trk;
+		vsec->sec = sec;
+		vsec->ncopies = 0;
+		vsec->next = vs->list;
+		vs->list = vsec;
+		vs->nsectors++;
+	}
+
+	if(vsec->ncopies >= VOTE_MAX_COPIES) {
+		return -1;
+	}
+	memcpy(vsec->copy[vsec->ncopies], mfm, VOTE_SIZE);
+	if(weak) {
+		memcpy(vsec->weak[vsec->ncopies], weak, VOTE_SIZE);
+	} else {
+		memset(vsec->weak[vsec->ncopies], 0, VOTE_SIZE);
+	}
+	vsec->ncopies++;
+	return 0;
+}
+
+int vote_copies(struct vote_store *vs, int trk, int sec)
+{
+	struct vote_sector *vsec = find_sector(vs, trk, sec);
+	return vsec ? vsec->ncopies : 0;
+}
+
+int vote_majority(struct vote_store *vs, int trk, int sec, unsigned char *mfm,
+		unsigned char *weak, int *disputed, int *narrow)
+{
+	int i, j, k, ones, margin, n;
+	unsigned char bit;
+	struct vote_sector *vsec;
+
+	*disputed = *narrow = 0;
+	if(weak) {
+		memset(weak, 0, VOTE_SIZE);
+	}
+
+	if(!(vsec = find_sector(vs, trk, sec))) {
+		return 0;
+	}
+	n = vsec->ncopies;
+
+	for(i=0; i<VOTE_SIZE; i++) {
+		mfm[i] = 0;
+		if(weak) {
+			for(k=0; k<n; k++) {
+				weak[i] |= vsec->weak[k][i];
+			}
+		}
+		for(j=0; j<8; j++) {
+			bit = 0x80 >> j;
+
+			ones = 0;
+			for(k=0; k<n; k++) {
+				if(vsec->copy[k][i] & bit) ones++;
+			}
+
+			if(ones * 2 > n || (ones * 2 == n && (vsec->copy[0][i] & bit))) {
+				mfm[i] |= bit;
+			}
+
+			if(ones && ones < n) {
+				(*disputed)++;
+				margin = ones * 2 - n;
+				if(margin >= -2 && margin <= 2) {
+					(*narrow)++;
+					if(weak) {
+						weak[i] |= bit;
+					}
+				}
+			}
+		}
+	}
+	return n;
+}
+
+static struct vote_sector *find_sector(struct vote_store *vs, int trk, int sec)
+{
+	struct vote_sector *vsec = vs->list;
+
+	while(vsec) {
+		if(vsec->trk == trk && vsec->sec == sec) {
+			return vsec;
+		}
+		vsec = vsec->next;
+	}
+	return 0;
+}
@@ -0,0 +1,55 @@
+/*
+amigafloppy - driver for the USB floppy controller for amiga disks
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VOTE_H_
+#define VOTE_H_
+
+/* Sectors which fail their data checksum on every read may still be
+ * recovered from several bad copies, as long as the bad bits are not the
+ * same ones every time: the copies are aligned at the sync mark already, so
+ * each bit is decided by a majority of the copies.
+ *
+ * A copy is the raw MFM of a sector from its data checksum to the end of its
+ * data, which covers everything the vote needs: a bad data checksum field is
+ * as likely as bad data.
+ */
+#define VOTE_SIZE		1032
+#define VOTE_MAX_COPIES	15
+
+struct vote_store;
+
+struct vote_store *vote_create(void);
+void vote_free(struct vote_store *vs);
+
+/* adds a copy of a sector, with an optional bitmap of its weak bits, as from
+ * pll_decode. Returns -1 if there's no room for it.
+ */
+int vote_add(struct vote_store *vs, int trk, int sec, const unsigned char *mfm,
+		const unsigned char *weak);
+/* number of copies of a sector */
+int vote_copies(struct vote_store *vs, int trk, int sec);
+
+/* Builds the bitwise majority of the copies of a sector to mfm (VOTE_SIZE
+ * bytes), with ties going to the first copy. Sets disputed to the number of
+ * bits the copies didn't all agree on, and narrow to those decided by a
+ * single vote. Those are set in the weak bitmap (VOTE_SIZE bytes), if given,
+ * along with the weak bits of each copy. Returns the number of copies.
+ */
+int vote_majority(struct vote_store *vs, int trk, int sec, unsigned char *mfm,
+		unsigned char *weak, int *disputed, int *narrow);
+
+#endif	/* VOTE_H_ */
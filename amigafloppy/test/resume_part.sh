@@ -0,0 +1,56 @@
+#!/bin/sh
+# --resume must keep the partial image of the earlier runs when the read can't
+# even start. Replays a session where the drive refuses to start reading.
+
+bin=${1:-./amigafloppy}
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+fail=0
+
+# serial session recording: direction, usec since the last record and
+# length (32-bit big endian), and the data
+rec() {
+	printf "%s\\000\\000\\000\\000\\000\\000\\000\\$(printf %03o ${#2})%s" "$1" "$2"
+}
+{
+	printf 'AFLSER1\n'
+	rec '>' '?'
+	rec '<' '1'
+	rec '<' 'V1.0'
+	rec '>' '+'
+	rec '<' '0'
+} >"$tmp/norun.rec"
+
+secmap() {
+	echo '# amigafloppy sector map: track, bitmask of valid sectors'
+	i=0
+	while [ $i -lt 160 ]; do
+		printf '%03d %03x\n' $i $((i < 80 ? 0x7ff : 0))
+		i=$((i + 1))
+	done
+}
+
+for img in disk.adf disk.adz; do
+	head -c 901120 /dev/urandom >"$tmp/data"
+	case $img in
+	*.adz)	gzip -c "$tmp/data" >"$tmp/$img.part";;
+	*)		cp "$tmp/data" "$tmp/$img.part";;
+	esac
+	secmap >"$tmp/$img.secmap"
+
+	"$bin" --replay-fast "$tmp/norun.rec" --resume "$tmp/$img" >/dev/null 2>&1
+
+	if [ ! -f "$tmp/$img.part" ]; then
+		echo "FAIL: $img: --resume removed the partial image"
+		fail=1
+	elif ! gzip -dcf "$tmp/$img.part" | cmp -s - "$tmp/data"; then
+		echo "FAIL: $img: --resume changed the partial image"
+		fail=1
+	elif [ ! -f "$tmp/$img.secmap" ]; then
+		echo "FAIL: $img: --resume removed the sector map"
+		fail=1
+	else
+		echo "ok: $img"
+	fi
+done
+exit $fail
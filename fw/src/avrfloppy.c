@@ -71,6 +71,73 @@
  * Paula assumed it was 12868 bytes, so we read that, plus thre size of a sectors
  */
 #define RAW_TRACKDATA_LENGTH   (0x1900 * 2 + 0x440)
+/* HD disks have 22 sectors, and twice as much data in one revolution */
+#define RAW_TRACKDATA_LENGTH_HD	(0x3200 * 2 + 0x880)
+
+/* Timer2 thresholds between the 4, 6 and 8us pulse intervals of DD disks, and
+ * the 2, 3 and 4us intervals of HD disks, at 16MHz
+ */
+#define DD_SHORT_MAX	80
+#define DD_LONG_MIN		111
+#define HD_SHORT_MAX	40
+#define HD_LONG_MIN		55
+
+/* head stepping: the default interval between step pulses, and time for the
+ * head to settle after a seek, in milliseconds, and the limits the "T"
+ * command accepts for them
+ */
+#define STEP_MS_DEFAULT		10
+#define SETTLE_MS_DEFAULT	100
+#define STEP_MS_MIN			2
+#define STEP_MS_MAX			40
+
+/* capture modes for the "D" command */
+#define MODE_DD		0
+#define MODE_HD		1
+
+/* highest cylinder we'll seek to: some disks use up to 83 */
+#define MAX_TRACK	83
+
+/* flags in the byte following the "<" command */
+#define READ_WAIT_INDEX	0x01
+#define READ_TRAILER	0x02
+#define READ_TERNARY	0x04
+#define READ_ABORTABLE	0x08
+#define READ_FLUX		0x10
+
+/* With READ_ABORTABLE, the other end may send this during a read to have it
+ * end early, once it has what it needs. If it arrives too late, the main loop
+ * sees it as a command, and ignores it.
+ */
+#define READ_ABORT		'A'
+
+/* With READ_TERNARY, the three pulse intervals are packed as base-3 digits, 5
+ * to a byte (3^5 = 243) instead of 4 two-bit codes, for 20% less to send.
+ * Bytes above 242 are free, and 0xff is used as the end of data.
+ */
+#define TERNARY_END		0xff
+
+/* With READ_FLUX, the pulse intervals themselves are sent instead, two 4-bit
+ * values to a byte, high nibble first. Each is the interval in quarters of a
+ * bit cell (0.5us for DD, 0.25us for HD) minus FLUX_BIAS, clamped to 1-15, so
+ * the nominal intervals of 2, 3 and 4 cells come out as 5, 9 and 13. A zero
+ * nibble ends the data, and a zero byte follows it.
+ */
+#define FLUX_BIAS		3
+#define FLUX_MAX		15
+
+/* Timer2 overflows every 16us while counting pulses. A read gives up after
+ * this many overflows without a pulse in total (about 16ms), or waiting for
+ * the index pulse for more than about a second.
+ */
+#define NOFLUX_OVERFLOWS	1024
+#define INDEX_OVERFLOWS		62500
+
+/* read status, the last byte of the trailer */
+#define STATUS_OK		0
+#define STATUS_NO_FLUX	1
+#define STATUS_NO_INDEX	2
+#define STATUS_ABORTED	3
 
 static void setup(void);
 static void loop(void);
@@ -84,11 +151,27 @@ static int goto_track_x(void);
 static void write_track_from_uart(void);
 static void erase_track(void);
 static void read_track_data_fast(void);
+static void read_flux_data(long target, unsigned char flags);
+static void init_flux_table(void);
+static int wait_read_index(void);
+static void end_read(unsigned char endmark, unsigned char flags, unsigned int count,
+		unsigned int sum, unsigned int overruns, unsigned char status);
+static inline void read_track_data(long target, unsigned char short_max, unsigned char long_min,
+		unsigned char flags, const unsigned char ternary) __attribute__((always_inline));
+static void write_word_to_uart(unsigned int value);
+static unsigned int measure_revolution(void);
+static int wait_index(unsigned char *ovf);
 static void run_diagnostic(void);
 
 static int current_track; /* The current track that the head is over */
 static int drive_enabled; /* If the drive has been switched on or not */
 static int in_write_mode; /* If we're in WRITING mode or not */
+static unsigned char capture_mode; /* MODE_DD or MODE_HD */
+/* Timer2 count to flux nibble, for the current capture mode */
+static unsigned char flux_table[256];
+/* pulse interval thresholds for the current capture mode, see "C" */
+static unsigned char short_max = DD_SHORT_MAX, long_min = DD_LONG_MIN;
+static unsigned char step_ms = STEP_MS_DEFAULT, settle_ms = SETTLE_MS_DEFAULT;
 
 int main(void)
 {
@@ -118,13 +201,15 @@ static void setup(void)
 
 	/* Setup the USART */
 	prep_serial_interface();
+
+	init_flux_table();
 }
 
 
 /* The main command loop */
 static void loop(void)
 {
-	unsigned char command;
+	unsigned char command, mode;
 
 	CTS_PORT &= ~CTS_BIT;		/* Allow data incoming */
 	WGATE_PORT |= WGATE_BIT;   /* always turn writing off */
@@ -137,9 +222,54 @@ static void loop(void)
 		/* Command: "?" Means information about the firmware */
 		write_byte_to_uart('1');  /* Success */
 		write_byte_to_uart('V');  /* Followed */
-		write_byte_to_uart('1');  /* By */
+		write_byte_to_uart('2');  /* By */
 		write_byte_to_uart('.');  /* Version */
-		write_byte_to_uart('3');  /* Number */
+		write_byte_to_uart('0');  /* Number */
+		break;
+
+	case 'D':
+		/* Command "D" followed by the capture mode: DD or HD timings and length */
+		mode = read_byte_from_uart();
+		if(mode == MODE_DD || mode == MODE_HD) {
+			capture_mode = mode;
+			short_max = mode == MODE_HD ? HD_SHORT_MAX : DD_SHORT_MAX;
+			long_min = mode == MODE_HD ? HD_LONG_MIN : DD_LONG_MIN;
+			init_flux_table();
+			write_byte_to_uart('1');
+		} else {
+			write_byte_to_uart('0');
+		}
+		break;
+
+	case 'C':
+		/* Command "C" followed by the Timer2 thresholds between the short and
+		 * medium, and the medium and long pulse intervals, for drives which
+		 * don't spin at quite the nominal speed. "D" resets them.
+		 */
+		mode = read_byte_from_uart();
+		command = read_byte_from_uart();
+		if(mode && mode < command) {
+			short_max = mode;
+			long_min = command;
+			write_byte_to_uart('1');
+		} else {
+			write_byte_to_uart('0');
+		}
+		break;
+
+	case 'T':
+		/* Command "T" followed by the step interval and the settle time after
+		 * a seek, in milliseconds, for drives which can go faster
+		 */
+		mode = read_byte_from_uart();
+		command = read_byte_from_uart();
+		if(mode >= STEP_MS_MIN && mode <= STEP_MS_MAX) {
+			step_ms = mode;
+			settle_ms = command;
+			write_byte_to_uart('1');
+		} else {
+			write_byte_to_uart('0');
+		}
 		break;
 
 		/* Command "." means go back to track 0 */
@@ -163,7 +293,7 @@ static void loop(void)
 			write_byte_to_uart('0');
 		} else {
 			if(goto_track_x()) {
-				smalldelay(100); /* wait for drive */
+				smalldelay(settle_ms); /* wait for drive */
 				write_byte_to_uart('1');
 			} else {
 				write_byte_to_uart('0');
@@ -183,6 +313,27 @@ static void loop(void)
 		write_byte_to_uart('1');
 		break;
 
+	case READ_ABORT:
+		/* a read abort that came after the read had finished anyway */
+		break;
+
+	case 'R':
+		/* Command "R" measures one revolution: replies with the time between
+		 * two index pulses in 4us units, or fails if there are none
+		 */
+		if(!drive_enabled) {
+			write_byte_to_uart('0');
+		} else {
+			unsigned int period = measure_revolution();
+			if(period) {
+				write_byte_to_uart('1');
+				write_word_to_uart(period);
+			} else {
+				write_byte_to_uart('0');
+			}
+		}
+		break;
+
 	case '<':
 		/* Command "<" Read track from the drive */
 		if(!drive_enabled) {
@@ -301,12 +452,12 @@ static void smalldelay(unsigned long delay_time)
 	}
 }
 
-/* Step the head once.  This seems to be an acceptable speed for the head */
+/* Step the head once, at the interval set with "T" */
 static void step_direction_head(void)
 {
-	smalldelay(5);
+	smalldelay(step_ms >> 1);
 	MOTOR_PORT &= ~MOTOR_STEP_BIT;
-	smalldelay(5);
+	smalldelay(step_ms - (step_ms >> 1));
 	MOTOR_PORT |= MOTOR_STEP_BIT;
 }
 
@@ -344,6 +495,13 @@ static inline void write_byte_to_uart(const char value)
 	UDR0 = value;
 }
 
+/* Writes a 16bit value to the UART0, MSB first */
+static void write_word_to_uart(unsigned int value)
+{
+	write_byte_to_uart(value >> 8);
+	write_byte_to_uart(value & 0xff);
+}
+
 /* Rewinds the head back to track 0 */
 static int goto_track0(void)
 {
@@ -384,7 +542,7 @@ static int goto_track_x(void)
 	/* Calculate target track and validate */
 	track = ((track1 - '0') * 10) + (track2 - '0');
 	if(track < 0) return 0;
-	if(track > 81) return 0; /* yes amiga could read track 81! */
+	if(track > MAX_TRACK) return 0; /* yes amiga could read track 81, and some disks go further */
 
 	/* Exit if its already been reached */
 	if(track == current_track) return 1;
@@ -616,11 +774,46 @@ static void erase_track(void)
 }
 
 
-/* Read the track using a timings to calculate which MFM sequence has been triggered */
+/* Read the track using a timings to calculate which MFM sequence has been triggered.
+ * The loop is instantiated separately for each capture mode, so that the
+ * thresholds and length are constants: there's no time to spare per pulse,
+ * especially with HD disks.
+ */
 static void read_track_data_fast(void)
 {
-	unsigned char data_output_byte, counter, bits;
-	long total_bits, target;
+	unsigned char flags = read_byte_from_uart();
+
+	/* the length is in quarter cells for flux reads */
+	if(flags & READ_FLUX) {
+		if(capture_mode == MODE_HD) {
+			read_flux_data((long)RAW_TRACKDATA_LENGTH_HD * 32L, flags);
+		} else {
+			read_flux_data((long)RAW_TRACKDATA_LENGTH * 32L, flags);
+		}
+		return;
+	}
+
+	if(capture_mode == MODE_HD) {
+		if(flags & READ_TERNARY) {
+			read_track_data((long)RAW_TRACKDATA_LENGTH_HD * 8L, short_max, long_min, flags, 1);
+		} else {
+			read_track_data((long)RAW_TRACKDATA_LENGTH_HD * 8L, short_max, long_min, flags, 0);
+		}
+	} else {
+		if(flags & READ_TERNARY) {
+			read_track_data((long)RAW_TRACKDATA_LENGTH * 8L, short_max, long_min, flags, 1);
+		} else {
+			read_track_data((long)RAW_TRACKDATA_LENGTH * 8L, short_max, long_min, flags, 0);
+		}
+	}
+}
+
+static inline void read_track_data(long target, unsigned char short_max, unsigned char long_min,
+		unsigned char flags, const unsigned char ternary)
+{
+	unsigned char data_output_byte, counter, bits, status = STATUS_OK;
+	unsigned int count, sum, overruns, ovf;
+	long total_bits;
 
 	/* Configure timer 2 just as a counter in NORMAL mode */
 	TCCR2A = 0;			/* No physical output port pins and normal operation */
@@ -632,49 +825,195 @@ static void read_track_data_fast(void)
 	/* Signal we're active */
 	LED_PORT |= LED_BIT;
 
+	total_bits = 0;
+	count = sum = overruns = 0;
+
 	/* While the INDEX pin is high wait if the other end requires us to */
-	if(read_byte_from_uart()) {
-		while(INDEX_PORT & INDEX_BIT);
+	if((flags & READ_WAIT_INDEX) && wait_read_index() == -1) {
+		status = STATUS_NO_INDEX;
+		goto end;
 	}
 
 	/* Prepare the two counter values as follows: */
 	TCNT2=0;	   /* Reset the counter */
-
-	data_output_byte = 0;
-	total_bits = 0;
-	target = (long)RAW_TRACKDATA_LENGTH * 8L;
+	TIFR2 = 1 << TOV2;
+	ovf = NOFLUX_OVERFLOWS;
 
 	while(total_bits < target) {
-		for(bits=0; bits<4; bits++) {
-			/* Wait while pin is high */
-
-			while(RDATA_PORT & RDATA_BIT);
+		data_output_byte = 0;
+		for(bits=0; bits<(ternary ? 5 : 4); bits++) {
+			/* Wait while pin is high. The counter only overflows when
+			 * there's no flux at all, so checking for it is cheap enough.
+			 */
+			while(RDATA_PORT & RDATA_BIT) {
+				if(TIFR2 & (1 << TOV2)) {
+					TIFR2 = 1 << TOV2;
+					if(!--ovf) {
+						status = STATUS_NO_FLUX;
+						goto end;
+					}
+				}
+			}
 			counter = TCNT2;
 			TCNT2 = 0;  /* reset */
 
-			data_output_byte <<= 2;
+			/* the symbols are 1, 2, 3 as two-bit codes, or 0, 1, 2 as digits */
+			if(ternary) {
+				data_output_byte *= 3;
+			} else {
+				data_output_byte = (data_output_byte << 2) + 1;
+			}
 
-			if(counter < 80) {
-				data_output_byte |= 1;
+			if(counter < short_max) {
 				total_bits += 2;
-			} else if(counter > 111) {
+			} else if(counter > long_min) {
 				/* this accounts for just a '1' or a '01' as two '1' arent allowed in a row */
-				data_output_byte |= 3;
+				data_output_byte += 2;
 				total_bits += 4;
 			} else {
-				data_output_byte |= 2;
+				data_output_byte += 1;
 				total_bits += 3;
 			}
 
 			/* Wait until pin is high again */
 			while(!(RDATA_PORT & RDATA_BIT));
 		}
+		/* there's no time to wait for the UART here: if the previous byte
+		 * is still pending, this one is lost, so at least keep count
+		 */
+		if(!(UCSR0A & (1 << UDRE0))) {
+			overruns++;
+		}
 		UDR0 = data_output_byte;
+		count++;
+		sum += data_output_byte;
+
+		if((flags & READ_ABORTABLE) && (UCSR0A & (1 << RXC0))) {
+			read_byte_from_uart();
+			status = STATUS_ABORTED;
+			break;
+		}
 	}
+end:
 	/* Because of the above rules the actual valid two-bit sequences output
 	 * are 01, 10 and 11, so we use 00 to say "END OF DATA"
 	 */
-	write_byte_to_uart(0);
+	end_read(ternary ? TERNARY_END : 0, flags, count, sum, overruns, status);
+}
+
+/* Like read_track_data, but sending the quantized pulse intervals (see
+ * READ_FLUX), for the other end to decode with a PLL of its own. Two intervals
+ * of at least 2 cells make a byte, so this keeps up with the UART for DD.
+ * target is in quarter cells.
+ */
+static void read_flux_data(long target, unsigned char flags)
+{
+	unsigned char data_output_byte, nibble, half, status = STATUS_OK;
+	unsigned int count, sum, overruns, ovf;
+	long total;
+
+	TCCR2A = 0;
+	TCCR2B = (1 << CS20);	/* Prescale = 1 */
+
+	while(!(UCSR0A & (1 << UDRE0)));
+	LED_PORT |= LED_BIT;
+
+	total = 0;
+	count = sum = overruns = 0;
+
+	if((flags & READ_WAIT_INDEX) && wait_read_index() == -1) {
+		status = STATUS_NO_INDEX;
+		goto end;
+	}
+
+	TCNT2 = 0;
+	TIFR2 = 1 << TOV2;
+	ovf = NOFLUX_OVERFLOWS;
+
+	while(total < target) {
+		data_output_byte = 0;
+		for(half=0; half<2; half++) {
+			while(RDATA_PORT & RDATA_BIT) {
+				if(TIFR2 & (1 << TOV2)) {
+					TIFR2 = 1 << TOV2;
+					if(!--ovf) {
+						status = STATUS_NO_FLUX;
+						goto end;
+					}
+				}
+			}
+			nibble = flux_table[TCNT2];
+			TCNT2 = 0;
+
+			data_output_byte = (data_output_byte << 4) | nibble;
+			total += nibble + FLUX_BIAS;
+
+			while(!(RDATA_PORT & RDATA_BIT));
+		}
+		if(!(UCSR0A & (1 << UDRE0))) {
+			overruns++;
+		}
+		UDR0 = data_output_byte;
+		count++;
+		sum += data_output_byte;
+
+		if((flags & READ_ABORTABLE) && (UCSR0A & (1 << RXC0))) {
+			read_byte_from_uart();
+			status = STATUS_ABORTED;
+			break;
+		}
+	}
+end:
+	end_read(0, flags, count, sum, overruns, status);
+}
+
+/* fills the flux table for the capture mode: Timer2 counts 16 ticks per us,
+ * so a quarter cell is 8 ticks for DD, and 4 for HD
+ */
+static void init_flux_table(void)
+{
+	int i, q, shift = capture_mode == MODE_HD ? 2 : 3;
+
+	for(i=0; i<256; i++) {
+		q = ((i + (1 << (shift - 1))) >> shift) - FLUX_BIAS;
+		if(q < 1) q = 1;
+		if(q > FLUX_MAX) q = FLUX_MAX;
+		flux_table[i] = q;
+	}
+}
+
+/* waits while the index pin is high, for up to about a second */
+static int wait_read_index(void)
+{
+	unsigned int ovf = INDEX_OVERFLOWS;
+
+	TIFR2 = 1 << TOV2;
+	while(INDEX_PORT & INDEX_BIT) {
+		if(TIFR2 & (1 << TOV2)) {
+			TIFR2 = 1 << TOV2;
+			if(!--ovf) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Ends a read with the end of data marker, and then, if asked for, the number
+ * of bytes sent, their sum, and how many were lost, for the other end to tell
+ * link errors from bad media, and whether the read was cut short
+ */
+static void end_read(unsigned char endmark, unsigned char flags, unsigned int count,
+		unsigned int sum, unsigned int overruns, unsigned char status)
+{
+	write_byte_to_uart(endmark);
+
+	if(flags & READ_TRAILER) {
+		write_word_to_uart(count);
+		write_word_to_uart(sum);
+		write_word_to_uart(overruns);
+		write_byte_to_uart(status);
+	}
 
 	/* turn off the status LED */
 	LED_PORT &= ~LED_BIT;
@@ -683,6 +1022,52 @@ static void read_track_data_fast(void)
 	TCCR2B = 0;	  /* No Clock (turn off) */
 }
 
+/* Measures the time between two index pulses with timer 1, in 4us units.
+ * Returns 0 if there are no index pulses, or they're too far apart.
+ */
+static unsigned int measure_revolution(void)
+{
+	unsigned char ovf;
+	unsigned int period = 0;
+
+	TCCR1A = 0;
+	TCCR1B = (1 << CS11) | (1 << CS10);	/* Prescale = 64 */
+	TIFR1 = 1 << TOV1;
+
+	ovf = 4;	/* about a second to find the first one */
+	if(wait_index(&ovf) != -1) {
+		TCNT1 = 0;
+		TIFR1 = 1 << TOV1;
+		ovf = 1;	/* and up to 262ms for the next */
+		if(wait_index(&ovf) != -1) {
+			period = TCNT1;
+		}
+	}
+
+	TCCR1B = 0;	/* No Clock (turn off) */
+	return period;
+}
+
+/* Waits for the start of the next index pulse, or until timer 1 has
+ * overflowed ovf times
+ */
+static int wait_index(unsigned char *ovf)
+{
+	unsigned char level = INDEX_BIT;
+
+	/* high first, then the falling edge */
+	for(;;) {
+		if((INDEX_PORT & INDEX_BIT) == level) {
+			if(!level) return 0;
+			level = 0;
+		}
+		if(TIFR1 & (1 << TOV1)) {
+			TIFR1 = 1 << TOV1;
+			if(!--*ovf) return -1;
+		}
+	}
+}
+
 static void run_diagnostic(void)
 {
 	int i, state1, state2, res;